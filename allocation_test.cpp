@@ -0,0 +1,152 @@
+#include "stream.h"
+#include <cassert>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <malloc.h>
+#include <new>
+#include <string>
+
+// counts every heap allocation made while counting_ is on so the xadd path
+// can be checked for copies. replacing the global operator new is the only
+// way to see allocations inside std::map and std::string. live_bytes_ is
+// what's allocated right now, what malloc actually handed out for each.
+static std::atomic<bool> counting_{false};
+static std::atomic<size_t> allocations_{0};
+static std::atomic<long long> live_bytes_{0};
+
+void *operator new(size_t size) {
+    if (counting_) allocations_++;
+    if (void *p = std::malloc(size ? size : 1)) {
+        live_bytes_ += malloc_usable_size(p);
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    if (p) live_bytes_ -= malloc_usable_size(p);
+    std::free(p);
+}
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+
+// long enough to be past the small string buffer so copying them allocates
+static FieldsStructure long_entry(long long i) {
+    std::string padding(40, 'x');
+    return {{"sensor_name_long_enough_" + std::to_string(i % 10), padding + std::to_string(i)},
+            {"reading_also_long_enough", padding + std::to_string(i * 3)}};
+}
+
+// allocations made by n xadds, the entries are built before counting starts
+// so only what xadd itself allocates shows up
+template <typename Add>
+static size_t count_xadds(redisStream &stream, long long n, Add add) {
+    std::vector<FieldsStructure> entries;
+    entries.reserve(n);
+    for (long long i = 0; i < n; ++i) entries.push_back(long_entry(i));
+    allocations_ = 0;
+    counting_ = true;
+    for (auto &entry : entries) add(stream, entry);
+    counting_ = false;
+    return allocations_;
+}
+
+// moving the fields in costs the map node and nothing per field, copying
+// costs the vector and all four strings on top. block_entries 0 keeps
+// sealing out of it, that's amortized and the same either way.
+void test_xadd_moves_fields_in() {
+    const long long n = 10000;
+    streamConfig config;
+    config.block_entries = 0;
+    redisStream copied(config), moved(config);
+    copied.xadd("s", long_entry(0));
+    moved.xadd("s", long_entry(0));
+    size_t copy_allocs = count_xadds(copied, n, [](redisStream &stream, FieldsStructure &entry) {
+        const FieldsStructure &data = entry;
+        stream.xadd("s", data);
+    });
+    size_t move_allocs = count_xadds(moved, n, [](redisStream &stream, FieldsStructure &entry) {
+        stream.xadd("s", std::move(entry));
+    });
+    std::cout << "allocations per xadd: copied " << double(copy_allocs) / n
+              << ", moved " << double(move_allocs) / n << std::endl;
+    // map node plus a deque chunk for arrival times every so often
+    assert(move_allocs <= n + n / 16);
+    assert(copy_allocs >= n * 6);
+    assert(moved.xlen("s") == n + 1);
+    assert(moved.xrange("s", n, n)[0].second == long_entry(n - 1));
+    std::cout << "test_xadd_moves_fields_in passed" << std::endl;
+}
+
+// same with blocks getting sealed the whole time, the moved path should stay
+// well under the copied one
+void test_xadd_moves_fields_in_with_sealing() {
+    const long long n = 10000;
+    streamConfig config;
+    config.block_entries = 256;
+    redisStream copied(config), moved(config);
+    size_t copy_allocs = count_xadds(copied, n, [](redisStream &stream, FieldsStructure &entry) {
+        const FieldsStructure &data = entry;
+        stream.xadd("s", data);
+    });
+    size_t move_allocs = count_xadds(moved, n, [](redisStream &stream, FieldsStructure &entry) {
+        stream.xadd("s", std::move(entry));
+    });
+    assert(move_allocs < n + n / 4);
+    assert(move_allocs * 4 < copy_allocs);
+    assert(moved.xrange("s", 0, 0)[0].second == long_entry(0));
+    assert(moved.xrange("s", n - 1, n - 1)[0].second == long_entry(n - 1));
+    std::cout << "test_xadd_moves_fields_in_with_sealing passed" << std::endl;
+}
+
+// with the replication backlog on the fields still move into the stream,
+// followers get their own copy
+void test_xadd_moves_fields_in_with_backlog() {
+    streamConfig config;
+    config.block_entries = 0;
+    redisStream stream(config);
+    stream.enable_replication_backlog(16);
+    FieldsStructure entry = long_entry(7);
+    assert(stream.xadd("s", std::move(entry)) == 0);
+    std::vector<streamMutation> log;
+    assert(stream.mutations_since(0, log, 16, std::chrono::milliseconds(0)));
+    assert(log.size() == 1 && log[0].data == long_entry(7));
+    assert(stream.xrange("s")[0].second == long_entry(7));
+    std::cout << "test_xadd_moves_fields_in_with_backlog passed" << std::endl;
+}
+
+// what a stream costs with a few entries in it, one stream per device is
+// millions of these. the first few entries of a stream sit in one vector
+// instead of a map node each and the stream's id counters live in its
+// state, so a stream with one entry is about its node and that entry.
+static long long bytes_per_stream(long long entries) {
+    const long long streams = 10000;
+    redisStream stream;
+    long long before = live_bytes_;
+    for (long long d = 0; d < streams; ++d) {
+        std::string name = "device:" + std::to_string(d);
+        for (long long i = 0; i < entries; ++i) stream.xadd(name, {{"temp", "21.5"}});
+    }
+    assert(stream.xlen("device:0") == static_cast<size_t>(entries));
+    return (live_bytes_ - before) / streams;
+}
+
+void test_bytes_per_small_stream() {
+    long long one = bytes_per_stream(1), ten = bytes_per_stream(10), hundred = bytes_per_stream(100);
+    std::cout << "bytes per stream: 1 entry " << one << ", 10 entries " << ten
+              << ", 100 entries " << hundred << std::endl;
+    // was about 1900, 3200 and 17700 with a map per tail and deques
+    assert(one < 600);
+    assert(ten < 2200);
+    assert(hundred < 20000);
+    std::cout << "test_bytes_per_small_stream passed" << std::endl;
+}
+
+int main() {
+    test_xadd_moves_fields_in();
+    test_xadd_moves_fields_in_with_sealing();
+    test_xadd_moves_fields_in_with_backlog();
+    test_bytes_per_small_stream();
+    std::cout << "All allocation tests passed!" << std::endl;
+    return 0;
+}
@@ -0,0 +1,734 @@
+#include "stream.h"
+#include "commands.h"
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+// rough benchmarks, not tests. every section prints its own numbers.
+// ./benchmark             runs everything
+// ./benchmark tiered ...  runs just the sections named
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// best of a few runs so one bad scheduling hiccup doesn't decide it
+static double best_of(int runs, const std::function<void()> &body) {
+    double best = 1e100;
+    for (int i = 0; i < runs; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        best = std::min(best, seconds_since(start));
+    }
+    return best;
+}
+
+static FieldsStructure sample_entry(long long i) {
+    return {{"device", "sensor-" + std::to_string(i % 64)},
+            {"reading", std::to_string(i * 7 % 1000)},
+            {"payload", std::string(64, static_cast<char>('a' + i % 26))}};
+}
+
+// full scan over the same stream kept as a plain map, as resident sealed
+// blocks and as blocks spilled to segment files. the segment files were just
+// written so they're likely still in the page cache, drop caches first
+// (echo 3 > /proc/sys/vm/drop_caches) to see real disk reads.
+static void bench_tiered() {
+    const long long entries = 200000;
+    std::cout << "== tiered storage: full xrange over " << entries << " entries\n";
+    struct variant { const char *name; size_t block_entries; size_t budget; };
+    for (variant v : {variant{"map only", 0, 0},
+                      variant{"sealed, resident", 1024, 0},
+                      variant{"sealed, spilled", 1024, 1}}) {
+        streamConfig config;
+        config.block_entries = v.block_entries;
+        config.memory_budget = v.budget;
+        redisStream stream(config);
+        for (long long i = 0; i < entries; ++i)
+            stream.xadd("bench", sample_entry(i));
+        size_t bytes = 0;
+        double secs = best_of(3, [&] {
+            auto result = stream.xrange("bench");
+            bytes = 0;
+            for (const auto &entry : result)
+                for (const auto &fv : entry.second)
+                    bytes += fv.first.size() + fv.second.size();
+        });
+        storageStats stats = stream.storage_stats();
+        std::cout << std::fixed << std::setprecision(1) << "  " << std::left
+                  << std::setw(18) << v.name << std::right << std::setw(8)
+                  << entries / secs / 1e6 << " M entries/s " << std::setw(8)
+                  << bytes / secs / 1e6 << " MB/s  (" << stats.spilled_blocks
+                  << " of " << stats.sealed_blocks << " blocks spilled, "
+                  << stats.resident_bytes / 1024 << " KB resident)\n";
+    }
+}
+
+// selective query, one device out of 1000. pulling everything and filtering
+// like a client has to today vs WHERE without an index vs WHERE with one.
+static void bench_index() {
+    const long long entries = 200000;
+    std::cout << "== field index: XRANGE WHERE device=sensor-7 over " << entries
+              << " entries, 1000 devices\n";
+    redisStream stream;
+    for (long long i = 0; i < entries; ++i) {
+        FieldsStructure entry = sample_entry(i);
+        entry[0].second = "sensor-" + std::to_string(i % 1000);
+        stream.xadd("bench", entry);
+    }
+    size_t matches = 0;
+    double client = best_of(3, [&] {
+        matches = 0;
+        for (const auto &entry : stream.xrange("bench"))
+            for (const auto &fv : entry.second)
+                if (fv.first == "device" && fv.second == "sensor-7") { matches++; break; }
+    });
+    double scan = best_of(3, [&] {
+        matches = stream.xrange_where("bench", LLONG_MIN, LLONG_MAX, "device", "sensor-7").size();
+    });
+    stream.create_index("bench", "device");
+    double indexed = best_of(3, [&] {
+        matches = stream.xrange_where("bench", LLONG_MIN, LLONG_MAX, "device", "sensor-7").size();
+    });
+    std::cout << std::fixed << std::setprecision(3)
+              << "  xrange + client filter " << std::setw(9) << client * 1e3 << " ms\n"
+              << "  WHERE, full scan       " << std::setw(9) << scan * 1e3 << " ms\n"
+              << "  WHERE, indexed         " << std::setw(9) << indexed * 1e3 << " ms  ("
+              << matches << " matches, " << std::setprecision(0) << client / indexed
+              << "x over client filter)\n";
+}
+
+// same full scan with and without compressed blocks, plus how much smaller
+// the payloads got
+static void bench_compress() {
+    const long long entries = 200000;
+    std::cout << "== block compression: full xrange over " << entries << " entries\n";
+    for (bool compress : {false, true}) {
+        streamConfig config;
+        config.compress_blocks = compress;
+        redisStream stream(config);
+        for (long long i = 0; i < entries; ++i)
+            stream.xadd("bench", sample_entry(i));
+        double secs = best_of(3, [&] { stream.xrange("bench"); });
+        storageStats stats = stream.storage_stats();
+        std::cout << std::fixed << std::setprecision(1) << "  " << std::left
+                  << std::setw(12) << (compress ? "compressed" : "plain") << std::right
+                  << std::setw(8) << entries / secs / 1e6 << " M entries/s  "
+                  << std::setw(8) << stats.resident_bytes / 1024 << " KB resident  ("
+                  << std::setprecision(2)
+                  << double(stats.payload_bytes) / stats.stored_payload_bytes
+                  << "x on payloads)\n";
+    }
+}
+
+// single id deletes spread over sealed blocks while the compactor works
+// behind them, and how long an xadd waits meanwhile. deleting used to
+// rewrite the whole block under the lock every time.
+static void bench_xdel() {
+    const long long entries = 200000;
+    const long long deletes = 80000;
+    std::cout << "== xdel: " << deletes << " random deletes over " << entries
+              << " entries in 1024 entry blocks\n";
+    redisStream stream;
+    for (long long i = 0; i < entries; ++i)
+        stream.xadd("bench", sample_entry(i));
+    std::vector<long long> xdel_us, xadd_us;
+    std::mt19937_64 rng(7);
+    for (long long i = 0; i < deletes; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        stream.xdel("bench", {static_cast<long long>(rng() % entries)});
+        xdel_us.push_back(static_cast<long long>(seconds_since(start) * 1e6));
+        if (i % 10 == 0) {
+            start = std::chrono::steady_clock::now();
+            stream.xadd("other", sample_entry(i));
+            xadd_us.push_back(static_cast<long long>(seconds_since(start) * 1e6));
+        }
+    }
+    auto percentile = [](std::vector<long long> v, double p) {
+        std::sort(v.begin(), v.end());
+        return v[static_cast<size_t>(p * (v.size() - 1))];
+    };
+    storageStats stats = stream.storage_stats();
+    std::cout << "  xdel p50 " << percentile(xdel_us, 0.5) << " us, p99 "
+              << percentile(xdel_us, 0.99) << " us, max " << percentile(xdel_us, 1) << " us\n"
+              << "  xadd p50 " << percentile(xadd_us, 0.5) << " us, p99 "
+              << percentile(xadd_us, 0.99) << " us, max " << percentile(xadd_us, 1) << " us\n"
+              << "  " << stats.compacted_blocks << " blocks compacted, "
+              << stats.tombstones << " tombstones left\n";
+}
+
+// xadd latency into a stream with no retention vs one the maintenance
+// thread keeps at 50k entries the whole time
+static void bench_retention() {
+    const long long entries = 300000;
+    std::cout << "== retention: xadd latency over " << entries
+              << " entries, MAXLEN 50000 kept in the background\n";
+    auto percentile = [](std::vector<long long> v, double p) {
+        std::sort(v.begin(), v.end());
+        return v[static_cast<size_t>(p * (v.size() - 1))];
+    };
+    for (bool retained : {false, true}) {
+        streamConfig config;
+        config.maintenance_interval_ms = 10;
+        redisStream stream(config);
+        if (retained) {
+            retentionPolicy policy;
+            policy.max_len = 50000;
+            stream.set_retention("bench", policy);
+        }
+        std::vector<long long> xadd_us;
+        xadd_us.reserve(entries);
+        for (long long i = 0; i < entries; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            stream.xadd("bench", sample_entry(i));
+            xadd_us.push_back(static_cast<long long>(seconds_since(start) * 1e6));
+        }
+        maintenanceStats stats = stream.maintenance_stats();
+        std::cout << "  " << std::left << std::setw(14)
+                  << (retained ? "retention" : "no retention") << std::right
+                  << " xadd p50 " << percentile(xadd_us, 0.5) << " us, p99 "
+                  << percentile(xadd_us, 0.99) << " us, p99.9 "
+                  << percentile(xadd_us, 0.999) << " us  (" << stream.xlen("bench")
+                  << " left, " << stats.retention_trimmed << " trimmed in "
+                  << stats.cycles << " cycles, longest " << stats.max_cycle_us << " us)\n";
+    }
+}
+
+// what the max_memory check costs on every xadd: no limit, a limit that's
+// never reached and a limit that's evicting the oldest entries the whole
+// time
+static void bench_maxmemory() {
+    const long long entries = 300000;
+    std::cout << "== maxmemory: xadd throughput over " << entries << " entries\n";
+    struct variant { const char *name; size_t max_memory; evictionPolicy eviction; };
+    for (variant v : {variant{"no limit", 0, EVICT_NONE},
+                      variant{"under limit", size_t(1) << 40, EVICT_NONE},
+                      variant{"evicting", 16 << 20, EVICT_OLDEST_ENTRIES}}) {
+        streamConfig config;
+        config.max_memory = v.max_memory;
+        config.eviction = v.eviction;
+        redisStream stream(config);
+        std::vector<FieldsStructure> samples;
+        for (long long i = 0; i < 1000; ++i)
+            samples.push_back(sample_entry(i));
+        auto start = std::chrono::steady_clock::now();
+        for (long long i = 0; i < entries; ++i)
+            stream.xadd(i % 2 ? "a" : "b", samples[i % 1000]);
+        double secs = seconds_since(start);
+        memoryStats stats = stream.memory_stats();
+        std::cout << std::fixed << std::setprecision(2) << "  " << std::left
+                  << std::setw(12) << v.name << std::right << std::setw(8)
+                  << entries / secs / 1e6 << " M xadd/s  (" << stats.used_bytes / 1024
+                  << " KB used, " << stats.evicted_entries << " evicted)\n";
+    }
+}
+
+// one feed sharded over 64 streams read back in global id order, 1000
+// entries at a time. client side means xread on all of them with COUNT
+// 1000 each (any shard could have all of the next 1000) and sorting that.
+static void bench_xmerge() {
+    const int shards = 64;
+    const long long per_shard = 5000;
+    const size_t page = 1000;
+    std::cout << "== XMERGE: next " << page << " of " << shards << " streams x "
+              << per_shard << " entries\n";
+    redisStream stream;
+    std::vector<std::string> names;
+    for (int s = 0; s < shards; ++s)
+        names.push_back("shard" + std::to_string(s));
+    for (long long i = 0; i < per_shard * shards; ++i)
+        stream.xadd(names[i % shards], sample_entry(i));
+    std::vector<long long> starts(shards, per_shard / 2);
+    size_t got = 0;
+    double client = best_of(5, [&] {
+        auto result = stream.xread(names, starts, std::nullopt, page);
+        std::vector<std::pair<long long, std::pair<std::string, FieldsStructure>>> all;
+        for (auto &s : result)
+            for (auto &entry : s.second)
+                all.push_back({entry.first, {s.first, std::move(entry.second)}});
+        std::sort(all.begin(), all.end(), [](const auto &a, const auto &b) {
+            return a.first != b.first ? a.first < b.first : a.second.first < b.second.first;
+        });
+        all.resize(std::min(all.size(), page));
+        got = all.size();
+    });
+    double merged = best_of(5, [&] { got = stream.xmerge(names, starts, page).size(); });
+    std::cout << std::fixed << std::setprecision(3)
+              << "  xread all + client sort " << std::setw(9) << client * 1e3 << " ms\n"
+              << "  XMERGE                  " << std::setw(9) << merged * 1e3 << " ms  ("
+              << got << " entries, " << std::setprecision(0) << client / merged << "x)\n";
+}
+
+// sum of a numeric field, pulling the entries out and parsing every value
+// like a client would vs XAGG running over the block columns. with 1024
+// entry blocks almost everything is sealed.
+static void bench_agg() {
+    const long long entries = 200000;
+    std::cout << "== XAGG: SUM reading over " << entries << " entries\n";
+    redisStream stream;
+    for (long long i = 0; i < entries; ++i)
+        stream.xadd("bench", sample_entry(i));
+    double sum = 0;
+    double client = best_of(3, [&] {
+        sum = 0;
+        for (const auto &entry : stream.xrange("bench"))
+            for (const auto &fv : entry.second)
+                if (fv.first == "reading") { sum += std::stod(fv.second); break; }
+    });
+    double client_sum = sum;
+    double columns = best_of(3, [&] {
+        sum = stream.xagg("bench", LLONG_MIN, LLONG_MAX, "reading")[0].sum;
+    });
+    double bucketed = best_of(3, [&] {
+        stream.xagg("bench", LLONG_MIN, LLONG_MAX, "reading", 10);
+    });
+    std::cout << std::fixed << std::setprecision(3)
+              << "  xrange + client sum " << std::setw(9) << client * 1e3 << " ms\n"
+              << "  XAGG SUM            " << std::setw(9) << columns * 1e3 << " ms  ("
+              << std::setprecision(0) << client / columns << "x, "
+              << (sum == client_sum ? "same sum" : "SUMS DIFFER") << ")\n"
+              << std::setprecision(3)
+              << "  XAGG SUM BUCKET 10  " << std::setw(9) << bucketed * 1e3 << " ms\n";
+}
+
+// the old if chain of op == "..." compares in the order interface.cpp used
+// to have them, returns the position so the compiler can't drop it
+static int if_chain_dispatch(const std::string &op) {
+    if (op == "INFO") return 0;
+    if (op == "XADD") return 1;
+    else if (op == "XREAD") return 2;
+    else if (op == "XMERGE") return 3;
+    else if (op == "XRANGE") return 4;
+    else if (op == "XINDEX") return 5;
+    else if (op == "XAGG") return 6;
+    else if (op == "XRETENTION") return 7;
+    else if (op == "XLEN") return 8;
+    else if (op == "XDEL") return 9;
+    else if (op == "XTRIM") return 10;
+    return -1;
+}
+
+// finding the command for a mix of every name plus one that isn't a
+// command, then the same lookup plus the arity and option checks for an
+// XREAD with options. the handlers themselves aren't run.
+static void bench_dispatch() {
+    const int rounds = 2000000;
+    std::cout << "== dispatch: " << rounds << " lookups\n";
+    std::vector<std::string> names;
+    for (const auto &spec : commands_) names.push_back(spec.name);
+    names.push_back("XFOO");
+    volatile long long sink = 0;
+    double chain = best_of(5, [&] {
+        for (int i = 0; i < rounds; ++i) sink += if_chain_dispatch(names[i % names.size()]);
+    });
+    double table = best_of(5, [&] {
+        for (int i = 0; i < rounds; ++i) sink += find_command(names[i % names.size()]) != nullptr;
+    });
+    std::vector<std::string> toks = {"XREAD", "COUNT", "10", "BLOCK", "0", "STREAMS", "a", "b", "0", "0"};
+    replyEncoder out;
+    double bound = best_of(5, [&] {
+        for (int i = 0; i < rounds; ++i) {
+            commandCall call{*find_command(toks[0]), toks, out};
+            sink += bind_command(call);
+        }
+    });
+    std::cout << std::fixed << std::setprecision(1)
+              << "  if chain           " << std::setw(7) << chain / rounds * 1e9 << " ns\n"
+              << "  perfect hash       " << std::setw(7) << table / rounds * 1e9 << " ns  ("
+              << std::setprecision(1) << chain / table << "x)\n"
+              << "  hash + XREAD check " << std::setw(7) << bound / rounds * 1e9 << " ns\n";
+}
+
+// stand in for a terminal, writes every line out as soon as it ends like a
+// line buffered stdout does and counts the write calls
+class lineBufferedSink : public std::streambuf {
+public:
+    explicit lineBufferedSink(int fd) : fd_(fd) {}
+    size_t writes = 0;
+
+protected:
+    int overflow(int c) override {
+        if (c == EOF) return 0;
+        line_ += static_cast<char>(c);
+        if (c == '\n') sync();
+        return c;
+    }
+    int sync() override {
+        if (line_.empty()) return 0;
+        ssize_t n = ::write(fd_, line_.data(), line_.size());
+        ++writes;
+        line_.clear();
+        return n < 0 ? -1 : 0;
+    }
+
+private:
+    int fd_;
+    std::string line_;
+};
+
+// a 10k entry XRANGE reply written to /dev/null, printed a line at a time
+// to a line buffered stream like the interface used to vs the reply
+// encoder, human readable and RESP
+static void bench_reply() {
+    const long long entries = 10000;
+    const int replies = 20;
+    std::cout << "== reply: " << replies << " XRANGE replies of " << entries << " entries\n";
+    redisStream stream;
+    for (long long i = 0; i < entries; ++i)
+        stream.xadd("bench", sample_entry(i));
+    auto result = stream.xrange("bench");
+    int fd = ::open("/dev/null", O_WRONLY);
+    lineBufferedSink sink(fd);
+    std::ostream old_out(&sink);
+    double before = best_of(3, [&] {
+        for (int r = 0; r < replies; ++r) {
+            size_t id_index = 1;
+            for (const auto &pr : result) {
+                old_out << id_index << ") " << pr.first << '\n';
+                size_t field_index = 1;
+                for (const auto &fv : pr.second) {
+                    old_out << '\t' << field_index << ") " << fv.first << ":" << fv.second << '\n';
+                    ++field_index;
+                }
+                old_out << '\n';
+                ++id_index;
+            }
+            old_out << std::flush;
+        }
+    });
+    size_t reply_bytes = 0;
+    auto encoded = [&](replyEncoder &out) {
+        return best_of(3, [&] {
+            for (int r = 0; r < replies; ++r) {
+                out.range(result);
+                reply_bytes = out.buffer().size();
+                out.flush(fd, fd);
+            }
+        });
+    };
+    replyEncoder human(REPLY_HUMAN), resp(REPLY_RESP);
+    double after = encoded(human);
+    size_t human_bytes = reply_bytes;
+    double after_resp = encoded(resp);
+    ::close(fd);
+    // best_of ran each one 3 times
+    double runs = 3.0 * replies;
+    std::cout << std::fixed << std::setprecision(1)
+              << "  line at a time  " << std::setw(8) << before / replies * 1e3 << " ms/reply  "
+              << std::setw(7) << sink.writes / runs << " writes/reply  "
+              << std::setw(6) << human_bytes * replies / before / 1e6 << " MB/s\n"
+              << "  encoder         " << std::setw(8) << after / replies * 1e3 << " ms/reply  "
+              << std::setw(7) << human.write_calls() / runs << " writes/reply  "
+              << std::setw(6) << human_bytes * replies / after / 1e6 << " MB/s  ("
+              << before / after << "x)\n"
+              << "  encoder, RESP   " << std::setw(8) << after_resp / replies * 1e3 << " ms/reply  "
+              << std::setw(7) << resp.write_calls() / runs << " writes/reply  "
+              << std::setw(6) << reply_bytes * replies / after_resp / 1e6 << " MB/s\n";
+}
+
+// cost of getting each new entry to every reader. readers polling with
+// xread each build their own copy of the entry, subscribers get a pointer
+// to the one copy xadd serialized. single threaded so it's only the
+// per-reader work, no wakeups.
+static void bench_pubsub() {
+    const int entries = 2000;
+    std::cout << "== pub/sub: " << entries << " entries fanned out\n";
+    for (int readers : {10, 100, 1000}) {
+        redisStream polled;
+        std::vector<std::string> names = {"feed"};
+        std::vector<long long> last(1, 0);
+        double xread_time = best_of(3, [&] {
+            for (int i = 0; i < entries; ++i) {
+                long long id = polled.xadd("feed", sample_entry(i));
+                last[0] = id;
+                for (int r = 0; r < readers; ++r)
+                    polled.xread(names, last, std::nullopt, 1);
+            }
+        });
+        redisStream pushed;
+        std::vector<std::shared_ptr<streamSubscription>> subscriptions;
+        for (int r = 0; r < readers; ++r)
+            subscriptions.push_back(pushed.subscribe(names, entries));
+        std::vector<PublishedEntryPointer> drained;
+        double push_time = best_of(3, [&] {
+            for (int i = 0; i < entries; ++i)
+                pushed.xadd("feed", sample_entry(i));
+            // emptied outside the xadds so the next run has room again
+            for (auto &subscription : subscriptions) {
+                drained.clear();
+                subscription->pop(drained, entries);
+            }
+        });
+        double deliveries = double(entries) * readers;
+        std::cout << std::fixed << std::setprecision(1)
+                  << "  " << std::setw(4) << readers << " readers  xread "
+                  << std::setw(7) << xread_time / deliveries * 1e9 << " ns/delivery  subscribe "
+                  << std::setw(6) << push_time / deliveries * 1e9 << " ns/delivery  ("
+                  << xread_time / push_time << "x)\n";
+    }
+}
+
+// a five minute window out of a day of entries. without BYTIME a client has
+// to carry the time in a field, pull the whole stream and filter it.
+// entries are replayed with picked arrival times, one every 100 ms.
+static void bench_bytime() {
+    const long long entries = 500000;
+    const long long step_ms = 100, base_ms = 1700000000000LL;
+    std::cout << "== XRANGE BYTIME: 5 minute window of " << entries << " entries\n";
+    redisStream stream;
+    for (long long i = 0; i < entries; ++i) {
+        streamMutation mutation;
+        mutation.kind = MUTATION_XADD;
+        mutation.stream_name = "bench";
+        mutation.id = i;
+        mutation.logged_ms = base_ms + i * step_ms;
+        mutation.data = sample_entry(i);
+        mutation.data.emplace_back("ts", std::to_string(mutation.logged_ms));
+        stream.apply_mutation(mutation);
+    }
+    long long from = base_ms + entries / 2 * step_ms, to = from + 5 * 60 * 1000;
+    size_t client_found = 0, found = 0;
+    double client = best_of(3, [&] {
+        client_found = 0;
+        for (const auto &entry : stream.xrange("bench")) {
+            long long ts = std::stoll(entry.second.back().second);
+            client_found += ts >= from && ts <= to;
+        }
+    });
+    double bytime = best_of(3, [&] { found = stream.xrange_bytime("bench", from, to).size(); });
+    std::cout << std::fixed << std::setprecision(3)
+              << "  xrange + client filter " << std::setw(9) << client * 1e3 << " ms\n"
+              << "  XRANGE BYTIME          " << std::setw(9) << bytime * 1e3 << " ms  ("
+              << found << " entries, " << std::setprecision(0) << client / bytime << "x"
+              << (found == client_found ? "" : ", COUNTS DIFFER") << ")\n";
+}
+
+// one full XRANGE over a stream big enough to split, blocks decoded on 1
+// to 16 threads. 1 is the old serial read. compressed blocks have the most
+// to gain since each one is decompressed as well as decoded.
+static void bench_parallel() {
+    const long long entries = 1000000;
+    std::cout << "== parallel XRANGE: full range over " << entries << " entries\n";
+    for (bool compress : {false, true}) {
+        double serial = 0;
+        for (size_t threads : {1, 2, 4, 8, 16}) {
+            streamConfig config;
+            config.compress_blocks = compress;
+            config.range_threads = threads;
+            config.decompressed_blocks = 8;
+            redisStream stream(config);
+            for (long long i = 0; i < entries; ++i) stream.xadd("bench", sample_entry(i));
+            size_t found = 0;
+            double took = best_of(3, [&] { found = stream.xrange("bench").size(); });
+            if (threads == 1) serial = took;
+            std::cout << std::fixed << std::setprecision(1)
+                      << "  " << (compress ? "compressed " : "plain      ") << std::setw(2) << threads
+                      << " threads " << std::setw(8) << took * 1e3 << " ms  (" << found << " entries, "
+                      << std::setprecision(2) << serial / took << "x)\n";
+        }
+    }
+}
+
+// thousands of clients polling a few popular streams for their newest
+// entries, through the command interface in RESP. with the reply cache a
+// poll is a slice of bytes xadd already serialized, without it every poll
+// walks the tail and encodes the same entries again. cpu time is the
+// process's, there's only the one thread.
+static void bench_replycache() {
+    const int streams = 16, writes = 2000, polls_per_write = 100, latest = 20;
+    std::cout << "== reply cache: " << polls_per_write << " polls of the latest " << latest
+              << " entries per xadd over " << streams << " streams\n";
+    double cpu_without = 0;
+    for (size_t cache_entries : {0, 128}) {
+        streamConfig config;
+        config.reply_cache_entries = cache_entries;
+        redisStream stream(config);
+        replyEncoder out(REPLY_RESP);
+        std::mt19937 rng(3);
+        std::vector<long long> next(streams, 0);
+        for (int s = 0; s < streams; ++s)
+            for (int i = 0; i < 100; ++i) next[s] = stream.xadd("stream:" + std::to_string(s), sample_entry(i)) + 1;
+        std::vector<std::string> toks = {"XRANGE", "", "", "+"};
+        size_t bytes = 0;
+        std::clock_t cpu_start = std::clock();
+        auto start = std::chrono::steady_clock::now();
+        for (int w = 0; w < writes; ++w) {
+            int s = rng() % streams;
+            next[s] = stream.xadd("stream:" + std::to_string(s), sample_entry(w)) + 1;
+            for (int p = 0; p < polls_per_write; ++p) {
+                int polled = rng() % streams;
+                toks[1] = "stream:" + std::to_string(polled);
+                toks[2] = std::to_string(next[polled] - latest);
+                command_interpreter(toks, stream, out);
+                bytes += out.buffer().size();
+                out.clear();
+            }
+        }
+        double took = seconds_since(start);
+        double cpu = double(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+        if (!cache_entries) cpu_without = cpu;
+        replyCacheStats stats = stream.reply_cache_stats();
+        double polls = double(writes) * polls_per_write;
+        std::cout << std::fixed << std::setprecision(2) << "  " << (cache_entries ? "reply cache " : "no cache    ")
+                  << std::setw(7) << took / polls * 1e9 << " ns/poll  " << std::setw(6) << cpu << " s cpu  "
+                  << std::setw(6) << bytes / took / 1e6 << " MB/s  hit rate "
+                  << std::setprecision(1)
+                  << (stats.hits + stats.misses ? 100.0 * stats.hits / (stats.hits + stats.misses) : 0.0) << "%";
+        if (cache_entries)
+            std::cout << "  (" << std::setprecision(0) << 100 * (1 - cpu / cpu_without) << "% cpu saved, "
+                      << stats.bytes / 1024 << " KB cached)";
+        std::cout << '\n';
+    }
+}
+
+// producers writing 10 related entries across 5 streams at a time, one
+// command_interpreter call each versus MULTI, the 10 queued and EXEC, with
+// readers blocked on the streams the whole time. the batch takes the lock
+// once and wakes the readers once instead of 10 times each.
+static void bench_multi() {
+    const int producers = 4, groups = 20000, readers = 4, per_group = 10;
+    std::cout << "== multi: " << producers << " producers x " << groups << " groups of " << per_group
+              << " xadds over 5 streams, " << readers << " blocked readers\n";
+    double individual = 0;
+    for (bool batched : {false, true}) {
+        redisStream stream;
+        std::atomic<bool> done{false};
+        std::atomic<size_t> reads{0};
+        std::vector<std::thread> threads;
+        std::vector<std::string> names;
+        for (int s = 0; s < 5; ++s) names.push_back("group:" + std::to_string(s));
+        for (int r = 0; r < readers; ++r) {
+            threads.emplace_back([&] {
+                std::vector<long long> ids(names.size(), 0);
+                while (!done) {
+                    auto result = stream.xread(names, ids, 100, 100);
+                    if (!result.empty()) reads++;
+                    for (size_t s = 0; s < names.size(); ++s) {
+                        auto found = result.find(names[s]);
+                        if (found != result.end() && !found->second.empty())
+                            ids[s] = found->second.back().first + 1;
+                    }
+                }
+            });
+        }
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> writers;
+        for (int p = 0; p < producers; ++p) {
+            writers.emplace_back([&, p] {
+                replyEncoder out(REPLY_RESP);
+                commandSession session;
+                std::vector<std::string> toks = {"XADD", "", "producer", std::to_string(p), "n", ""};
+                for (int g = 0; g < groups; ++g) {
+                    if (batched) command_interpreter({"MULTI"}, stream, out, session);
+                    for (int c = 0; c < per_group; ++c) {
+                        toks[1] = names[c % names.size()];
+                        toks[5] = std::to_string(g);
+                        command_interpreter(toks, stream, out, session);
+                    }
+                    if (batched) command_interpreter({"EXEC"}, stream, out, session);
+                    out.clear();
+                }
+            });
+        }
+        for (auto &writer : writers) writer.join();
+        double took = seconds_since(start);
+        done = true;
+        for (auto &thread : threads) thread.join();
+        if (!batched) individual = took;
+        std::cout << std::fixed << std::setprecision(0) << "  " << (batched ? "MULTI/EXEC " : "individual ")
+                  << std::setw(9) << producers * groups / took << " groups/s  " << std::setw(10)
+                  << producers * groups * per_group / took << " xadds/s";
+        std::cout << std::setprecision(2) << "  " << double(reads) / (producers * groups) << " reads/group";
+        if (batched) std::cout << "  (" << individual / took << "x)";
+        std::cout << '\n';
+    }
+}
+
+// xadd latency on one stream while another one with 10M entries gets
+// trimmed down to its last 1000, freed with the lock held versus handed to
+// the free thread. the writer goes at a fixed pace and latency counts from
+// when each xadd was due, so the xadds that piled up behind a stall show up
+// in the percentiles instead of just one slow call.
+static void bench_lazyfree() {
+    const long long entries = 10000000;
+    const auto pace = std::chrono::microseconds(20);
+    std::cout << "== lazyfree: xadd every " << pace.count() << " us during an XTRIM of " << entries << " entries\n";
+    for (size_t lazyfree_entries : {0, 64}) {
+        streamConfig config;
+        config.lazyfree_entries = lazyfree_entries;
+        redisStream stream(config);
+        for (long long i = 0; i < entries; ++i) stream.xadd("big", sample_entry(i));
+        size_t before = stream.memory_stats().used_bytes;
+        std::atomic<bool> done{false};
+        std::vector<long long> latencies_ns;
+        latencies_ns.reserve(1 << 20);
+        std::thread writer([&] {
+            auto due = std::chrono::steady_clock::now();
+            for (long long i = 0; !done; ++i) {
+                due += pace;
+                while (std::chrono::steady_clock::now() < due) {}
+                stream.xadd("small", sample_entry(i));
+                latencies_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                           std::chrono::steady_clock::now() - due).count());
+                stream.xtrim("small", MINID, i - 1000);
+            }
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        auto start = std::chrono::steady_clock::now();
+        size_t trimmed = stream.xtrim("big", MINID, entries - 1001);
+        double trim_ms = seconds_since(start) * 1e3;
+        stream.wait_for_lazy_free();
+        double freed_ms = seconds_since(start) * 1e3;
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        done = true;
+        writer.join();
+        std::sort(latencies_ns.begin(), latencies_ns.end());
+        auto at = [&](double p) {
+            return latencies_ns[std::min(latencies_ns.size() - 1, size_t(p * latencies_ns.size()))] / 1e3;
+        };
+        std::cout << std::fixed << std::setprecision(1) << "  " << (lazyfree_entries ? "lazyfree " : "inline   ")
+                  << trimmed << " trimmed, " << trim_ms << " ms in xtrim, " << freed_ms << " ms until freed, "
+                  << (before - stream.memory_stats().used_bytes) / (1 << 20) << " MB\n"
+                  << "           xadd p50 " << at(0.5) << " us  p99 " << at(0.99) << " us  p99.9 " << at(0.999)
+                  << " us  max " << latencies_ns.back() / 1e3 << " us over " << latencies_ns.size() << " xadds\n";
+    }
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::pair<std::string, std::function<void()>>> sections = {
+        {"tiered", bench_tiered},
+        {"index", bench_index},
+        {"agg", bench_agg},
+        {"compress", bench_compress},
+        {"xdel", bench_xdel},
+        {"retention", bench_retention},
+        {"maxmemory", bench_maxmemory},
+        {"xmerge", bench_xmerge},
+        {"dispatch", bench_dispatch},
+        {"reply", bench_reply},
+        {"pubsub", bench_pubsub},
+        {"bytime", bench_bytime},
+        {"parallel", bench_parallel},
+        {"replycache", bench_replycache},
+        {"multi", bench_multi},
+        {"lazyfree", bench_lazyfree},
+    };
+    for (const auto &section : sections) {
+        bool wanted = argc == 1;
+        for (int i = 1; i < argc; ++i)
+            wanted = wanted || section.first == argv[i];
+        if (wanted)
+            section.second();
+    }
+    return 0;
+}
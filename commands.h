@@ -0,0 +1,797 @@
+// command table for the interface. every command is one constexpr entry
+// with its arity, option keywords, where its keys are and a typed handler.
+// lookup is a perfect hash worked out at compile time so dispatch is one
+// hash, one table load and one string compare no matter how many commands
+// there are, and options get checked once here instead of every handler
+// walking the tokens again.
+
+#pragma once
+#include "stream.h"
+#include "replication.h"
+#include "reply.h"
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <optional>
+#include <sstream>
+#include <iomanip> // quoted
+#include <iterator>
+#include <cstdint>
+
+// I probably would have just used boosts tokenizer if I didn't want to do this.
+inline std::vector<std::string> tokenize_whitespace(const std::string& text) {
+    std::stringstream ss(text);
+    std::string token;
+    std::vector<std::string> tokens;
+    while (ss >> std::quoted(token)) {
+        tokens.push_back(token);
+    }
+    return tokens;
+}
+
+// parse long long from string
+inline bool parse_ll(const std::string& s, long long &out) {
+    if (s.empty()) return false;
+    std::stringstream ss(s);
+    ss >> out;
+    return !ss.fail() && ss.eof();
+}
+
+inline bool parse_bound(const std::string& s, long long &out) {
+    if (s == "-") { out = LLONG_MIN; return true; }
+    if (s == "+") { out = LLONG_MAX; return true; }
+    return parse_ll(s, out);
+}
+
+// set from the command line in main, INFO reports on them
+inline replicationLeader *leader_ = nullptr;
+inline replicationFollower *follower_ = nullptr;
+// XSUBSCRIBE, the interface has one session so there's one of these
+inline std::shared_ptr<streamSubscription> subscription_;
+
+// MULTI state of one client. between MULTI and EXEC commands get checked
+// and queued instead of run, queue_failed is set if one of them was bad so
+// EXEC throws the lot away like Redis does. only the first queued_count of
+// queued are queued, the rest stay around so the next transaction copies
+// its tokens into strings that are already allocated.
+struct commandSession {
+    bool in_multi = false;
+    bool queue_failed = false;
+    std::vector<std::vector<std::string>> queued;
+    size_t queued_count = 0;
+
+    void queue(const std::vector<std::string> &toks) {
+        if (queued_count == queued.size()) queued.emplace_back();
+        queued[queued_count++].assign(toks.begin(), toks.end());
+    }
+
+    void end() {
+        in_multi = queue_failed = false;
+        queued_count = 0;
+    }
+};
+
+inline void print_replication_info(std::ostream& out, redisStream& stream) {
+    if (follower_) {
+        replicaStatus status = follower_->status();
+        out << "role:follower\n"
+                  << "connected:" << status.connected << '\n'
+                  << "leader_offset:" << status.leader_offset << '\n'
+                  << "applied_offset:" << status.applied_offset << '\n'
+                  << "lag_offsets:" << status.leader_offset - status.applied_offset << '\n'
+                  << "lag_ms:" << status.lag_ms << '\n'
+                  << "full_syncs:" << status.full_syncs << '\n'
+                  << "partial_syncs:" << status.partial_syncs << '\n';
+        return;
+    }
+    out << (leader_ ? "role:leader\n" : "role:standalone\n")
+              << "replication_offset:" << stream.replication_offset() << '\n';
+    if (!leader_) return;
+    auto followers = leader_->followers();
+    out << "connected_followers:" << followers.size() << '\n';
+    for (size_t i = 0; i < followers.size(); ++i) {
+        out << "follower" << i << ":acked_offset=" << followers[i].acked_offset
+                  << ",lag=" << followers[i].lag
+                  << ",ms_since_ack=" << followers[i].ms_since_ack << '\n';
+    }
+}
+
+// where a command's keys are. KEYS_FIXED is first_key..last_key every
+// key_step tokens (last_key -1 is the last token), KEYS_STREAMS is the first
+// half of whatever comes after STREAMS
+enum keySpec { KEYS_NONE, KEYS_FIXED, KEYS_STREAMS };
+
+inline constexpr size_t max_options = 4;
+
+struct optionSpec {
+    const char *keyword;
+    int args;
+};
+
+struct commandSpec;
+
+// a command that passed the arity and option checks. option_at holds the
+// token index of each option keyword from the spec, 0 if it wasn't given,
+// and rest is the first token after the options (after STREAMS if the
+// command has it). the reply and any errors go to out.
+struct commandCall {
+    const commandSpec &spec;
+    const std::vector<std::string> &toks;
+    replyEncoder &out;
+    commandSession *session = nullptr; // whoever's running it, for MULTI
+    size_t option_at[max_options] = {};
+    size_t rest = 0;
+
+    bool has(size_t option) const { return option_at[option] != 0; }
+    const std::string &arg(size_t option, size_t n = 0) const { return toks[option_at[option] + 1 + n]; }
+};
+
+struct commandSpec {
+    const char *name;
+    int min_args, max_args; // token counts including the name, -1 no max
+    bool writes;            // refused on a read only follower
+    keySpec keys;
+    int first_key, last_key, key_step;
+    int options_at;         // first token options can start at, 0 none
+    bool streams;           // options end at STREAMS, keys then ids follow
+    optionSpec options[max_options];
+    const char *usage;      // printed when the arity is wrong
+    void (*handler)(const commandCall &, redisStream &);
+};
+
+inline std::string concat(std::initializer_list<std::string_view> parts) {
+    std::string joined;
+    for (auto part : parts) joined.append(part.data(), part.size());
+    return joined;
+}
+
+// every handler is a parse into its own args struct followed by a run on
+// those, the parse replies with what's wrong and returns false
+template <typename Args, bool (*Parse)(const commandCall &, Args &),
+          void (*Run)(const Args &, redisStream &, replyEncoder &)>
+inline void typed_handler(const commandCall &call, redisStream &stream) {
+    Args args;
+    if (Parse(call, args)) Run(args, stream, call.out);
+}
+
+// keys then as many ids after STREAMS
+inline bool parse_streams(const commandCall &call, std::vector<std::string> &keys, std::vector<long long> &ids) {
+    const auto &toks = call.toks;
+    size_t rest = toks.size() - call.rest;
+    if (rest == 0) { call.out.error(concat({call.spec.name, " STREAMS requires stream names and ids"})); return false; }
+    if (rest % 2) { call.out.error("Number of keys and ids must match"); return false; }
+    keys.assign(toks.begin() + call.rest, toks.begin() + call.rest + rest / 2);
+    // since I know the number of ids I'm going to be adding might as well
+    // reserve for a minor boost allocating capacity only once instead
+    ids.reserve(rest / 2);
+    for (size_t j = call.rest + rest / 2; j < toks.size(); ++j) {
+        long long id;
+        if (!parse_ll(toks[j], id)) { call.out.error(concat({"Invalid id: ", toks[j]})); return false; }
+        ids.push_back(id);
+    }
+    return true;
+}
+
+inline bool parse_count_option(const commandCall &call, size_t option, std::optional<long long> &out) {
+    if (!call.has(option)) return true;
+    long long v;
+    const std::string &tk = call.arg(option);
+    if (!parse_ll(tk, v) || v < 0) {
+        call.out.error(concat({call.spec.options[option].keyword, " invalid number: ", tk}));
+        return false;
+    }
+    out = v;
+    return true;
+}
+
+// INFO
+struct infoArgs {};
+
+inline bool parse_info(const commandCall &, infoArgs &) { return true; }
+
+inline void run_info(const infoArgs &, redisStream &stream, replyEncoder &out) {
+    std::ostringstream info;
+    print_replication_info(info, stream);
+    storageStats stats = stream.storage_stats();
+    info << "sealed_blocks:" << stats.sealed_blocks << '\n'
+         << "spilled_blocks:" << stats.spilled_blocks << '\n'
+         << "resident_block_bytes:" << stats.resident_bytes << '\n'
+         << "spilled_block_bytes:" << stats.spilled_bytes << '\n'
+         << "block_payload_bytes:" << stats.payload_bytes << '\n'
+         << "block_payload_stored_bytes:" << stats.stored_payload_bytes << '\n'
+         << "block_compression_ratio:"
+         << (stats.stored_payload_bytes ? double(stats.payload_bytes) / stats.stored_payload_bytes : 1.0) << '\n'
+         << "decompressed_block_bytes:" << stats.decompressed_bytes << '\n'
+         << "tombstones:" << stats.tombstones << '\n'
+         << "compacted_blocks:" << stats.compacted_blocks << '\n'
+         << "parallel_ranges:" << stats.parallel_ranges << '\n';
+    replyCacheStats cache = stream.reply_cache_stats();
+    info << "reply_cache_hits:" << cache.hits << '\n'
+         << "reply_cache_misses:" << cache.misses << '\n'
+         << "reply_cache_streams:" << cache.streams << '\n'
+         << "reply_cache_bytes:" << cache.bytes << '\n';
+    memoryStats memory = stream.memory_stats();
+    info << "used_memory:" << memory.used_bytes << '\n'
+         << "maxmemory:" << memory.max_bytes << '\n'
+         << "evicted_entries:" << memory.evicted_entries << '\n'
+         << "evicted_streams:" << memory.evicted_streams << '\n'
+         << "rejected_writes:" << memory.rejected_writes << '\n'
+         << "replication_backlog_bytes:" << memory.backlog_bytes << '\n'
+         << "index_bytes:" << memory.index_bytes << '\n'
+         << "lazyfree_pending_objects:" << memory.lazyfree_pending << '\n'
+         << "lazyfreed_objects:" << memory.lazyfreed << '\n';
+    maintenanceStats maintenance = stream.maintenance_stats();
+    info << "maintenance_cycles:" << maintenance.cycles << '\n'
+         << "retention_trimmed_entries:" << maintenance.retention_trimmed << '\n'
+         << "maintenance_last_cycle_us:" << maintenance.last_cycle_us << '\n'
+         << "maintenance_max_cycle_us:" << maintenance.max_cycle_us << '\n'
+         << "maintenance_total_us:" << maintenance.total_us << '\n';
+    pubsubStats pubsub = stream.pubsub_stats();
+    info << "pubsub_subscriptions:" << pubsub.subscriptions << '\n'
+         << "pubsub_published_entries:" << pubsub.published << '\n';
+    out.text(info.str());
+}
+
+// XADD key [field value ...]
+struct xaddArgs {
+    std::string key;
+    FieldsStructure data;
+};
+
+inline bool parse_xadd(const commandCall &call, xaddArgs &args) {
+    const auto &toks = call.toks;
+    args.key = toks[1];
+    args.data.reserve((toks.size() - 1) / 2);
+    for (size_t i = 2; i < toks.size(); i += 2) {
+        const std::string &field = toks[i];
+        const std::string value = (i + 1 < toks.size()) ? toks[i + 1] : std::string{};
+        args.data.emplace_back(field, value);
+    }
+    return true;
+}
+
+inline void run_xadd(const xaddArgs &args, redisStream &stream, replyEncoder &out) {
+    long long id = stream.xadd(args.key, args.data);
+    if (id < 0) { out.error("command not allowed when used memory > 'maxmemory'.", "OOM"); return; }
+    out.integer(id);
+}
+
+// XREAD [COUNT n] [BLOCK ms] STREAMS key ... id ...
+struct xreadArgs {
+    std::optional<long long> count, block_time;
+    std::vector<std::string> keys;
+    std::vector<long long> ids;
+};
+
+inline bool parse_xread(const commandCall &call, xreadArgs &args) {
+    return parse_count_option(call, 0, args.count) &&
+           parse_count_option(call, 1, args.block_time) &&
+           parse_streams(call, args.keys, args.ids);
+}
+
+// RESP readers polling for new entries get served from the engine's reply
+// caches, the human format numbers entries so it always builds the reply
+inline void run_xread(const xreadArgs &args, redisStream &stream, replyEncoder &out) {
+    if (out.format() == REPLY_RESP &&
+        stream.xread_resp(args.keys, args.ids, args.block_time, args.count, out.resp_buffer()))
+        return;
+    out.streams(stream.xread(args.keys, args.ids, args.block_time, args.count));
+}
+
+// XMERGE [COUNT n] [BLOCK ms] [BY ID|TIME] STREAMS key ... id ...
+struct xmergeArgs {
+    std::optional<long long> count, block_time;
+    mergeOrder order = MERGE_BY_ID;
+    std::vector<std::string> keys;
+    std::vector<long long> ids;
+};
+
+inline bool parse_xmerge(const commandCall &call, xmergeArgs &args) {
+    if (!parse_count_option(call, 0, args.count) || !parse_count_option(call, 1, args.block_time))
+        return false;
+    if (call.has(2)) {
+        const std::string &by = call.arg(2);
+        if (by != "ID" && by != "TIME") { call.out.error("XMERGE BY needs ID or TIME"); return false; }
+        args.order = by == "ID" ? MERGE_BY_ID : MERGE_BY_TIME;
+    }
+    return parse_streams(call, args.keys, args.ids);
+}
+
+inline void run_xmerge(const xmergeArgs &args, redisStream &stream, replyEncoder &out) {
+    out.merged(stream.xmerge(args.keys, args.ids, args.count.value_or(10), args.order, args.block_time));
+}
+
+// XRANGE key start end [COUNT n] [WHERE field value] [BYTIME], with BYTIME
+// start and end are arrival times in ms since the epoch instead of ids
+struct xrangeArgs {
+    std::string key;
+    long long start_id, end_id;
+    std::optional<long long> count;
+    std::optional<std::pair<std::string, std::string>> where;
+    bool by_time = false;
+};
+
+inline bool parse_xrange(const commandCall &call, xrangeArgs &args) {
+    const auto &toks = call.toks;
+    args.key = toks[1];
+    if (!parse_bound(toks[2], args.start_id)) { call.out.error("Invalid start id"); return false; }
+    if (!parse_bound(toks[3], args.end_id)) { call.out.error("Invalid end id"); return false; }
+    if (!parse_count_option(call, 0, args.count)) return false;
+    if (call.has(1)) args.where = std::make_pair(call.arg(1, 0), call.arg(1, 1));
+    args.by_time = call.has(2);
+    if (args.by_time && args.where) { call.out.error("XRANGE BYTIME doesn't go with WHERE"); return false; }
+    return true;
+}
+
+inline void run_xrange(const xrangeArgs &args, redisStream &stream, replyEncoder &out) {
+    if (args.by_time)
+        out.range(stream.xrange_bytime(args.key, args.start_id, args.end_id, args.count));
+    else if (out.format() == REPLY_RESP && !args.where && args.end_id == LLONG_MAX)
+        stream.xrange_resp(args.key, args.start_id, args.count, out.resp_buffer());
+    else if (args.where)
+        out.range(stream.xrange_where(args.key, args.start_id, args.end_id, args.where->first, args.where->second, args.count));
+    else
+        out.range(stream.xrange(args.key, args.start_id, args.end_id, args.count));
+}
+
+// XINDEX CREATE key field / XINDEX DROP key field
+struct xindexArgs {
+    bool create;
+    std::string key, field;
+};
+
+inline bool parse_xindex(const commandCall &call, xindexArgs &args) {
+    const auto &toks = call.toks;
+    if (toks[1] != "CREATE" && toks[1] != "DROP") {
+        call.out.error(concat({"Unknown XINDEX subcommand: ", toks[1]}));
+        return false;
+    }
+    args.create = toks[1] == "CREATE";
+    args.key = toks[2];
+    args.field = toks[3];
+    return true;
+}
+
+inline void run_xindex(const xindexArgs &args, redisStream &stream, replyEncoder &out) {
+    out.integer(args.create ? stream.create_index(args.key, args.field)
+                            : stream.drop_index(args.key, args.field));
+}
+
+// XAGG key start end COUNT|SUM|MIN|MAX|AVG field [BUCKET ms]
+enum aggregateKind { AGG_COUNT, AGG_SUM, AGG_MIN, AGG_MAX, AGG_AVG };
+
+struct xaggArgs {
+    std::string key, field;
+    long long start_id, end_id;
+    aggregateKind kind;
+    std::optional<long long> bucket_ms;
+};
+
+inline bool parse_xagg(const commandCall &call, xaggArgs &args) {
+    const auto &toks = call.toks;
+    args.key = toks[1];
+    if (!parse_bound(toks[2], args.start_id)) { call.out.error("Invalid start id"); return false; }
+    if (!parse_bound(toks[3], args.end_id)) { call.out.error("Invalid end id"); return false; }
+    const std::string &agg = toks[4];
+    if (agg == "COUNT") args.kind = AGG_COUNT;
+    else if (agg == "SUM") args.kind = AGG_SUM;
+    else if (agg == "MIN") args.kind = AGG_MIN;
+    else if (agg == "MAX") args.kind = AGG_MAX;
+    else if (agg == "AVG") args.kind = AGG_AVG;
+    else { call.out.error(concat({"Unknown XAGG aggregate: ", agg})); return false; }
+    args.field = toks[5];
+    if (call.has(0)) {
+        long long v;
+        if (!parse_ll(call.arg(0), v) || v <= 0) { call.out.error("XAGG BUCKET needs a positive number of ms"); return false; }
+        args.bucket_ms = v;
+    }
+    return true;
+}
+
+inline void run_xagg(const xaggArgs &args, redisStream &stream, replyEncoder &out) {
+    auto buckets = stream.xagg(args.key, args.start_id, args.end_id, args.field, args.bucket_ms);
+    std::vector<std::pair<long long, double>> values;
+    values.reserve(buckets.size());
+    for (const auto &bucket : buckets) {
+        double value = bucket.count;
+        if (args.kind == AGG_SUM) value = bucket.sum;
+        else if (args.kind == AGG_MIN) value = bucket.count ? bucket.min : 0;
+        else if (args.kind == AGG_MAX) value = bucket.count ? bucket.max : 0;
+        else if (args.kind == AGG_AVG) value = bucket.count ? bucket.sum / bucket.count : 0;
+        values.emplace_back(bucket.start_ms, value);
+    }
+    if (args.bucket_ms) out.buckets(values);
+    else for (const auto &value : values) out.value(value.second);
+}
+
+// XRETENTION key shows it, XRETENTION key [MAXAGE ms] [MAXLEN n]
+// [MAXBYTES n] replaces it, XRETENTION key NONE turns it off
+struct xretentionArgs {
+    std::string key;
+    std::optional<retentionPolicy> policy; // nothing means show it
+};
+
+inline bool parse_xretention(const commandCall &call, xretentionArgs &args) {
+    args.key = call.toks[1];
+    if (call.toks.size() == 2) return true;
+    // MAXAGE, MAXLEN and MAXBYTES in option order
+    long long limits[3] = {};
+    for (size_t option = 0; option < 3; ++option) {
+        if (!call.has(option)) continue;
+        if (!parse_ll(call.arg(option), limits[option]) || limits[option] < 0) {
+            call.out.error(concat({"XRETENTION ", call.spec.options[option].keyword, " needs a number"}));
+            return false;
+        }
+    }
+    if (call.has(3) && call.toks.size() != 3) {
+        call.out.error("XRETENTION NONE doesn't go with other options");
+        return false;
+    }
+    retentionPolicy policy;
+    policy.max_age_ms = limits[0];
+    policy.max_len = limits[1];
+    policy.max_bytes = limits[2];
+    args.policy = policy;
+    return true;
+}
+
+inline void run_xretention(const xretentionArgs &args, redisStream &stream, replyEncoder &out) {
+    if (!args.policy) {
+        retentionPolicy policy = stream.retention(args.key);
+        out.text(concat({"MAXAGE ", std::to_string(policy.max_age_ms), " MAXLEN ", std::to_string(policy.max_len),
+                         " MAXBYTES ", std::to_string(policy.max_bytes), "\n"}));
+        return;
+    }
+    stream.set_retention(args.key, *args.policy);
+    out.status("OK");
+}
+
+// XLEN key
+struct xlenArgs {
+    std::string key;
+};
+
+inline bool parse_xlen(const commandCall &call, xlenArgs &args) {
+    args.key = call.toks[1];
+    return true;
+}
+
+inline void run_xlen(const xlenArgs &args, redisStream &stream, replyEncoder &out) {
+    out.integer(stream.xlen(args.key));
+}
+
+// XDEL key id ...
+struct xdelArgs {
+    std::string key;
+    std::vector<long long> ids;
+};
+
+inline bool parse_xdel(const commandCall &call, xdelArgs &args) {
+    const auto &toks = call.toks;
+    args.key = toks[1];
+    args.ids.reserve(toks.size() - 2);
+    for (size_t j = 2; j < toks.size(); ++j) {
+        long long v;
+        if (!parse_ll(toks[j], v)) { call.out.error(concat({"Invalid id: ", toks[j]})); return false; }
+        args.ids.push_back(v);
+    }
+    return true;
+}
+
+inline void run_xdel(const xdelArgs &args, redisStream &stream, replyEncoder &out) {
+    out.integer(stream.xdel(args.key, args.ids));
+}
+
+// XTRIM key MINID|MAXLEN threshold
+struct xtrimArgs {
+    std::string key;
+    trimmingStrategy strategy;
+    long long threshold;
+};
+
+inline bool parse_xtrim(const commandCall &call, xtrimArgs &args) {
+    const auto &toks = call.toks;
+    args.key = toks[1];
+    if (!parse_ll(toks[3], args.threshold)) { call.out.error("Invalid threshold"); return false; }
+    if (toks[2] == "MINID") args.strategy = MINID;
+    // shouldn't run this when max length threshold exceeds current length
+    else if (toks[2] == "MAXLEN") args.strategy = MAXLEN;
+    else { call.out.error(concat({"Unknown XTRIM strategy: ", toks[2]})); return false; }
+    return true;
+}
+
+inline void run_xtrim(const xtrimArgs &args, redisStream &stream, replyEncoder &out) {
+    out.integer(stream.xtrim(args.key, args.strategy, args.threshold));
+}
+
+// DEL key ... and UNLINK key ..., UNLINK leaves freeing big streams to the
+// engine's free thread
+struct delArgs {
+    std::vector<std::string> keys;
+};
+
+inline bool parse_del(const commandCall &call, delArgs &args) {
+    args.keys.assign(call.toks.begin() + 1, call.toks.end());
+    return true;
+}
+
+inline void run_del(const delArgs &args, redisStream &stream, replyEncoder &out) {
+    out.integer(static_cast<long long>(stream.del(args.keys)));
+}
+
+using unlinkArgs = delArgs;
+
+inline bool parse_unlink(const commandCall &call, unlinkArgs &args) { return parse_del(call, args); }
+
+inline void run_unlink(const unlinkArgs &args, redisStream &stream, replyEncoder &out) {
+    out.integer(static_cast<long long>(stream.del(args.keys, true)));
+}
+
+// XSUBSCRIBE key ..., replaces whatever this session was subscribed to
+struct xsubscribeArgs {
+    std::vector<std::string> keys;
+};
+
+inline bool parse_xsubscribe(const commandCall &call, xsubscribeArgs &args) {
+    args.keys.assign(call.toks.begin() + 1, call.toks.end());
+    return true;
+}
+
+inline void run_xsubscribe(const xsubscribeArgs &args, redisStream &stream, replyEncoder &out) {
+    if (subscription_) stream.unsubscribe(subscription_);
+    subscription_ = stream.subscribe(args.keys);
+    out.integer(static_cast<long long>(args.keys.size()));
+}
+
+// XUNSUBSCRIBE
+struct xunsubscribeArgs {};
+
+inline bool parse_xunsubscribe(const commandCall &, xunsubscribeArgs &) { return true; }
+
+inline void run_xunsubscribe(const xunsubscribeArgs &, redisStream &stream, replyEncoder &out) {
+    if (subscription_) stream.unsubscribe(subscription_);
+    subscription_.reset();
+    out.status("OK");
+}
+
+// anything the session's subscription got since last time, the interface
+// calls this before every prompt
+inline void drain_subscription(replyEncoder &out) {
+    if (!subscription_) return;
+    std::vector<PublishedEntryPointer> entries;
+    subscription_->pop(entries, SIZE_MAX);
+    for (const auto &entry : entries) out.published(*entry);
+}
+
+// MULTI, EXEC and DISCARD work on the session instead of the engine so
+// they skip the typed handlers. EXEC is defined after command_interpreter,
+// it runs the queued commands through it.
+inline void multi_handler(const commandCall &call, redisStream &) {
+    if (call.session->in_multi) { call.out.error("MULTI calls can not be nested"); return; }
+    call.session->in_multi = true;
+    call.out.status("OK");
+}
+
+inline void discard_handler(const commandCall &call, redisStream &) {
+    if (!call.session->in_multi) { call.out.error("DISCARD without MULTI"); return; }
+    call.session->end();
+    call.out.status("OK");
+}
+
+inline void exec_handler(const commandCall &call, redisStream &stream);
+
+#define COMMAND_HANDLER(name) typed_handler<name##Args, parse_##name, run_##name>
+
+// adding a command is adding a line here, the hash below gets redone at
+// compile time and the build fails if it can't find one
+inline constexpr commandSpec commands_[] = {
+    {"INFO", 1, 1, false, KEYS_NONE, 0, 0, 0, 0, false, {}, "INFO takes no arguments", COMMAND_HANDLER(info)},
+    {"XADD", 2, -1, true, KEYS_FIXED, 1, 1, 1, 0, false, {}, "XADD requires a key", COMMAND_HANDLER(xadd)},
+    {"XREAD", 4, -1, false, KEYS_STREAMS, 0, 0, 0, 1, true, {{"COUNT", 1}, {"BLOCK", 1}},
+     "XREAD STREAMS requires stream names and ids", COMMAND_HANDLER(xread)},
+    {"XMERGE", 4, -1, false, KEYS_STREAMS, 0, 0, 0, 1, true, {{"COUNT", 1}, {"BLOCK", 1}, {"BY", 1}},
+     "XMERGE STREAMS requires stream names and ids", COMMAND_HANDLER(xmerge)},
+    {"XRANGE", 4, -1, false, KEYS_FIXED, 1, 1, 1, 4, false, {{"COUNT", 1}, {"WHERE", 2}, {"BYTIME", 0}},
+     "XRANGE requires key, start, and end", COMMAND_HANDLER(xrange)},
+    {"XINDEX", 4, 4, false, KEYS_FIXED, 2, 2, 1, 0, false, {},
+     "XINDEX requires CREATE or DROP, key, and field", COMMAND_HANDLER(xindex)},
+    {"XAGG", 6, 8, false, KEYS_FIXED, 1, 1, 1, 6, false, {{"BUCKET", 1}},
+     "XAGG requires key, start, end, aggregate, and field", COMMAND_HANDLER(xagg)},
+    {"XRETENTION", 2, 8, true, KEYS_FIXED, 1, 1, 1, 2, false,
+     {{"MAXAGE", 1}, {"MAXLEN", 1}, {"MAXBYTES", 1}, {"NONE", 0}},
+     "XRETENTION requires a key", COMMAND_HANDLER(xretention)},
+    {"XLEN", 2, 2, false, KEYS_FIXED, 1, 1, 1, 0, false, {}, "XLEN requires a key", COMMAND_HANDLER(xlen)},
+    {"XDEL", 3, -1, true, KEYS_FIXED, 1, 1, 1, 0, false, {},
+     "XDEL requires key and at least one id", COMMAND_HANDLER(xdel)},
+    {"XSUBSCRIBE", 2, -1, false, KEYS_FIXED, 1, -1, 1, 0, false, {},
+     "XSUBSCRIBE requires at least one key", COMMAND_HANDLER(xsubscribe)},
+    {"XUNSUBSCRIBE", 1, 1, false, KEYS_NONE, 0, 0, 0, 0, false, {},
+     "XUNSUBSCRIBE takes no arguments", COMMAND_HANDLER(xunsubscribe)},
+    {"XTRIM", 4, 4, true, KEYS_FIXED, 1, 1, 1, 0, false, {},
+     "XTRIM requires key, strategy, and threshold", COMMAND_HANDLER(xtrim)},
+    {"DEL", 2, -1, true, KEYS_FIXED, 1, -1, 1, 0, false, {}, "DEL requires at least one key", COMMAND_HANDLER(del)},
+    {"UNLINK", 2, -1, true, KEYS_FIXED, 1, -1, 1, 0, false, {},
+     "UNLINK requires at least one key", COMMAND_HANDLER(unlink)},
+    {"MULTI", 1, 1, false, KEYS_NONE, 0, 0, 0, 0, false, {}, "MULTI takes no arguments", multi_handler},
+    {"EXEC", 1, 1, false, KEYS_NONE, 0, 0, 0, 0, false, {}, "EXEC takes no arguments", exec_handler},
+    {"DISCARD", 1, 1, false, KEYS_NONE, 0, 0, 0, 0, false, {}, "DISCARD takes no arguments", discard_handler},
+};
+
+#undef COMMAND_HANDLER
+
+inline constexpr size_t command_count_ = sizeof(commands_) / sizeof(commands_[0]);
+
+// smallest power of two at least twice the commands, keeps the seed search
+// short
+constexpr size_t command_slot_count_() {
+    size_t slots = 1;
+    while (slots < 2 * command_count_) slots *= 2;
+    return slots;
+}
+inline constexpr size_t command_slots_ = command_slot_count_();
+
+// fnv-1a with the seed folded into the offset basis. the multiplies only
+// carry upward so the low bits the slot comes from only ever saw the low
+// bits of the seed, folding the high half down lets the rest of it count
+constexpr uint32_t command_hash(std::string_view name, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (char c : name) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 16777619u;
+    }
+    return hash ^ (hash >> 16);
+}
+
+constexpr bool command_seed_works_(uint32_t seed) {
+    bool used[command_slots_] = {};
+    for (size_t i = 0; i < command_count_; ++i) {
+        size_t slot = command_hash(commands_[i].name, seed) & (command_slots_ - 1);
+        if (used[slot]) return false;
+        used[slot] = true;
+    }
+    return true;
+}
+
+constexpr uint32_t command_find_seed_() {
+    for (uint32_t seed = 0; seed < 100000; ++seed)
+        if (command_seed_works_(seed)) return seed;
+    return UINT32_MAX;
+}
+
+inline constexpr uint32_t command_seed_ = command_find_seed_();
+static_assert(command_seed_ != UINT32_MAX, "no collision free seed for the command table, add slots");
+
+constexpr std::array<int8_t, command_slots_> command_build_slots_() {
+    std::array<int8_t, command_slots_> slots{};
+    for (auto &slot : slots) slot = -1;
+    for (size_t i = 0; i < command_count_; ++i)
+        slots[command_hash(commands_[i].name, command_seed_) & (command_slots_ - 1)] = static_cast<int8_t>(i);
+    return slots;
+}
+
+inline constexpr std::array<int8_t, command_slots_> command_table_ = command_build_slots_();
+
+// nullptr if it isn't a command
+inline const commandSpec *find_command(std::string_view name) {
+    int index = command_table_[command_hash(name, command_seed_) & (command_slots_ - 1)];
+    if (index < 0 || name != commands_[index].name) return nullptr;
+    return &commands_[index];
+}
+
+// token positions of the keys the command touches, for sharding or
+// checking access without knowing anything else about the command
+inline std::vector<size_t> command_keys(const commandSpec &spec, const std::vector<std::string> &toks) {
+    std::vector<size_t> keys;
+    if (spec.keys == KEYS_FIXED) {
+        size_t last = spec.last_key < 0 ? toks.size() - 1 : static_cast<size_t>(spec.last_key);
+        for (size_t i = spec.first_key; i <= last && i < toks.size(); i += spec.key_step)
+            keys.push_back(i);
+    } else if (spec.keys == KEYS_STREAMS) {
+        size_t at = 1;
+        while (at < toks.size() && toks[at] != "STREAMS") ++at;
+        size_t rest = toks.size() - std::min(at + 1, toks.size());
+        for (size_t i = at + 1; i < at + 1 + rest / 2; ++i) keys.push_back(i);
+    }
+    return keys;
+}
+
+// arity and options, replying with what's wrong. the handler can take the
+// option positions in call as given after this
+inline bool bind_command(commandCall &call) {
+    const commandSpec &spec = call.spec;
+    const auto &toks = call.toks;
+    int argc = static_cast<int>(toks.size());
+    if (argc < spec.min_args || (spec.max_args >= 0 && argc > spec.max_args)) {
+        call.out.error(spec.usage);
+        return false;
+    }
+    if (!spec.options_at) return true;
+    size_t i = spec.options_at;
+    for (; i < toks.size(); ++i) {
+        const std::string &tk = toks[i];
+        if (spec.streams && tk == "STREAMS") {
+            call.rest = i + 1;
+            return true;
+        }
+        size_t option = 0;
+        while (option < max_options && spec.options[option].keyword && tk != spec.options[option].keyword)
+            ++option;
+        if (option == max_options || !spec.options[option].keyword) {
+            call.out.error(concat({"Unknown ", spec.name, " option: ", tk}));
+            return false;
+        }
+        int args = spec.options[option].args;
+        if (i + args >= toks.size()) {
+            call.out.error(concat({tk, args == 1 ? " needs a value" : " needs more values"}));
+            return false;
+        }
+        call.option_at[option] = i;
+        i += args;
+    }
+    if (spec.streams) {
+        call.out.error(spec.usage);
+        return false;
+    }
+    call.rest = i;
+    return true;
+}
+
+inline bool controls_transaction(const commandSpec &spec) {
+    return spec.handler == multi_handler || spec.handler == exec_handler || spec.handler == discard_handler;
+}
+
+// runs one command for session, the reply goes into out and nothing is
+// written until the caller flushes it. in a MULTI anything but the
+// transaction commands only gets checked and queued.
+inline void command_interpreter(const std::vector<std::string>& toks, redisStream& stream, replyEncoder& out,
+                                commandSession& session) {
+    if (toks.empty()) return;
+    const commandSpec *spec = find_command(toks[0]);
+    if (!spec) {
+        out.error(concat({"Unknown command: ", toks[0]}));
+        session.queue_failed |= session.in_multi;
+        return;
+    }
+    commandCall call{*spec, toks, out, &session};
+    if (!bind_command(call)) { session.queue_failed |= session.in_multi; return; }
+    if (spec->writes && stream.is_read_only()) {
+        out.error("You can't write against a read only follower.", "READONLY");
+        session.queue_failed |= session.in_multi;
+        return;
+    }
+    if (session.in_multi && !controls_transaction(*spec)) {
+        session.queue(toks);
+        out.status("QUEUED");
+        return;
+    }
+    spec->handler(call, stream);
+}
+
+// the interface has one session, like subscription_
+inline void command_interpreter(const std::vector<std::string>& toks, redisStream& stream, replyEncoder& out) {
+    static commandSession session;
+    command_interpreter(toks, stream, out, session);
+}
+
+// everything queued runs in one engine batch, so the lock is taken once
+// for all of it, other clients see none or all of it and blocked readers
+// get woken once at the end. the replies come back as one array.
+inline void exec_handler(const commandCall &call, redisStream &stream) {
+    commandSession &session = *call.session;
+    if (!session.in_multi) { call.out.error("EXEC without MULTI"); return; }
+    size_t count = session.queued_count;
+    bool failed = session.queue_failed;
+    // out of the MULTI first so the queued commands run, none of them can
+    // touch the queue since the transaction commands never get queued
+    session.end();
+    if (failed) {
+        call.out.error("Transaction discarded because of previous errors.", "EXECABORT");
+        return;
+    }
+    call.out.array(static_cast<long long>(count));
+    stream.batch([&]() {
+        for (size_t i = 0; i < count; ++i) command_interpreter(session.queued[i], stream, call.out, session);
+    });
+}
@@ -0,0 +1,154 @@
+// small LZ77 style codec for sealed block payloads, same idea as LZ4 but
+// nowhere near as tuned. block payloads are the same handful of field names
+// and mostly similar values over and over so even this gets most of it.
+//
+// the compressed bytes are a run of sequences:
+//   token    u8, high 4 bits literal count, low 4 bits match length - 4,
+//            15 in either means more length bytes follow (each adds up to
+//            255, stops at the first one below 255)
+//   literals copied as is
+//   offset   u16 back from the current output position, then the match
+//            length bytes if any
+// the last sequence is only literals and ends the input.
+
+#pragma once
+#include <cstring>
+#include <cstdint>
+#include <vector>
+
+class lzCodec
+{
+private:
+    static constexpr size_t min_match_ = 4;
+    static constexpr size_t max_offset_ = 65535;
+    static constexpr int hash_bits_ = 14;
+
+    static uint32_t read32_(const char *p)
+    {
+        uint32_t value;
+        std::memcpy(&value, p, 4);
+        return value;
+    }
+
+    static uint32_t hash_(uint32_t sequence)
+    {
+        return (sequence * 2654435761u) >> (32 - hash_bits_);
+    }
+
+    static void put_length_(std::vector<char> &out, size_t length)
+    {
+        while (length >= 255)
+        {
+            out.push_back(static_cast<char>(255));
+            length -= 255;
+        }
+        out.push_back(static_cast<char>(length));
+    }
+
+    static void put_sequence_(std::vector<char> &out, const char *literals,
+                              size_t literal_count, size_t offset,
+                              size_t match_length)
+    {
+        size_t match_code = match_length ? match_length - min_match_ : 0;
+        uint8_t token = static_cast<uint8_t>(
+            (literal_count < 15 ? literal_count : 15) << 4 |
+            (match_code < 15 ? match_code : 15));
+        out.push_back(static_cast<char>(token));
+        if (literal_count >= 15)
+            put_length_(out, literal_count - 15);
+        out.insert(out.end(), literals, literals + literal_count);
+        if (!match_length)
+            return;
+        out.push_back(static_cast<char>(offset & 0xff));
+        out.push_back(static_cast<char>(offset >> 8));
+        if (match_code >= 15)
+            put_length_(out, match_code - 15);
+    }
+
+    // reads a length continued past 15, false if the input ran out
+    static bool get_length_(const uint8_t *&in, const uint8_t *end, size_t &length)
+    {
+        uint8_t more;
+        do
+        {
+            if (in == end)
+                return false;
+            more = *in++;
+            length += more;
+        } while (more == 255);
+        return true;
+    }
+
+public:
+    static std::vector<char> compress(const char *data, size_t size)
+    {
+        std::vector<char> out;
+        out.reserve(size / 2 + 16);
+        // last position each 4 byte sequence was seen at, plus one so 0 is
+        // empty
+        std::vector<uint32_t> table(size_t(1) << hash_bits_, 0);
+        size_t pos = 0, anchor = 0;
+        while (size >= min_match_ && pos + min_match_ <= size)
+        {
+            uint32_t sequence = read32_(data + pos);
+            uint32_t &slot = table[hash_(sequence)];
+            size_t candidate = slot;
+            slot = static_cast<uint32_t>(pos + 1);
+            if (candidate == 0 || pos - (candidate - 1) > max_offset_ ||
+                read32_(data + candidate - 1) != sequence)
+            {
+                pos++;
+                continue;
+            }
+            candidate--;
+            size_t length = min_match_;
+            while (pos + length < size && data[candidate + length] == data[pos + length])
+                length++;
+            put_sequence_(out, data + anchor, pos - anchor, pos - candidate, length);
+            pos += length;
+            anchor = pos;
+        }
+        put_sequence_(out, data + anchor, size - anchor, 0, 0);
+        return out;
+    }
+
+    // out has to be exactly as big as the original, false if the input is
+    // broken instead of reading or writing past either end
+    static bool decompress(const char *data, size_t size, char *out, size_t out_size)
+    {
+        const uint8_t *in = reinterpret_cast<const uint8_t *>(data);
+        const uint8_t *end = in + size;
+        size_t written = 0;
+        while (in < end)
+        {
+            uint8_t token = *in++;
+            size_t literal_count = token >> 4;
+            if (literal_count == 15 && !get_length_(in, end, literal_count))
+                return false;
+            if (literal_count > static_cast<size_t>(end - in) ||
+                literal_count > out_size - written)
+                return false;
+            std::memcpy(out + written, in, literal_count);
+            in += literal_count;
+            written += literal_count;
+            if (in == end)
+                break;
+            if (end - in < 2)
+                return false;
+            size_t offset = in[0] | static_cast<size_t>(in[1]) << 8;
+            in += 2;
+            size_t length = token & 15;
+            if (length == 15 && !get_length_(in, end, length))
+                return false;
+            length += min_match_;
+            if (offset == 0 || offset > written || length > out_size - written)
+                return false;
+            // byte at a time on purpose, matches can overlap what they write
+            const char *from = out + written - offset;
+            for (size_t i = 0; i < length; ++i)
+                out[written + i] = from[i];
+            written += length;
+        }
+        return written == out_size;
+    }
+};
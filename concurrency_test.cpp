@@ -1,8 +1,11 @@
-#include "stream.cpp"
+#include "stream.h"
+#include <atomic>
 #include <cassert>
 #include <thread>
 #include <chrono>
+#include <climits>
 #include <iostream>
+#include <stdexcept>
 #include <vector>
 
 // here I simulate concurrent access to the stream
@@ -13,17 +16,22 @@ void test_concurrency_for_xadd() {
     // this needs to use threads
     redisStream stream;
     std::vector<long long> ids;
+    // the vector is shared too so it needs its own lock, thread sanitizer
+    // flagged the push_backs racing with each other
+    std::mutex ids_mutex;
     // timer so these things happen at the same time idk?
-    std::thread t1([&stream, &ids]() {
+    std::thread t1([&stream, &ids, &ids_mutex]() {
         FieldsStructure data1 = {{"field1", "value1"}};
         std::this_thread::sleep_for(std::chrono::milliseconds(50));
         long long id1 = stream.xadd("stream1", data1);
+        std::lock_guard<std::mutex> lock(ids_mutex);
         ids.push_back(id1);
     });
 
-    std::thread t2([&stream, &ids]() {
+    std::thread t2([&stream, &ids, &ids_mutex]() {
         FieldsStructure data2 = {{"field2", "value2"}};
         long long id2 = stream.xadd("stream1", data2);
+        std::lock_guard<std::mutex> lock(ids_mutex);
         ids.push_back(id2);
     });
 
@@ -131,8 +139,182 @@ void test_check_for_possible_deadlock(){
     std::cout << "No deadlock detected" << std::endl;
 }
 
-//eventually test for possible race conditions with many threads and periodic or
-// random delays
+// the randomized many-thread version of this lives in stress_test.cpp
+
+// subscribers waiting in pop on their own threads wake up for an xadd and
+// all of them see every entry in order
+void test_subscribers_wake_up_on_xadd() {
+    redisStream stream;
+    const int subscribers = 8;
+    const int entries = 200;
+    std::vector<std::shared_ptr<streamSubscription>> subscriptions;
+    for (int i = 0; i < subscribers; ++i)
+        subscriptions.push_back(stream.subscribe({"events"}, entries));
+    std::vector<std::thread> readers;
+    std::vector<std::vector<long long>> seen(subscribers);
+    for (int i = 0; i < subscribers; ++i) {
+        readers.emplace_back([&, i]() {
+            std::vector<PublishedEntryPointer> got;
+            while (static_cast<int>(seen[i].size()) < entries) {
+                got.clear();
+                subscriptions[i]->pop(got, 16, std::chrono::milliseconds(1000));
+                for (const auto &entry : got) seen[i].push_back(entry->id);
+                if (subscriptions[i]->closed()) break;
+            }
+        });
+    }
+    for (int i = 0; i < entries; ++i)
+        stream.xadd("events", {{"n", std::to_string(i)}});
+    for (auto &reader : readers) reader.join();
+    for (const auto &ids : seen) {
+        assert(static_cast<int>(ids.size()) == entries);
+        for (int i = 0; i < entries; ++i) assert(ids[i] == i);
+    }
+    std::cout << "test_subscribers_wake_up_on_xadd passed" << std::endl;
+}
+
+// parallel range reads from several threads while a writer keeps sealing
+// and deleting, each read has to come back in order with nothing deleted
+void test_parallel_xrange_with_writers() {
+    streamConfig config;
+    config.block_entries = 32;
+    config.compress_blocks = true;
+    config.parallel_range_entries = 64;
+    config.range_threads = 4;
+    redisStream stream(config);
+    for (int i = 0; i < 2000; ++i) stream.xadd("s", {{"n", std::to_string(i)}});
+    std::atomic<bool> done{false};
+    std::thread writer([&]() {
+        for (long long i = 0; i < 2000; ++i) {
+            stream.xadd("s", {{"n", std::to_string(i)}});
+            if (i % 3 == 0) stream.xdel("s", {i * 2});
+        }
+        done = true;
+    });
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 4; ++r) {
+        readers.emplace_back([&]() {
+            while (!done) {
+                auto entries = stream.xrange("s");
+                for (size_t i = 1; i < entries.size(); ++i) assert(entries[i - 1].first < entries[i].first);
+                for (const auto &entry : entries)
+                    assert(entry.second[0].second == std::to_string(entry.first % 2000));
+            }
+        });
+    }
+    writer.join();
+    for (auto &reader : readers) reader.join();
+    auto entries = stream.xrange("s");
+    assert(entries.size() == 4000 - 667);
+    for (const auto &entry : entries) assert(entry.first % 6 != 0);
+    assert(stream.storage_stats().parallel_ranges > 0);
+    std::cout << "test_parallel_xrange_with_writers passed" << std::endl;
+}
+
+// a batch writing to two streams is all or nothing to readers on other
+// threads, and a reader blocked on one of them wakes up to the whole batch
+void test_batches_are_atomic() {
+    redisStream stream;
+    const int batches = 500;
+    std::atomic<bool> done{false};
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 3; ++r) {
+        readers.emplace_back([&]() {
+            while (!done) {
+                auto result = stream.xread({"a", "b"}, {0, 0});
+                size_t a = result.count("a") ? result["a"].size() : 0;
+                size_t b = result.count("b") ? result["b"].size() : 0;
+                assert(a == b);
+            }
+        });
+    }
+    ResultStructure woke;
+    std::thread blocked([&]() {
+        woke = stream.xread({"c"}, {0}, 5000);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    stream.batch([&]() {
+        for (int i = 0; i < 5; ++i) stream.xadd("c", {{"n", std::to_string(i)}});
+    });
+    blocked.join();
+    assert(woke["c"].size() == 5);
+    for (int i = 0; i < batches; ++i) {
+        stream.batch([&]() {
+            stream.xadd("a", {{"n", std::to_string(i)}});
+            stream.xadd("b", {{"n", std::to_string(i)}});
+        });
+    }
+    done = true;
+    for (auto &reader : readers) reader.join();
+    assert(stream.xlen("a") == batches && stream.xlen("b") == batches);
+    std::cout << "test_batches_are_atomic passed" << std::endl;
+}
+
+// big trims and unlinks hand their blocks to the free thread while other
+// threads keep writing and reading, nobody sees anything half freed
+void test_lazy_free_with_writers() {
+    streamConfig config;
+    config.block_entries = 64;
+    redisStream stream(config);
+    for (int i = 0; i < 100000; ++i) stream.xadd("big", {{"n", std::to_string(i)}});
+    std::atomic<bool> done{false};
+    std::thread writer([&]() {
+        for (int i = 0; !done; ++i) stream.xadd("other", {{"n", std::to_string(i)}});
+    });
+    std::thread reader([&]() {
+        while (!done) {
+            auto entries = stream.xrange("big", LLONG_MIN, LLONG_MAX, 100);
+            for (size_t i = 1; i < entries.size(); ++i) assert(entries[i].first > entries[i - 1].first);
+        }
+    });
+    assert(stream.xtrim("big", MINID, 49999) == 50000);
+    assert(stream.xlen("big") == 50000);
+    assert(stream.xrange("big", LLONG_MIN, LLONG_MAX, 1)[0].first == 50000);
+    assert(stream.del({"big"}, true) == 1);
+    stream.wait_for_lazy_free();
+    done = true;
+    writer.join();
+    reader.join();
+    assert(stream.xlen("big") == 0);
+    assert(stream.memory_stats().lazyfreed == 2);
+    std::cout << "test_lazy_free_with_writers passed" << std::endl;
+}
+
+// a batch that throws still ends, what it added before the throw wakes the
+// blocked reader and reaches subscribers, and the thread that ran it goes
+// back to locking and blocking like everyone else
+void test_batch_that_throws() {
+    redisStream stream;
+    auto subscription = stream.subscribe({"c"});
+    ResultStructure woke;
+    std::thread blocked([&]() {
+        woke = stream.xread({"c"}, {0}, 5000);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    bool thrown = false;
+    try {
+        stream.batch([&]() {
+            stream.xadd("c", {{"n", "0"}});
+            throw std::runtime_error("handler failed");
+        });
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+    blocked.join();
+    assert(woke["c"].size() == 1);
+    std::vector<PublishedEntryPointer> pushed;
+    assert(subscription->pop(pushed, 16) == 1);
+
+    std::thread writer([&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        stream.xadd("d", {{"n", "0"}});
+    });
+    auto result = stream.xread({"d"}, {0}, 5000);
+    writer.join();
+    assert(result["d"].size() == 1);
+    std::cout << "test_batch_that_throws passed" << std::endl;
+}
 
 int main() {
     test_concurrency_for_xadd();
@@ -142,6 +324,11 @@ int main() {
     // it doesn't I had a bug in my makefile but keeping just in case
     std::this_thread::sleep_for(std::chrono::milliseconds(100));
     test_check_for_possible_deadlock();
+    test_subscribers_wake_up_on_xadd();
+    test_parallel_xrange_with_writers();
+    test_batches_are_atomic();
+    test_batch_that_throws();
+    test_lazy_free_with_writers();
     std::cout << "All concurrency tests passed!" << std::endl;
     return 0;
 }
@@ -1,187 +1,104 @@
 // create an interface with commands to run
 
-// probably want to use a header file instead of direct file
-#include "stream.cpp"
+#include "commands.h"
+#include "trace.h"
+#include <chrono>
 #include <iostream>
+#include <memory>
 #include <string>
-#include <vector>
-#include <optional>
-#include <sstream>
-#include <iomanip> // quoted
-#include <iterator>
 
-// I probably would have just used boosts tokenizer if I didn't want to do this.
-std::vector<std::string> tokenize_whitespace(const std::string& text) {
-    std::stringstream ss(text);
-    std::string token;
-    std::vector<std::string> tokens;
-    while (ss >> std::quoted(token)) {
-        tokens.push_back(token);
-    }
-    return tokens;
-}
-
-// parse long long from string
-static bool parse_ll(const std::string& s, long long &out) {
-    if (s.empty()) return false;
-    std::stringstream ss(s);
-    ss >> out;
-    return !ss.fail() && ss.eof();
-}
-
-static bool parse_bound(const std::string& s, long long &out) {
-    if (s == "-") { out = LLONG_MIN; return true; }
-    if (s == "+") { out = LLONG_MAX; return true; }
-    return parse_ll(s, out);
-}
-
-void command_interpreter(const std::vector<std::string>& toks, redisStream& stream) {
-    if (toks.empty()) return;
-    const std::string &op = toks[0];
-
-    if (op == "XADD") {
-        if (toks.size() < 2) { std::cerr << "XADD requires a key\n"; return; }
-        const std::string key = toks[1];
-        FieldsStructure data;
-        for (size_t i = 2; i < toks.size(); i += 2) {
-            const std::string &field = toks[i];
-            const std::string value = (i + 1 < toks.size()) ? toks[i + 1] : std::string{};
-            data.emplace_back(field, value);
-        }
-        std::cout << stream.xadd(key, data) << std::endl;
-        return;
-    } else if (op == "XREAD") {
-        std::optional<long long> count, block_time;
-        size_t i = 1;
-        // parse options until STREAMS
-        for (; i < toks.size(); ++i) {
-            const std::string &tk = toks[i];
-            if (tk == "COUNT" || tk == "BLOCK") {
-                if (i + 1 >= toks.size()) { std::cerr << tk << " needs a number\n"; return; }
-                long long v;
-                if (!parse_ll(toks[i + 1], v)) { std::cerr << tk << " invalid number: " << toks[i + 1] << '\n'; return; }
-                if (tk == "COUNT") count = v; else block_time = v;
-                ++i;
-            } else if (tk == "STREAMS") {
-                ++i;
-                break;
-            } else {
-                std::cerr << "Unknown XREAD option: " << tk << '\n'; return;
-            }
-        }
-
-        if (i >= toks.size()) { std::cerr << "XREAD STREAMS requires stream names and ids\n"; return; }
-        // remaining tokens: keys ... ids ...
-        std::vector<std::string> rest(toks.begin() + i, toks.end());
-        // find split point the first token that parses as long long
-        size_t split = rest.size();
-        long long tmp;
-        for (size_t j = 0; j < rest.size(); ++j) {
-            if (parse_ll(rest[j], tmp)) { split = j; break; }
-        }
-        if (split == rest.size()) { std::cerr << "STREAMS requires ids after keys\n"; return; }
-        std::vector<std::string> keys(rest.begin(), rest.begin() + split);
-        std::vector<long long> ids;
-        // since I know the number of ids I'm going to be adding might as well
-        // reserve for a minor boost allocating capacity only once instead
-        ids.reserve(rest.size() - split);
-        for (size_t j = split; j < rest.size(); ++j) {
-            long long id;
-            if (!parse_ll(rest[j], id)) { std::cerr << "Invalid id: " << rest[j] << '\n'; return; }
-            ids.push_back(id);
-        }
-        if (keys.size() != ids.size()) { std::cerr << "Number of keys and ids must match\n"; return; }
-        // run command xread
-        auto result = stream.xread(keys, ids, block_time, count);
-        // pretty print results
-        size_t key_index = 1;
-        for (const auto &p : result) {
-            std::cout << key_index << ") \"" << p.first << "\"\n";
-            size_t id_index = 0;
-            for (const auto &entry : p.second) {
-                std::cout << "\t" << id_index << ") " << entry.first << '\n';
-                size_t field_idx = 1;
-                for (const auto &fv : entry.second) {
-                    std::cout << "\t\t" << field_idx << ") " << fv.first << ":" << fv.second << '\n';
-                    ++field_idx;
-                }
-                ++id_index;
-            }
-            ++key_index;
-        }
-        return;
-    } else if (op == "XRANGE") {
-        if (toks.size() < 4) { std::cerr << "XRANGE requires key, start, and end\n"; return; }
-        const std::string key = toks[1];
-        long long start_id, end_id;
-        if (!parse_bound(toks[2], start_id)) { std::cerr << "Invalid start id\n"; return; }
-        if (!parse_bound(toks[3], end_id)) { std::cerr << "Invalid end id\n"; return; }
-        std::optional<long long> count;
-        if (toks.size() >= 6) {
-            if (toks[4] != "COUNT") { std::cerr << "Unrecognized XRANGE option: " << toks[4] << '\n'; return; }
-            long long v;
-            if (!parse_ll(toks[5], v)) { std::cerr << "Invalid COUNT\n"; return; }
-            count = v;
-        }
-
-        auto result = stream.xrange(key, start_id, end_id, count);
-        size_t id_index = 1;
-        for (const auto &pr : result) {
-            std::cout << id_index << ") " << pr.first << '\n';
-            size_t field_index = 1;
-            for (const auto &fv : pr.second) {
-                std::cout << '\t' << field_index << ") " << fv.first << ":" << fv.second << '\n';
-                ++field_index;
-            }
-            std::cout << '\n';
-            ++id_index;
+// ./redis_stream                         plain standalone instance
+// ./redis_stream --leader /tmp/rs.sock    lets followers replicate from it
+// ./redis_stream --replicaof /tmp/rs.sock read only copy of that leader
+// --memory-budget BYTES, --segment-dir DIR and --block-entries N set up
+// spilling old blocks to disk, --compress-blocks compresses them
+// --maxmemory BYTES caps memory, --maxmemory-policy says what gives
+// --resp replies in RESP instead of the human readable format
+// --record FILE writes every command to a trace for ./loadgen replay
+int main(int argc, char **argv) {
+    streamConfig config;
+    std::string leader_path, follower_path, record_path;
+    replyFormat format = REPLY_HUMAN;
+    for (int i = 1; i < argc; ++i) {
+        std::string flag = argv[i];
+        long long v = 0;
+        if (flag == "--compress-blocks") { config.compress_blocks = true; continue; }
+        if (flag == "--resp") { format = REPLY_RESP; continue; }
+        if (i + 1 >= argc) { flag.clear(); }
+        else if (flag == "--leader") { leader_path = argv[++i]; continue; }
+        else if (flag == "--replicaof") { follower_path = argv[++i]; continue; }
+        else if (flag == "--record") { record_path = argv[++i]; continue; }
+        else if (flag == "--segment-dir") { config.segment_dir = argv[++i]; continue; }
+        else if (flag == "--maxmemory-policy") {
+            std::string policy = argv[++i];
+            if (policy == "noeviction") { config.eviction = EVICT_NONE; continue; }
+            if (policy == "oldest-entries") { config.eviction = EVICT_OLDEST_ENTRIES; continue; }
+            if (policy == "lru-streams") { config.eviction = EVICT_LRU_STREAMS; continue; }
+            flag.clear();
         }
-        return;
-    } else if (op == "XLEN") {
-        if (toks.size() != 2) { std::cerr << "XLEN requires a key\n"; return; }
-        std::cout << stream.xlen(toks[1]) << std::endl;
-        return;
-    } else if (op == "XDEL") {
-        if (toks.size() < 3) { std::cerr << "XDEL requires key and at least one id\n"; return; }
-        const std::string key = toks[1];
-        std::vector<long long> ids;
-        for (size_t j = 2; j < toks.size(); ++j) {
-            long long v;
-            if (!parse_ll(toks[j], v)) { std::cerr << "Invalid id: " << toks[j] << '\n'; return; }
-            ids.push_back(v);
+        else if (flag == "--maxmemory" && parse_ll(argv[i + 1], v) && v >= 0) {
+            config.max_memory = v;
+            ++i;
+            continue;
         }
-        std::cout << stream.xdel(key, ids) << std::endl;
-        return;
-    } else if (op == "XTRIM") {
-        if (toks.size() < 4) { std::cerr << "XTRIM requires key, strategy, and threshold\n"; return; }
-        const std::string key = toks[1];
-        const std::string strategy = toks[2];
-        long long threshold;
-        if (!parse_ll(toks[3], threshold)) { std::cerr << "Invalid threshold\n"; return; }
-        if (strategy == "MINID") {
-            std::cout << stream.xtrim(key, MINID, threshold) << std::endl;
-        } else if (strategy == "MAXLEN") {
-            // shouldn't run this when max length threshold exceeds current length
-            std::cout << stream.xtrim(key, MAXLEN, threshold) << std::endl;
-        } else {
-            std::cerr << "Unknown XTRIM strategy: " << strategy << '\n';
+        else if ((flag == "--memory-budget" || flag == "--block-entries") &&
+                 parse_ll(argv[i + 1], v) && v >= 0) {
+            (flag == "--memory-budget" ? config.memory_budget : config.block_entries) = v;
+            ++i;
+            continue;
         }
-        return;
+        std::cerr << "usage: " << argv[0] << " [--leader PATH | --replicaof PATH]"
+                  << " [--memory-budget BYTES] [--segment-dir DIR] [--block-entries N]"
+                  << " [--compress-blocks] [--resp] [--record FILE] [--maxmemory BYTES]"
+                  << " [--maxmemory-policy noeviction|oldest-entries|lru-streams]\n";
+        return 1;
     }
-    std::cerr << "Unknown command: " << op << '\n';
-}
 
-int main() {
-    std::cout << "Hi there, welcome to my toy redis stream implementation!\n";
-    std::cout << "Type a command!\n";
-    redisStream stream;
+    redisStream stream(config);
+    std::unique_ptr<replicationLeader> leader;
+    std::unique_ptr<replicationFollower> follower;
+    if (!leader_path.empty()) {
+        leader = std::make_unique<replicationLeader>(stream, leader_path);
+        if (!leader->start()) { std::cerr << "can't listen on " << leader_path << '\n'; return 1; }
+        leader_ = leader.get();
+    } else if (!follower_path.empty()) {
+        follower = std::make_unique<replicationFollower>(stream, follower_path);
+        if (!follower->start()) { std::cerr << "bad socket path " << follower_path << '\n'; return 1; }
+        follower_ = follower.get();
+    }
+    traceWriter trace;
+    if (!record_path.empty() && !trace.open(record_path)) {
+        std::cerr << "can't write " << record_path << '\n';
+        return 1;
+    }
+    auto started = std::chrono::steady_clock::now();
+    // replies are written straight to the fd by the encoder, cin doesn't
+    // need to stay in step with stdio either and buffering it lets us see
+    // when more commands are already waiting
+    std::ios::sync_with_stdio(false);
+    replyEncoder out(format);
+    out.raw("Hi there, welcome to my toy redis stream implementation!\n");
+    out.raw("Type a command!\n");
     std::string line;
     while (true) {
-        std::cout << "> ";
+        drain_subscription(out);
+        out.raw("> ");
+        // pipelined commands that are already read in get answered with one
+        // write once they've all run
+        if (std::cin.rdbuf()->in_avail() <= 0) out.flush();
         if (!std::getline(std::cin, line)) break;
         auto toks = tokenize_whitespace(line);
         if (toks.empty()) continue;
-        command_interpreter(toks, stream);
+        if (!record_path.empty()) {
+            traceRecord record;
+            record.at_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - started).count();
+            record.toks = toks;
+            trace.add(record);
+        }
+        command_interpreter(toks, stream, out);
     }
+    out.flush();
+    if (!trace.close()) std::cerr << "failed writing " << record_path << '\n';
     return 0;
 }
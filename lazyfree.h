@@ -0,0 +1,107 @@
+// frees things on a background thread, like Redis' lazyfree. dropping a
+// stream or trimming millions of entries used to run every destructor with
+// the stream lock held and everyone else waited for it. now whoever holds
+// the lock only unhooks the memory and drops it in here, the thread lets
+// go of it later with nobody waiting.
+//
+// anything movable can go in, it's kept as a shared_ptr<void> so the right
+// destructor runs on the thread without this knowing what it was.
+
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+class lazyFreer
+{
+private:
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::condition_variable idle_;
+    std::vector<std::shared_ptr<void>> queue_;
+    std::thread thread_;
+    size_t pending_ = 0; // queued or being freed right now
+    size_t freed_ = 0;
+    bool stopping_ = false;
+
+    void loop_()
+    {
+        std::vector<std::shared_ptr<void>> freeing;
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true)
+        {
+            ready_.wait(lock, [this]
+                        { return stopping_ || !queue_.empty(); });
+            if (queue_.empty())
+                return;
+            freeing.swap(queue_);
+            lock.unlock();
+            size_t n = freeing.size();
+            freeing.clear(); // the destructors run here
+            lock.lock();
+            pending_ -= n;
+            freed_ += n;
+            if (!pending_)
+                idle_.notify_all();
+        }
+    }
+
+public:
+    lazyFreer() = default;
+    lazyFreer(const lazyFreer &) = delete;
+    lazyFreer &operator=(const lazyFreer &) = delete;
+
+    // anything still queued gets freed before this returns
+    ~lazyFreer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        ready_.notify_all();
+        if (thread_.joinable())
+            thread_.join();
+    }
+
+    // moves garbage in, the thread starts the first time there's any
+    template <typename T>
+    void free(T &&garbage)
+    {
+        auto held = std::make_shared<std::decay_t<T>>(std::forward<T>(garbage));
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.push_back(std::move(held));
+            pending_++;
+            if (!thread_.joinable())
+                thread_ = std::thread([this]
+                                      { loop_(); });
+        }
+        ready_.notify_one();
+    }
+
+    // waits until everything handed over so far has been freed
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_.wait(lock, [this]
+                   { return pending_ == 0; });
+    }
+
+    size_t pending()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return pending_;
+    }
+
+    // how many things were handed over and freed so far
+    size_t freed()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return freed_;
+    }
+};
@@ -0,0 +1,334 @@
+// load generator for the command interface. records command traces,
+// replays them on many threads at the recorded pace or faster, and makes up
+// synthetic mixes. every run prints throughput and latency percentiles.
+//
+// ./loadgen record FILE < commands     one command per line, timed as it comes in
+// ./loadgen replay FILE [--threads N] [--speed X]
+//     X times the recorded pace, 0 (the default) as fast as it goes
+// ./loadgen synth [--ops N] [--threads N] [--keys K] [--skew S] [--fields F]
+//                 [--payload BYTES] [--reads R] [--count C] [--preload N]
+//                 [--rate OPS] [--seed N] [--save FILE]
+//     S is the zipf exponent for picking keys (0 is uniform), R the share
+//     of reads, C the COUNT on XRANGE. --rate paces it open loop, --save
+//     writes the mix out as a trace to replay later.
+// --block-entries N, --compress-blocks and --maxmemory BYTES set up the
+// engine like they do for the interface.
+
+#include "commands.h"
+#include "trace.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using steadyClock = std::chrono::steady_clock;
+
+// what the commands run against. just the engine in this process for now,
+// a client talking to a server would be another one of these. every client
+// in the trace gets its own session so MULTI/EXEC replays the way it ran.
+using commandTarget = std::function<void(const std::vector<std::string> &, replyEncoder &, commandSession &)>;
+
+struct threadResult {
+    std::vector<long long> latencies_ns;
+    std::map<std::string, std::vector<long long>> by_command;
+    size_t errors = 0;
+};
+
+// per thread lists of records, each thread runs its own in order
+using traceShards = std::vector<std::vector<traceRecord>>;
+
+// replays the shards on one thread each. with speed > 0 a record is due at
+// at_us / speed after the start and its latency counts from then, not from
+// when the thread got to it, so a stall shows up in the numbers instead of
+// just pushing everything after it back. waking up from the sleep takes
+// some tens of us too and that shows up as well.
+static std::vector<threadResult> run_shards(const traceShards &shards, const commandTarget &target,
+                                            double speed, double &seconds) {
+    std::vector<threadResult> results(shards.size());
+    std::vector<std::thread> threads;
+    auto start = steadyClock::now() + std::chrono::milliseconds(10);
+    for (size_t t = 0; t < shards.size(); ++t) {
+        threads.emplace_back([&, t]() {
+            replyEncoder out;
+            std::map<uint32_t, commandSession> sessions;
+            threadResult &result = results[t];
+            result.latencies_ns.reserve(shards[t].size());
+            std::this_thread::sleep_until(start);
+            for (const auto &record : shards[t]) {
+                auto due = start;
+                if (speed > 0) {
+                    due += std::chrono::microseconds(static_cast<long long>(record.at_us / speed));
+                    std::this_thread::sleep_until(due);
+                }
+                auto began = steadyClock::now();
+                target(record.toks, out, sessions[record.client]);
+                auto took = steadyClock::now() - (speed > 0 ? due : began);
+                long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(took).count();
+                result.latencies_ns.push_back(ns);
+                std::string name = record.toks[0];
+                std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+                result.by_command[name].push_back(ns);
+                if (!out.errors().empty()) result.errors++;
+                out.clear();
+            }
+        });
+    }
+    for (auto &thread : threads) thread.join();
+    seconds = std::chrono::duration<double>(steadyClock::now() - start).count();
+    return results;
+}
+
+static std::string percentiles(std::vector<long long> &ns) {
+    std::sort(ns.begin(), ns.end());
+    auto at = [&ns](double p) {
+        size_t i = static_cast<size_t>(std::ceil(p * ns.size()));
+        return ns[std::min(ns.size() - 1, i ? i - 1 : 0)] / 1e3;
+    };
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(1) << "p50 " << std::setw(8) << at(0.5) << "  p90 "
+         << std::setw(8) << at(0.9) << "  p99 " << std::setw(8) << at(0.99) << "  p99.9 "
+         << std::setw(8) << at(0.999) << "  max " << std::setw(9) << ns.back() / 1e3 << " us";
+    return line.str();
+}
+
+static void report(std::vector<threadResult> &results, double seconds) {
+    std::vector<long long> all;
+    std::map<std::string, std::vector<long long>> by_command;
+    size_t errors = 0;
+    for (auto &result : results) {
+        all.insert(all.end(), result.latencies_ns.begin(), result.latencies_ns.end());
+        for (auto &command : result.by_command) {
+            auto &into = by_command[command.first];
+            into.insert(into.end(), command.second.begin(), command.second.end());
+        }
+        errors += result.errors;
+    }
+    if (all.empty()) {
+        std::cout << "nothing to run\n";
+        return;
+    }
+    std::cout << std::fixed << std::setprecision(3) << all.size() << " commands on " << results.size()
+              << " threads in " << seconds << " s, " << std::setprecision(0) << all.size() / seconds
+              << " commands/s, " << errors << " errors\n";
+    std::cout << "  " << std::left << std::setw(12) << "all" << std::right << std::setw(10) << all.size()
+              << "  " << percentiles(all) << '\n';
+    for (auto &command : by_command)
+        std::cout << "  " << std::left << std::setw(12) << command.first << std::right << std::setw(10)
+                  << command.second.size() << "  " << percentiles(command.second) << '\n';
+}
+
+// sessions subscribe through one global in commands.h, threads can't share it
+static bool replayable(const traceRecord &record) {
+    if (record.toks.empty()) return false;
+    std::string name = record.toks[0];
+    std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+    return name != "XSUBSCRIBE" && name != "XUNSUBSCRIBE";
+}
+
+static int record_main(const std::string &path) {
+    traceWriter trace;
+    if (!trace.open(path)) { std::cerr << "can't write " << path << '\n'; return 1; }
+    auto start = steadyClock::now();
+    std::string line;
+    size_t records = 0;
+    while (std::getline(std::cin, line)) {
+        traceRecord record;
+        record.toks = tokenize_whitespace(line);
+        if (record.toks.empty()) continue;
+        record.at_us = std::chrono::duration_cast<std::chrono::microseconds>(steadyClock::now() - start).count();
+        trace.add(record);
+        records++;
+    }
+    if (!trace.close()) { std::cerr << "failed writing " << path << '\n'; return 1; }
+    std::cout << records << " commands recorded to " << path << '\n';
+    return 0;
+}
+
+static int replay_main(const std::string &path, size_t threads, double speed, const commandTarget &target) {
+    traceReader trace;
+    if (!trace.open(path)) { std::cerr << path << " isn't a trace\n"; return 1; }
+    traceShards shards(threads);
+    traceRecord record;
+    size_t skipped = 0;
+    while (trace.next(record)) {
+        if (!replayable(record)) { skipped++; continue; }
+        shards[record.client % threads].push_back(record);
+    }
+    if (trace.bad()) std::cerr << "trace is cut off, replaying what was read\n";
+    if (skipped) std::cout << skipped << " subscribe commands skipped\n";
+    double seconds = 0;
+    auto results = run_shards(shards, target, speed, seconds);
+    report(results, seconds);
+    return 0;
+}
+
+struct synthConfig {
+    long long ops = 100000;
+    size_t threads = 4;
+    long long keys = 1000;
+    double skew = 0.99;
+    long long fields = 2;
+    long long payload = 32;
+    double reads = 0.5;
+    long long count = 10;
+    long long preload = 0;
+    long long rate = 0; // ops per second for all threads together, 0 closed loop
+    long long seed = 1;
+    std::string save;
+};
+
+// key i gets picked with probability proportional to 1 / (i + 1)^skew
+class zipfKeys {
+private:
+    std::vector<double> cdf_;
+
+public:
+    zipfKeys(long long keys, double skew) : cdf_(keys) {
+        double total = 0;
+        for (long long i = 0; i < keys; ++i) cdf_[i] = total += 1 / std::pow(i + 1, skew);
+        for (auto &c : cdf_) c /= total;
+    }
+    template <typename Rng>
+    long long operator()(Rng &rng) const {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        return std::min<long long>(std::lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin(),
+                                   cdf_.size() - 1);
+    }
+};
+
+static std::string key_name(long long key) { return "key:" + std::to_string(key); }
+
+static traceRecord synth_write(long long key, const synthConfig &config, std::mt19937_64 &rng) {
+    traceRecord record;
+    record.toks = {"XADD", key_name(key)};
+    for (long long f = 0; f < config.fields; ++f) {
+        std::string value(config.payload, 'a');
+        for (auto &c : value) c = static_cast<char>('a' + rng() % 26);
+        record.toks.push_back("f" + std::to_string(f));
+        record.toks.push_back(std::move(value));
+    }
+    return record;
+}
+
+static int synth_main(const synthConfig &config, redisStream &stream, const commandTarget &target) {
+    if (config.threads == 0 || config.keys <= 0) { std::cerr << "need at least one thread and key\n"; return 1; }
+    zipfKeys pick(config.keys, config.skew);
+    std::mt19937_64 rng(config.seed);
+    traceShards shards(config.threads);
+    for (long long i = 0; i < config.ops; ++i) {
+        long long key = pick(rng);
+        traceRecord record;
+        if (std::uniform_real_distribution<double>(0, 1)(rng) < config.reads) {
+            // mostly short ranges, XLEN now and then
+            if (rng() % 4)
+                record.toks = {"XRANGE", key_name(key), "-", "+", "COUNT", std::to_string(config.count)};
+            else
+                record.toks = {"XLEN", key_name(key)};
+        } else {
+            record = synth_write(key, config, rng);
+        }
+        record.client = static_cast<uint32_t>(i % config.threads);
+        record.at_us = config.rate > 0 ? i * 1000000 / config.rate : 0;
+        shards[record.client].push_back(std::move(record));
+    }
+    if (!config.save.empty()) {
+        traceWriter trace;
+        bool ok = trace.open(config.save);
+        // back in time order, round robin over the shards is that order
+        for (long long i = 0; ok && i < config.ops; ++i)
+            trace.add(shards[i % config.threads][i / config.threads]);
+        if (!ok || !trace.close()) { std::cerr << "failed writing " << config.save << '\n'; return 1; }
+        std::cout << config.ops << " commands saved to " << config.save << '\n';
+    }
+    for (long long key = 0; key < config.keys && config.preload > 0; ++key) {
+        for (long long n = 0; n < config.preload; ++n) {
+            traceRecord record = synth_write(key, config, rng);
+            FieldsStructure fields;
+            for (size_t t = 2; t + 1 < record.toks.size(); t += 2)
+                fields.emplace_back(record.toks[t], record.toks[t + 1]);
+            stream.xadd(record.toks[1], std::move(fields));
+        }
+    }
+    std::cout << config.ops << " commands, " << config.keys << " keys (skew " << config.skew << "), "
+              << config.reads * 100 << "% reads, " << config.fields << " x " << config.payload
+              << " byte fields" << (config.rate > 0 ? ", " + std::to_string(config.rate) + " ops/s" : "")
+              << '\n';
+    double seconds = 0;
+    auto results = run_shards(shards, target, config.rate > 0 ? 1 : 0, seconds);
+    report(results, seconds);
+    return 0;
+}
+
+static int usage(const char *self) {
+    std::cerr << "usage: " << self << " record FILE | replay FILE [--threads N] [--speed X]"
+              << " | synth [--ops N] [--threads N] [--keys K] [--skew S] [--fields F] [--payload BYTES]"
+              << " [--reads R] [--count C] [--preload N] [--rate OPS] [--seed N] [--save FILE]\n"
+              << "  engine: [--block-entries N] [--compress-blocks] [--maxmemory BYTES]\n";
+    return 1;
+}
+
+static bool parse_double(const std::string &s, double &out) {
+    char *end = nullptr;
+    out = std::strtod(s.c_str(), &end);
+    return !s.empty() && end && *end == '\0' && out >= 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) return usage(argv[0]);
+    std::string mode = argv[1], path;
+    int i = 2;
+    if (mode == "record" || mode == "replay") {
+        if (argc < 3) return usage(argv[0]);
+        path = argv[i++];
+    } else if (mode != "synth") {
+        return usage(argv[0]);
+    }
+    streamConfig engine;
+    synthConfig synth;
+    double speed = 0;
+    for (; i < argc; ++i) {
+        std::string flag = argv[i];
+        long long v = 0;
+        double d = 0;
+        if (flag == "--compress-blocks") { engine.compress_blocks = true; continue; }
+        if (i + 1 >= argc) return usage(argv[0]);
+        std::string value = argv[++i];
+        if (flag == "--save") { synth.save = value; continue; }
+        if ((flag == "--speed" || flag == "--skew" || flag == "--reads") && parse_double(value, d)) {
+            (flag == "--speed" ? speed : flag == "--skew" ? synth.skew : synth.reads) = d;
+            continue;
+        }
+        if (!parse_ll(value, v) || v < 0) return usage(argv[0]);
+        if (flag == "--threads") synth.threads = v;
+        else if (flag == "--ops") synth.ops = v;
+        else if (flag == "--keys") synth.keys = v;
+        else if (flag == "--fields") synth.fields = v;
+        else if (flag == "--payload") synth.payload = v;
+        else if (flag == "--count") synth.count = v;
+        else if (flag == "--preload") synth.preload = v;
+        else if (flag == "--rate") synth.rate = v;
+        else if (flag == "--seed") synth.seed = v;
+        else if (flag == "--block-entries") engine.block_entries = v;
+        else if (flag == "--maxmemory") engine.max_memory = v;
+        else return usage(argv[0]);
+    }
+    if (mode == "record") return record_main(path);
+
+    redisStream stream(engine);
+    commandTarget target = [&stream](const std::vector<std::string> &toks, replyEncoder &out,
+                                     commandSession &session) {
+        command_interpreter(toks, stream, out, session);
+    };
+    if (mode == "replay") return replay_main(path, std::max<size_t>(1, synth.threads), speed, target);
+    return synth_main(synth, stream, target);
+}
@@ -1,7 +1,7 @@
 // create an interface with commands to run
 
 // probably want to use a header file instead of direct file
-#include "stream.cpp"
+#include "stream.h"
 #include <iostream>
 #include <sstream>
 #include <map>
@@ -0,0 +1,101 @@
+// small fixed pool of worker threads for splitting one big job into
+// numbered tasks, used by range reads over lots of sealed blocks. the
+// calling thread works on tasks too and run only returns once every task
+// is done, so whatever the caller holds (the stream lock) stays held for
+// the whole thing.
+
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class workerPool
+{
+private:
+    std::vector<std::thread> threads_;
+    std::mutex run_mutex_; // one job at a time
+    std::mutex mutex_;
+    std::condition_variable work_ready_;
+    std::condition_variable work_done_;
+    const std::function<void(size_t)> *task_ = nullptr;
+    size_t tasks_ = 0;
+    size_t next_ = 0;
+    size_t finished_ = 0;
+    unsigned long long job_ = 0;
+    bool stopping_ = false;
+
+    // takes tasks off the current job until there are none left, caller
+    // holds lock and gets it back held
+    void work_(std::unique_lock<std::mutex> &lock)
+    {
+        while (next_ < tasks_)
+        {
+            size_t task = next_++;
+            const auto &run = *task_;
+            lock.unlock();
+            run(task);
+            lock.lock();
+            if (++finished_ == tasks_)
+                work_done_.notify_all();
+        }
+    }
+
+    void loop_()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        unsigned long long seen = 0;
+        while (true)
+        {
+            work_ready_.wait(lock, [this, &seen]
+                             { return stopping_ || job_ != seen; });
+            if (stopping_)
+                return;
+            seen = job_;
+            work_(lock);
+        }
+    }
+
+public:
+    // threads on top of the caller, 0 runs everything on the caller
+    explicit workerPool(size_t threads)
+    {
+        for (size_t i = 0; i < threads; ++i)
+            threads_.emplace_back([this]
+                                  { loop_(); });
+    }
+
+    ~workerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        work_ready_.notify_all();
+        for (auto &thread : threads_)
+            thread.join();
+    }
+
+    size_t threads() const { return threads_.size() + 1; }
+
+    // runs task(0) .. task(tasks - 1) spread over the pool and the caller,
+    // in no particular order, and waits for all of them
+    void run(size_t tasks, const std::function<void(size_t)> &task)
+    {
+        std::lock_guard<std::mutex> running(run_mutex_);
+        std::unique_lock<std::mutex> lock(mutex_);
+        task_ = &task;
+        tasks_ = tasks;
+        next_ = 0;
+        finished_ = 0;
+        job_++;
+        work_ready_.notify_all();
+        work_(lock);
+        work_done_.wait(lock, [this]
+                        { return finished_ == tasks_; });
+        task_ = nullptr;
+        tasks_ = 0;
+    }
+};
@@ -1,7 +1,12 @@
-#include "stream.cpp"
+#include "stream.h"
+#include "commands.h"
+#include "trace.h"
 #include <cassert>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
 #include <limits>
+#include <random>
 #include <thread>
 
 void test_xadd() {
@@ -296,6 +301,1139 @@ void test_xtrim_minid_trim_up_to(){
     assert(stream.xrange("mystream", 0, -1)[0].first == 1);
 }
 
+// small blocks so a handful of entries already ends up sealed
+static streamConfig small_blocks(size_t block_entries, size_t memory_budget = 0) {
+    streamConfig config;
+    config.block_entries = block_entries;
+    config.memory_budget = memory_budget;
+    return config;
+}
+
+void test_xrange_across_sealed_blocks() {
+    redisStream stream(small_blocks(4));
+    for (int i = 0; i < 30; ++i)
+        stream.xadd("mystream", {{"n", std::to_string(i)}});
+    assert(stream.storage_stats().sealed_blocks > 0);
+    assert(stream.xlen("mystream") == 30);
+
+    auto result = stream.xrange("mystream", 0, LLONG_MAX);
+    assert(result.size() == 30);
+    for (int i = 0; i < 30; ++i) {
+        assert(result[i].first == i);
+        assert(result[i].second[0].second == std::to_string(i));
+    }
+    // starting and stopping in the middle of blocks
+    result = stream.xrange("mystream", 3, 9);
+    assert(result.size() == 7);
+    assert(result.front().first == 3 && result.back().first == 9);
+    result = stream.xrange("mystream", 6, LLONG_MAX, 5);
+    assert(result.size() == 5);
+    assert(result.back().first == 10);
+    auto read = stream.xread({"mystream"}, {25});
+    assert(read["mystream"].size() == 5);
+    std::cout << "test_xrange_across_sealed_blocks passed" << std::endl;
+}
+
+void test_xdel_in_sealed_block() {
+    redisStream stream(small_blocks(4));
+    for (int i = 0; i < 20; ++i)
+        stream.xadd("mystream", {{"n", std::to_string(i)}});
+    size_t deleted = stream.xdel("mystream", {1, 2, 2, 5, 100});
+    assert(deleted == 3);
+    assert(stream.xlen("mystream") == 17);
+    // deleting everything in a block gets rid of the block
+    size_t blocks = stream.storage_stats().sealed_blocks;
+    deleted = stream.xdel("mystream", {0, 3});
+    assert(deleted == 2);
+    assert(stream.storage_stats().sealed_blocks == blocks - 1);
+    auto result = stream.xrange("mystream", 0, 8);
+    assert(result.size() == 4);
+    assert(result[0].first == 4 && result[1].first == 6);
+    std::cout << "test_xdel_in_sealed_block passed" << std::endl;
+}
+
+void test_xtrim_across_sealed_blocks() {
+    redisStream stream(small_blocks(4));
+    for (int i = 0; i < 20; ++i)
+        stream.xadd("mystream", {{"n", std::to_string(i)}});
+    // MINID in the middle of a block
+    size_t trimmed = stream.xtrim("mystream", MINID, 5);
+    assert(trimmed == 6);
+    assert(stream.xrange("mystream", 0, LLONG_MAX)[0].first == 6);
+    // MAXLEN takes from the tail and then the newest blocks
+    trimmed = stream.xtrim("mystream", MAXLEN, 11);
+    assert(trimmed == 11);
+    auto result = stream.xrange("mystream", 0, LLONG_MAX);
+    assert(result.size() == 3);
+    assert(result.back().first == 8);
+    std::cout << "test_xtrim_across_sealed_blocks passed" << std::endl;
+}
+
+void test_cold_blocks_spill_to_segment_files() {
+    // budget of about one block so nearly everything ends up on disk
+    redisStream stream(small_blocks(16, 512));
+    for (int i = 0; i < 500; ++i)
+        stream.xadd("mystream", {{"payload", std::string(20, 'a' + i % 26)}});
+    storageStats stats = stream.storage_stats();
+    assert(stats.spilled_blocks > 0);
+    assert(stats.resident_bytes <= 512 + stats.resident_bytes / stats.sealed_blocks);
+    assert(stats.spilled_bytes > 0);
+
+    auto result = stream.xrange("mystream", 0, LLONG_MAX);
+    assert(result.size() == 500);
+    for (int i = 0; i < 500; ++i)
+        assert(result[i].second[0].second == std::string(20, 'a' + i % 26));
+    // deletes and trims still work on spilled blocks
+    assert(stream.xdel("mystream", {0, 17}) == 2);
+    assert(stream.xtrim("mystream", MINID, 40) == 39);
+    assert(stream.xrange("mystream", 0, LLONG_MAX)[0].first == 41);
+    std::cout << "test_cold_blocks_spill_to_segment_files passed" << std::endl;
+}
+
+void test_xrange_where_with_index() {
+    redisStream stream(small_blocks(4));
+    assert(stream.create_index("mystream", "device"));
+    assert(!stream.create_index("mystream", "device"));
+    for (int i = 0; i < 40; ++i)
+        stream.xadd("mystream", {{"device", i % 3 == 0 ? "abc" : "xyz"},
+                                 {"n", std::to_string(i)}});
+    auto result = stream.xrange_where("mystream", LLONG_MIN, LLONG_MAX, "device", "abc");
+    assert(result.size() == 14);
+    for (const auto &entry : result)
+        assert(entry.first % 3 == 0 && entry.second[0].second == "abc");
+    result = stream.xrange_where("mystream", 4, 20, "device", "abc", 3);
+    assert(result.size() == 3);
+    assert(result[0].first == 6 && result[2].first == 12);
+    assert(stream.xrange_where("mystream", LLONG_MIN, LLONG_MAX, "device", "nope").empty());
+
+    // the index follows deletes and trims, including in sealed blocks
+    stream.xdel("mystream", {0, 3, 39});
+    stream.xtrim("mystream", MINID, 10);
+    stream.xtrim("mystream", MAXLEN, 3); // drops 37, 38 and 36
+    result = stream.xrange_where("mystream", LLONG_MIN, LLONG_MAX, "device", "abc");
+    assert(result.size() == 8);
+    assert(result.front().first == 12 && result.back().first == 33);
+    std::cout << "test_xrange_where_with_index passed" << std::endl;
+}
+
+void test_xrange_where_without_index() {
+    redisStream stream(small_blocks(4));
+    for (int i = 0; i < 40; ++i)
+        stream.xadd("mystream", {{"device", i % 3 == 0 ? "abc" : "xyz"}});
+    auto scanned = stream.xrange_where("mystream", LLONG_MIN, LLONG_MAX, "device", "abc");
+    assert(scanned.size() == 14);
+    // building the index afterwards covers what's already there
+    assert(stream.create_index("mystream", "device"));
+    assert(stream.xrange_where("mystream", LLONG_MIN, LLONG_MAX, "device", "abc") == scanned);
+    assert(stream.drop_index("mystream", "device"));
+    assert(!stream.drop_index("mystream", "device"));
+    std::cout << "test_xrange_where_without_index passed" << std::endl;
+}
+
+// XINDEX on a stream that isn't there doesn't make one, the index waits for it
+void test_xindex_on_missing_stream() {
+    redisStream stream;
+    replyEncoder info(REPLY_HUMAN);
+    command_interpreter({"INFO"}, stream, info);
+    replyEncoder out(REPLY_RESP);
+    command_interpreter({"XINDEX", "CREATE", "missing", "device"}, stream, out);
+    command_interpreter({"XINDEX", "CREATE", "missing", "device"}, stream, out);
+    command_interpreter({"XLEN", "missing"}, stream, out);
+    assert(out.buffer() == ":1\r\n:0\r\n:0\r\n");
+    replyEncoder after(REPLY_HUMAN);
+    command_interpreter({"INFO"}, stream, after);
+    assert(after.buffer() == info.buffer());
+    // dropping it before the stream shows up works too
+    assert(stream.create_index("other", "device"));
+    assert(stream.drop_index("other", "device"));
+    assert(!stream.drop_index("other", "device"));
+    stream.xadd("other", {{"device", "abc"}});
+    assert(stream.create_index("other", "device"));
+    stream.xadd("missing", {{"device", "abc"}});
+    assert(!stream.create_index("missing", "device"));
+    assert(stream.xrange_where("missing", LLONG_MIN, LLONG_MAX, "device", "abc").size() == 1);
+    std::cout << "test_xindex_on_missing_stream passed" << std::endl;
+}
+
+void test_xagg() {
+    redisStream stream(small_blocks(4, 256));
+    for (int i = 0; i < 30; ++i)
+        stream.xadd("mystream", {{"reading", std::to_string(i)}, {"unit", "c"}});
+    // not numbers and missing fields don't count
+    stream.xadd("mystream", {{"reading", "n/a"}});
+    stream.xadd("mystream", {{"other", "5"}});
+    assert(stream.storage_stats().spilled_blocks > 0);
+
+    auto total = stream.xagg("mystream", LLONG_MIN, LLONG_MAX, "reading");
+    assert(total.size() == 1);
+    assert(total[0].count == 30 && total[0].sum == 435);
+    assert(total[0].min == 0 && total[0].max == 29);
+    // ranges that start and stop inside blocks and reach into the tail
+    auto part = stream.xagg("mystream", 3, 26, "reading");
+    assert(part[0].count == 24 && part[0].sum == 348);
+    assert(part[0].min == 3 && part[0].max == 26);
+    assert(stream.xagg("mystream", LLONG_MIN, LLONG_MAX, "unit")[0].count == 0);
+    assert(stream.xagg("nope", LLONG_MIN, LLONG_MAX, "reading")[0].count == 0);
+
+    // everything went in within a few ms so a big bucket gets all of it and
+    // 1ms buckets add back up to the same thing
+    auto buckets = stream.xagg("mystream", LLONG_MIN, LLONG_MAX, "reading", 3600000);
+    assert(buckets.size() <= 2);
+    long long count = 0;
+    double sum = 0;
+    for (const auto &bucket : stream.xagg("mystream", LLONG_MIN, LLONG_MAX, "reading", 1)) {
+        assert(bucket.count > 0);
+        count += bucket.count;
+        sum += bucket.sum;
+    }
+    assert(count == 30 && sum == 435);
+
+    // still right after a delete rewrites a block
+    stream.xdel("mystream", {1, 2});
+    total = stream.xagg("mystream", LLONG_MIN, LLONG_MAX, "reading");
+    assert(total[0].count == 28 && total[0].sum == 432);
+    std::cout << "test_xagg passed" << std::endl;
+}
+
+void test_lz_codec_round_trip() {
+    std::vector<std::string> inputs = {"", "a", "abc", "abcd",
+                                       std::string(1000, 'x'),
+                                       "device:sensor-1 device:sensor-2 device:sensor-3"};
+    std::string noise;
+    for (int i = 0; i < 5000; ++i)
+        noise += static_cast<char>((i * 7919 + i / 13) % 251);
+    inputs.push_back(noise);
+    for (const auto &input : inputs) {
+        std::vector<char> packed = lzCodec::compress(input.data(), input.size());
+        std::string out(input.size(), '\0');
+        assert(lzCodec::decompress(packed.data(), packed.size(), &out[0], out.size()));
+        assert(out == input);
+    }
+    std::vector<char> packed = lzCodec::compress(inputs[4].data(), inputs[4].size());
+    assert(packed.size() < 50);
+    // truncated input fails instead of reading off the end
+    std::string out(1000, '\0');
+    assert(!lzCodec::decompress(packed.data(), packed.size() / 2, &out[0], out.size()));
+    std::cout << "test_lz_codec_round_trip passed" << std::endl;
+}
+
+void test_compressed_blocks() {
+    streamConfig config = small_blocks(16, 1024);
+    config.compress_blocks = true;
+    config.decompressed_blocks = 2;
+    redisStream stream(config);
+    for (int i = 0; i < 300; ++i)
+        stream.xadd("mystream", {{"device", "sensor-" + std::to_string(i % 4)},
+                                 {"reading", std::to_string(i)},
+                                 {"payload", std::string(40, 'a' + i % 3)}});
+    storageStats stats = stream.storage_stats();
+    assert(stats.spilled_blocks > 0);
+    assert(stats.stored_payload_bytes * 2 < stats.payload_bytes);
+
+    auto result = stream.xrange("mystream", 0, LLONG_MAX);
+    assert(result.size() == 300);
+    for (int i = 0; i < 300; ++i) {
+        assert(result[i].second[1].second == std::to_string(i));
+        assert(result[i].second[2].second == std::string(40, 'a' + i % 3));
+    }
+    // only a couple of blocks stay decompressed
+    stats = stream.storage_stats();
+    assert(stats.decompress_misses > 0);
+    assert(stats.decompressed_bytes <= 2 * stats.payload_bytes / stats.sealed_blocks + 1024);
+
+    // deletes, WHERE and XAGG all go through the compressed blocks
+    assert(stream.xdel("mystream", {5, 6}) == 2);
+    assert(stream.xrange_where("mystream", LLONG_MIN, LLONG_MAX, "device", "sensor-1").size() == 74);
+    assert(stream.xagg("mystream", LLONG_MIN, LLONG_MAX, "reading")[0].count == 298);
+    std::cout << "test_compressed_blocks passed" << std::endl;
+}
+
+void test_xdel_tombstones_then_compacts() {
+    streamConfig config = small_blocks(8);
+    config.compact_ratio = 0.5;
+    redisStream stream(config);
+    for (int i = 0; i < 40; ++i)
+        stream.xadd("mystream", {{"n", std::to_string(i)}});
+    // a few deletes in the first block only tombstone it
+    assert(stream.xdel("mystream", {1, 2, 3, 3}) == 3);
+    storageStats stats = stream.storage_stats();
+    assert(stats.tombstones == 3);
+    assert(stream.xlen("mystream") == 37);
+    auto result = stream.xrange("mystream", 0, 5);
+    assert(result.size() == 3);
+    assert(result[0].first == 0 && result[1].first == 4);
+    assert(stream.xagg("mystream", 0, 7, "n")[0].sum == 0 + 4 + 5 + 6 + 7);
+    assert(stream.xtrim("mystream", MINID, 4) == 2);
+
+    // half of the second block gets the background compactor going
+    assert(stream.xdel("mystream", {8, 9, 10, 11}) == 4);
+    bool compacted = false;
+    for (int i = 0; i < 200 && !compacted; ++i) {
+        compacted = stream.storage_stats().compacted_blocks == 1;
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    assert(compacted);
+    stats = stream.storage_stats();
+    assert(stats.tombstones == 0);
+    result = stream.xrange("mystream", 5, 15);
+    assert(result.size() == 7);
+    assert(result[2].first == 7 && result[3].first == 12);
+    assert(stream.xlen("mystream") == 31);
+    std::cout << "test_xdel_tombstones_then_compacts passed" << std::endl;
+}
+
+void test_xdel_and_xlen_dont_create_streams() {
+    redisStream stream;
+    assert(stream.xdel("nope", {1}) == 0);
+    assert(stream.xlen("nope") == 0);
+    std::vector<streamSnapshot> streams;
+    stream.snapshot(streams);
+    assert(streams.empty());
+    std::cout << "test_xdel_and_xlen_dont_create_streams passed" << std::endl;
+}
+
+void test_retention_max_len_and_bytes() {
+    redisStream stream(small_blocks(8));
+    for (int i = 0; i < 100; ++i)
+        stream.xadd("mystream", {{"n", std::to_string(i)}});
+    retentionPolicy policy;
+    policy.max_len = 30;
+    stream.set_retention("mystream", policy);
+    stream.enforce_retention();
+    // unlike XTRIM MAXLEN retention keeps the newest
+    auto result = stream.xrange("mystream", 0, LLONG_MAX);
+    assert(result.size() == 30);
+    assert(result.front().first == 70 && result.back().first == 99);
+    assert(stream.maintenance_stats().retention_trimmed == 70);
+
+    policy = retentionPolicy();
+    policy.max_bytes = 2000;
+    stream.set_retention("mystream", policy);
+    stream.enforce_retention();
+    size_t left = stream.xlen("mystream");
+    assert(left > 0 && left < 30);
+    assert(stream.xrange("mystream", 0, LLONG_MAX).back().first == 99);
+    // turned off, nothing else goes
+    stream.set_retention("mystream", retentionPolicy());
+    for (int i = 0; i < 50; ++i)
+        stream.xadd("mystream", {{"n", "more"}});
+    stream.enforce_retention();
+    assert(stream.xlen("mystream") == left + 50);
+    std::cout << "test_retention_max_len_and_bytes passed" << std::endl;
+}
+
+// turning retention off on a stream that isn't there leaves it not there
+void test_retention_none_on_missing_stream() {
+    redisStream stream;
+    replyEncoder out(REPLY_RESP);
+    size_t used = stream.memory_stats().used_bytes;
+    command_interpreter({"XRETENTION", "missing", "NONE"}, stream, out);
+    stream.set_retention("missing", retentionPolicy());
+    assert(out.buffer() == "+OK\r\n" && out.errors().empty());
+    assert(stream.memory_stats().used_bytes == used);
+    assert(stream.xadd("missing", {{"f", "v"}}) == 0);
+    std::cout << "test_retention_none_on_missing_stream passed" << std::endl;
+}
+
+// a full sync keeps this node's retention policies, but not the streams
+// the leader doesn't have anymore
+void test_load_snapshot_keeps_retention_only_for_streams_it_has() {
+    redisStream stream;
+    retentionPolicy policy;
+    policy.max_len = 5;
+    stream.set_retention("gone", policy);
+    stream.set_retention("kept", policy);
+    stream.xadd("gone", {{"f", "v"}});
+    streamSnapshot kept;
+    kept.stream_name = "kept";
+    for (long long id = 0; id < 10; ++id) {
+        kept.entries.push_back({id, {{"n", std::to_string(id)}}});
+        kept.arrival_ms.push_back(1000 + id);
+    }
+    kept.next_id = 10;
+    stream.load_snapshot({kept}, "leader", 7);
+    std::vector<streamSnapshot> streams;
+    stream.snapshot(streams);
+    assert(streams.size() == 1 && streams[0].stream_name == "kept");
+    assert(stream.retention("gone").empty() && stream.retention("kept").max_len == 5);
+    assert(stream.xread({"gone"}, {0}).empty());
+    stream.enforce_retention();
+    assert(stream.xlen("kept") == 5);
+    assert(stream.xlen("gone") == 0);
+    streams.clear();
+    stream.snapshot(streams);
+    assert(streams.size() == 1);
+    std::cout << "test_load_snapshot_keeps_retention_only_for_streams_it_has passed" << std::endl;
+}
+
+void test_retention_max_age_in_background() {
+    streamConfig config = small_blocks(8);
+    config.maintenance_interval_ms = 5;
+    redisStream stream(config);
+    for (int i = 0; i < 50; ++i)
+        stream.xadd("mystream", {{"n", "old"}});
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    for (int i = 0; i < 5; ++i)
+        stream.xadd("mystream", {{"n", "new"}});
+    retentionPolicy policy;
+    policy.max_age_ms = 200;
+    stream.set_retention("mystream", policy);
+    // nothing calls in, the maintenance thread gets to it on its own
+    bool trimmed = false;
+    for (int i = 0; i < 100 && !trimmed; ++i) {
+        trimmed = stream.xlen("mystream") == 5;
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    assert(trimmed);
+    for (const auto &entry : stream.xrange("mystream", 0, LLONG_MAX))
+        assert(entry.second[0].second == "new");
+    maintenanceStats stats = stream.maintenance_stats();
+    assert(stats.cycles > 0 && stats.retention_trimmed == 50);
+    assert(stats.max_cycle_us >= stats.last_cycle_us);
+    std::cout << "test_retention_max_age_in_background passed" << std::endl;
+}
+
+static streamConfig max_memory(size_t bytes, evictionPolicy eviction) {
+    streamConfig config = small_blocks(8);
+    config.max_memory = bytes;
+    config.eviction = eviction;
+    return config;
+}
+
+void test_maxmemory_rejects_writes() {
+    redisStream stream(max_memory(20000, EVICT_NONE));
+    long long id = 0;
+    int added = 0;
+    while ((id = stream.xadd("mystream", {{"payload", std::string(100, 'x')}})) >= 0)
+        added++;
+    assert(added > 10);
+    memoryStats stats = stream.memory_stats();
+    assert(stats.rejected_writes == 1);
+    assert(stats.used_bytes > 20000 && stats.used_bytes < 21000);
+    // nothing got thrown away and freeing some makes room again
+    assert(stream.xlen("mystream") == static_cast<size_t>(added));
+    stream.xtrim("mystream", MINID, 20);
+    assert(stream.xadd("mystream", {{"payload", "y"}}) == added);
+    std::cout << "test_maxmemory_rejects_writes passed" << std::endl;
+}
+
+void test_maxmemory_trims_oldest_entries() {
+    redisStream stream(max_memory(20000, EVICT_OLDEST_ENTRIES));
+    for (int i = 0; i < 300; ++i) {
+        assert(stream.xadd(i % 2 ? "a" : "b", {{"payload", std::string(100, 'x')}}) >= 0);
+        assert(stream.memory_stats().used_bytes < 22000);
+    }
+    memoryStats stats = stream.memory_stats();
+    assert(stats.evicted_entries > 0 && stats.rejected_writes == 0);
+    // the newest of each stream are still there
+    assert(stream.xrange("a", 0, LLONG_MAX).back().first == 149);
+    assert(stream.xrange("b", 0, LLONG_MAX).back().first == 149);
+    assert(stream.xlen("a") + stream.xlen("b") + stats.evicted_entries == 300);
+    std::cout << "test_maxmemory_trims_oldest_entries passed" << std::endl;
+}
+
+void test_maxmemory_evicts_lru_streams() {
+    redisStream stream(max_memory(30000, EVICT_LRU_STREAMS));
+    for (int i = 0; i < 30; ++i) {
+        stream.xadd("cold", {{"payload", std::string(100, 'x')}});
+        stream.xadd("hot", {{"payload", std::string(100, 'x')}});
+    }
+    stream.xrange("hot");
+    for (int i = 0; i < 200 && stream.memory_stats().evicted_streams == 0; ++i)
+        assert(stream.xadd("new", {{"payload", std::string(100, 'x')}}) >= 0);
+    assert(stream.memory_stats().evicted_streams == 1);
+    assert(stream.xlen("cold") == 0);
+    assert(stream.xlen("hot") == 30);
+    // ids keep going where they left off
+    assert(stream.xadd("cold", {{"payload", "again"}}) == 30);
+    std::cout << "test_maxmemory_evicts_lru_streams passed" << std::endl;
+}
+
+// the replication backlog and field indexes count against max_memory too,
+// and give back what they took when they let go of it
+void test_maxmemory_counts_backlog_and_indexes() {
+    redisStream stream(max_memory(40000, EVICT_OLDEST_ENTRIES));
+    stream.enable_replication_backlog(20);
+    assert(stream.create_index("s", "device"));
+    for (int i = 0; i < 400; ++i) {
+        assert(stream.xadd("s", {{"device", "d" + std::to_string(i % 50)},
+                                 {"payload", std::string(100, 'x')}}) >= 0);
+        assert(stream.memory_stats().used_bytes < 42000);
+    }
+    memoryStats stats = stream.memory_stats();
+    assert(stats.backlog_bytes > 20 * 100 && stats.index_bytes > 0);
+    assert(stats.evicted_entries > 0);
+    assert(stats.backlog_bytes + stats.index_bytes < stats.used_bytes);
+    stream.xdel("s", {399});
+    stream.xtrim("s", MAXLEN, 10);
+    size_t trimmed = stream.memory_stats().index_bytes;
+    assert(trimmed > 0 && trimmed < stats.index_bytes);
+    assert(stream.drop_index("s", "device"));
+    assert(stream.memory_stats().index_bytes == 0);
+    assert(stream.create_index("s", "device"));
+    assert(stream.memory_stats().index_bytes == trimmed);
+    stream.del({"s"});
+    assert(stream.memory_stats().index_bytes == 0);
+    stream.enable_replication_backlog(1);
+    assert(stream.memory_stats().backlog_bytes < stats.backlog_bytes / 10);
+    std::cout << "test_maxmemory_counts_backlog_and_indexes passed" << std::endl;
+}
+
+// hundreds of streams over the limit at once. entries get replayed like on a
+// follower so arrival times can go the other way from the names, the oldest
+// go first whatever order the streams are in.
+void test_maxmemory_trims_oldest_of_many_streams() {
+    redisStream stream(max_memory(400000, EVICT_OLDEST_ENTRIES));
+    for (int i = 0; i < 500; ++i)
+        for (long long id = 0; id < 2; ++id) {
+            streamMutation mutation;
+            mutation.kind = MUTATION_XADD;
+            mutation.stream_name = "s" + std::to_string(i);
+            mutation.id = id;
+            mutation.logged_ms = (id ? 200000 : 100000) - i;
+            mutation.data = {{"payload", std::string(200, 'x')}};
+            stream.apply_mutation(mutation);
+        }
+    assert(stream.memory_stats().used_bytes > 400000);
+    // the oldest stream is empty and the next one's first entry is now its
+    // newer one, neither should be picked
+    stream.xtrim("s499", MAXLEN, 0);
+    stream.xdel("s498", {0});
+    assert(stream.xadd("new", {{"payload", "y"}}) >= 0);
+    memoryStats stats = stream.memory_stats();
+    assert(stats.used_bytes < 401000);
+    assert(stats.evicted_entries > 100 && stats.rejected_writes == 0);
+    assert(stream.xlen("s498") == 1);
+    assert(stream.xlen("s0") == 2 && stream.xlen("s497") == 0);
+    for (int i = 0; i < 497; ++i)
+        assert(stream.xlen("s" + std::to_string(i)) >= stream.xlen("s" + std::to_string(i + 1)));
+    std::cout << "test_maxmemory_trims_oldest_of_many_streams passed" << std::endl;
+}
+
+void test_maxmemory_evicts_lru_of_many_streams() {
+    redisStream stream(max_memory(300000, EVICT_LRU_STREAMS));
+    for (int i = 0; i < 500; ++i)
+        stream.xadd("s" + std::to_string(i), {{"payload", std::string(100, 'x')}});
+    assert(stream.memory_stats().evicted_streams == 0);
+    // read back to front so the last ones are the least recently read
+    for (int i = 499; i >= 0; --i)
+        stream.xrange("s" + std::to_string(i));
+    for (int i = 0; i < 100; ++i)
+        assert(stream.xadd("new", {{"payload", std::string(1000, 'x')}}) >= 0);
+    size_t evicted = stream.memory_stats().evicted_streams;
+    assert(evicted > 50 && evicted < 500);
+    for (size_t i = 0; i < 500; ++i)
+        assert(stream.xlen("s" + std::to_string(i)) == (i < 500 - evicted ? 1u : 0u));
+    assert(stream.xlen("new") == 100);
+    std::cout << "test_maxmemory_evicts_lru_of_many_streams passed" << std::endl;
+}
+
+void test_xmerge() {
+    redisStream stream(small_blocks(4));
+    // three shards with different amounts in each, some of it sealed
+    for (int i = 0; i < 20; ++i) {
+        stream.xadd("shard0", {{"n", std::to_string(i)}});
+        if (i % 2 == 0)
+            stream.xadd("shard1", {{"n", std::to_string(i)}});
+        if (i % 5 == 0)
+            stream.xadd("shard2", {{"n", std::to_string(i)}});
+    }
+    stream.xdel("shard0", {2});
+    auto merged = stream.xmerge({"shard0", "shard1", "shard2", "missing"}, {0, 0, 0, 0}, 100);
+    assert(merged.size() == 19 + 10 + 4);
+    for (size_t i = 1; i < merged.size(); ++i)
+        assert(merged[i - 1].id <= merged[i].id);
+    // ties go to the stream listed first
+    assert(merged[0].stream_name == "shard0" && merged[1].stream_name == "shard1" &&
+           merged[2].stream_name == "shard2");
+    for (const auto &entry : merged)
+        assert(!(entry.stream_name == "shard0" && entry.id == 2));
+
+    // by arrival time everything comes back in the order it was added
+    merged = stream.xmerge({"shard2", "shard1", "shard0"}, {0, 0, 0}, 100, MERGE_BY_TIME);
+    for (size_t i = 1; i < merged.size(); ++i)
+        assert(merged[i - 1].arrival_ms <= merged[i].arrival_ms);
+
+    // count and continuing from where it left off
+    auto page = stream.xmerge({"shard0", "shard1"}, {15, 9}, 3);
+    assert(page.size() == 3);
+    assert(page[0].stream_name == "shard1" && page[0].id == 9);
+    assert(page[1].stream_name == "shard0" && page[1].id == 15);
+    std::cout << "test_xmerge passed" << std::endl;
+}
+
+void test_xmerge_blocking() {
+    redisStream stream;
+    std::thread writer([&stream] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        stream.xadd("shard1", {{"field", "value"}});
+    });
+    auto merged = stream.xmerge({"shard0", "shard1"}, {0, 0}, 10, MERGE_BY_ID, 2000);
+    writer.join();
+    assert(merged.size() == 1 && merged[0].stream_name == "shard1");
+    assert(stream.xmerge({"shard0"}, {0}, 10, MERGE_BY_ID, 20).empty());
+    std::cout << "test_xmerge_blocking passed" << std::endl;
+}
+
+// every command in the table comes back out of the perfect hash, anything
+// else doesn't, and arity, options and key positions come from the spec
+void test_command_table() {
+    for (const auto &spec : commands_)
+        assert(find_command(spec.name) == &spec);
+    assert(find_command("XFOO") == nullptr);
+    assert(find_command("xadd") == nullptr);
+    assert(find_command("") == nullptr);
+
+    replyEncoder out;
+    std::vector<std::string> toks = {"XREAD", "COUNT", "5", "BLOCK", "10", "STREAMS", "a", "b", "0", "0"};
+    commandCall call{*find_command("XREAD"), toks, out};
+    assert(bind_command(call));
+    assert(call.has(0) && call.arg(0) == "5");
+    assert(call.has(1) && call.arg(1) == "10");
+    assert(call.rest == 6);
+    assert((command_keys(call.spec, toks) == std::vector<size_t>{6, 7}));
+
+    toks = {"XRANGE", "s", "-", "+", "WHERE", "device", "7"};
+    commandCall range{*find_command("XRANGE"), toks, out};
+    assert(bind_command(range));
+    assert(!range.has(0) && range.arg(1, 1) == "7");
+    assert((command_keys(range.spec, toks) == std::vector<size_t>{1}));
+
+    // too few or too many tokens, an option missing its value, an unknown
+    // option and no STREAMS all get stopped before the handler
+    std::vector<std::vector<std::string>> bad = {
+        {"XLEN"}, {"XLEN", "a", "b"}, {"XRANGE", "s", "-", "+", "COUNT"},
+        {"XRANGE", "s", "-", "+", "LIMIT", "1"}, {"XREAD", "COUNT", "1", "s", "0"}};
+    for (const auto &b : bad) {
+        commandCall c{*find_command(b[0]), b, out};
+        assert(!bind_command(c));
+    }
+    assert(out.buffer().empty() && !out.errors().empty());
+    out.clear();
+
+    // writes get refused on a read only stream, reads still go through
+    redisStream stream;
+    stream.set_read_only(true);
+    command_interpreter({"XADD", "s", "f", "v"}, stream, out);
+    assert(stream.xlen("s") == 0);
+    assert(out.errors() == "READONLY You can't write against a read only follower.\n");
+    command_interpreter({"XRETENTION", "s", "MAXLEN", "5"}, stream, out);
+    assert(stream.retention("s").empty());
+    stream.set_read_only(false);
+    command_interpreter({"XADD", "s", "f", "v"}, stream, out);
+    assert(stream.xlen("s") == 1);
+    std::cout << "test_command_table passed" << std::endl;
+}
+
+// the human readable replies look like what the interface always printed,
+// RESP ones are proper RESP, and nothing is written until flush
+void test_reply_encoder() {
+    redisStream stream;
+    stream.xadd("s", {{"a", "1"}, {"b", "x"}});
+    stream.xadd("s", {{"a", "2"}});
+
+    replyEncoder human(REPLY_HUMAN);
+    command_interpreter({"XRANGE", "s", "-", "+"}, stream, human);
+    assert(human.buffer() == "1) 0\n\t1) a:1\n\t2) b:x\n\n2) 1\n\t1) a:2\n\n");
+    human.clear();
+    command_interpreter({"XREAD", "COUNT", "1", "STREAMS", "s", "1"}, stream, human);
+    command_interpreter({"XLEN", "s"}, stream, human);
+    command_interpreter({"XAGG", "s", "-", "+", "AVG", "a"}, stream, human);
+    assert(human.buffer() == "1) \"s\"\n\t0) 1\n\t\t1) a:2\n2\n1.5\n");
+    command_interpreter({"XLEN"}, stream, human);
+    assert(human.errors() == "XLEN requires a key\n");
+
+    replyEncoder resp(REPLY_RESP);
+    command_interpreter({"XRANGE", "s", "1", "+"}, stream, resp);
+    command_interpreter({"XLEN", "s"}, stream, resp);
+    command_interpreter({"XRETENTION", "s", "MAXLEN", "5"}, stream, resp);
+    command_interpreter({"XFOO"}, stream, resp);
+    assert(resp.buffer() ==
+           "*1\r\n*2\r\n$1\r\n1\r\n*2\r\n$1\r\na\r\n$1\r\n2\r\n"
+           ":2\r\n+OK\r\n-ERR Unknown command: XFOO\r\n");
+    assert(resp.errors().empty());
+
+    // one write for the whole batch, and the buffer is ready for more
+    int fds[2];
+    assert(pipe(fds) == 0);
+    size_t expected = resp.buffer().size();
+    assert(resp.flush(fds[1], fds[1]));
+    assert(resp.write_calls() == 1 && resp.buffer().empty());
+    std::string got(expected, '\0');
+    assert(read(fds[0], &got[0], expected) == static_cast<ssize_t>(expected));
+    assert(got.compare(0, 4, "*1\r\n") == 0);
+
+    // human errors come out between the replies they came with, not all
+    // ahead of them
+    human.clear();
+    command_interpreter({"XLEN", "s"}, stream, human);
+    command_interpreter({"XLEN"}, stream, human);
+    command_interpreter({"XFOO"}, stream, human);
+    command_interpreter({"XLEN", "s"}, stream, human);
+    command_interpreter({"XLEN"}, stream, human);
+    expected = human.buffer().size() + human.errors().size();
+    assert(human.flush(fds[1], fds[1]));
+    got.assign(expected, '\0');
+    assert(read(fds[0], &got[0], expected) == static_cast<ssize_t>(expected));
+    assert(got == "2\nXLEN requires a key\nUnknown command: XFOO\n2\nXLEN requires a key\n");
+    close(fds[0]);
+    close(fds[1]);
+    std::cout << "test_reply_encoder passed" << std::endl;
+}
+
+// every subscriber gets the same serialized entry, only for the streams it
+// asked for, a full queue drops the oldest and unsubscribing stops it
+void test_subscribe_fanout() {
+    redisStream stream;
+    auto first = stream.subscribe({"s"});
+    auto second = stream.subscribe({"s", "t"});
+    auto small = stream.subscribe({"s"}, 2);
+    // subscribing doesn't create the stream
+    assert(stream.xlen("s") == 0);
+    stream.xadd("s", {{"a", "1"}});
+    stream.xadd("t", {{"b", "2"}});
+    stream.xadd("u", {{"c", "3"}});
+
+    std::vector<PublishedEntryPointer> got_first, got_second;
+    assert(first->pop(got_first, 10) == 1);
+    assert(second->pop(got_second, 10) == 2);
+    // one entry built once, handed to both
+    assert(got_first[0] == got_second[0]);
+    assert(got_first[0]->stream_name == "s" && got_first[0]->id == 0);
+    assert((got_first[0]->fields == FieldsStructure{{"a", "1"}}));
+    assert(got_first[0]->resp == "*1\r\n*2\r\n$1\r\ns\r\n*1\r\n*2\r\n$1\r\n0\r\n*2\r\n$1\r\na\r\n$1\r\n1\r\n");
+    assert(got_second[1]->stream_name == "t");
+
+    for (int i = 0; i < 3; ++i) stream.xadd("s", {{"n", std::to_string(i)}});
+    std::vector<PublishedEntryPointer> got_small;
+    assert(small->pop(got_small, 10) == 2);
+    assert(small->dropped() == 2);
+    assert(got_small[0]->id == 2 && got_small[1]->id == 3);
+
+    stream.unsubscribe(first);
+    assert(first->closed());
+    first->pop(got_first, 10);
+    stream.xadd("s", {{"n", "after"}});
+    std::vector<PublishedEntryPointer> after;
+    assert(first->pop(after, 10) == 0);
+    assert(second->pop(after, 10) == 4);
+    assert(stream.pubsub_stats().subscriptions == 2);
+    std::cout << "test_subscribe_fanout passed" << std::endl;
+}
+
+// BYTIME goes by arrival time, not ids. entries get replayed like on a
+// follower so their arrival times can be picked, and they jump around so
+// block time ranges overlap and ids say nothing about time.
+void test_xrange_bytime() {
+    redisStream stream(small_blocks(4));
+    std::vector<std::pair<long long, long long>> entries; // id, arrival ms
+    for (long long id = 0; id < 60; ++id) {
+        long long ms = 1000 + (id * 37) % 50 * 10 + (id / 10) * 100;
+        entries.emplace_back(id * 3, ms);
+        streamMutation mutation;
+        mutation.kind = MUTATION_XADD;
+        mutation.stream_name = "s";
+        mutation.id = id * 3;
+        mutation.logged_ms = ms;
+        mutation.data = {{"n", std::to_string(id)}};
+        stream.apply_mutation(mutation);
+    }
+    auto expect = [&](long long from, long long to) {
+        std::vector<long long> ids;
+        for (const auto &entry : entries)
+            if (entry.second >= from && entry.second <= to) ids.push_back(entry.first);
+        return ids;
+    };
+    auto got = [&](long long from, long long to, std::optional<long long> count = std::nullopt) {
+        std::vector<long long> ids;
+        for (const auto &entry : stream.xrange_bytime("s", from, to, count)) ids.push_back(entry.first);
+        return ids;
+    };
+    for (long long from : {0LL, 1000LL, 1250LL, 1490LL, 1700LL})
+        for (long long width : {0LL, 10LL, 95LL, 300LL, 5000LL})
+            assert(got(from, from + width) == expect(from, from + width));
+    assert(got(5000, 6000).empty());
+    assert(got(1200, 1100).empty());
+    assert(got(0, LLONG_MAX, 5).size() == 5);
+    assert(stream.xrange_bytime("nope", 0, LLONG_MAX).empty());
+
+    // deleting and trimming changes the blocks underneath the time index
+    std::vector<long long> gone = {0, 9, 30, 99};
+    stream.xdel("s", gone);
+    stream.xtrim("s", MINID, 24);
+    std::set<long long> left;
+    for (const auto &entry : stream.xrange("s")) left.insert(entry.first);
+    assert(left.size() < entries.size() - gone.size());
+    entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const auto &entry) {
+        return !left.count(entry.first);
+    }), entries.end());
+    for (long long from : {1000LL, 1300LL, 1600LL})
+        assert(got(from, from + 200) == expect(from, from + 200));
+    assert(got(0, LLONG_MAX).size() == entries.size());
+    std::cout << "test_xrange_bytime passed" << std::endl;
+}
+
+// big range reads get split across threads by block, whatever the split
+// they have to come back the same as the one thread read
+void test_parallel_xrange() {
+    streamConfig serial_config = small_blocks(16);
+    serial_config.parallel_range_entries = 0;
+    streamConfig parallel_config = small_blocks(16);
+    parallel_config.parallel_range_entries = 1;
+    parallel_config.range_threads = 4;
+    streamConfig cold_config = small_blocks(16, 4096);
+    cold_config.compress_blocks = true;
+    cold_config.parallel_range_entries = 1;
+    cold_config.range_threads = 3;
+    redisStream serial(serial_config), parallel(parallel_config), cold(cold_config);
+    std::vector<long long> gone;
+    for (long long i = 0; i < 2000; ++i) {
+        FieldsStructure data = {{"n", std::to_string(i)}, {"pad", std::string(i % 7, 'p')}};
+        for (redisStream *stream : {&serial, &parallel, &cold}) stream->xadd("s", data);
+        if (i % 5 == 0 || (i >= 400 && i < 480)) gone.push_back(i);
+    }
+    for (redisStream *stream : {&serial, &parallel, &cold}) stream->xdel("s", gone);
+    for (long long start : {LLONG_MIN, 0LL, 3LL, 401LL, 999LL, 1990LL})
+        for (long long end : {LLONG_MAX, 2LL, 479LL, 1500LL})
+            for (std::optional<long long> count : {std::optional<long long>(), std::optional<long long>(0),
+                                                   std::optional<long long>(1), std::optional<long long>(37),
+                                                   std::optional<long long>(1500)}) {
+                auto expected = serial.xrange("s", start, end, count);
+                assert(parallel.xrange("s", start, end, count) == expected);
+                assert(cold.xrange("s", start, end, count) == expected);
+            }
+    assert(serial.xrange("s", 0, LLONG_MAX, 0).empty());
+    assert(serial.storage_stats().parallel_ranges == 0);
+    assert(parallel.storage_stats().parallel_ranges > 0);
+    assert(cold.storage_stats().parallel_ranges > 0);
+    assert(cold.storage_stats().spilled_blocks > 0);
+    std::cout << "test_parallel_xrange passed" << std::endl;
+}
+
+// COUNT 0 is no entries whichever way the range gets read
+void test_count_zero_on_every_xrange_path() {
+    redisStream stream(small_blocks(4));
+    for (int i = 0; i < 20; ++i)
+        stream.xadd("s", {{"device", "abc"}});
+    stream.xadd("indexed", {{"device", "abc"}});
+    assert(stream.create_index("indexed", "device"));
+    for (long long count : {0LL, -1LL}) {
+        assert(stream.xrange("s", 0, LLONG_MAX, count).empty());
+        assert(stream.xrange_bytime("s", LLONG_MIN, LLONG_MAX, count).empty());
+        assert(stream.xrange_where("s", LLONG_MIN, LLONG_MAX, "device", "abc", count).empty());
+        assert(stream.xrange_where("indexed", LLONG_MIN, LLONG_MAX, "device", "abc", count).empty());
+    }
+    assert(stream.xrange_bytime("s", LLONG_MIN, LLONG_MAX, 1).size() == 1);
+    assert(stream.xrange_where("s", LLONG_MIN, LLONG_MAX, "device", "abc", 1).size() == 1);
+    replyEncoder out(REPLY_RESP);
+    command_interpreter({"XRANGE", "s", "-", "+", "COUNT", "0"}, stream, out);
+    command_interpreter({"XRANGE", "s", "0", "9223372036854775807", "COUNT", "0", "BYTIME"}, stream, out);
+    command_interpreter({"XRANGE", "s", "-", "+", "COUNT", "0", "WHERE", "device", "abc"}, stream, out);
+    assert(out.buffer() == "*0\r\n*0\r\n*0\r\n" && out.errors().empty());
+    std::cout << "test_count_zero_on_every_xrange_path passed" << std::endl;
+}
+
+// the ends of the id range work as bounds whichever form the tail is in,
+// upper_bound used to overflow on LLONG_MAX while the tail was small
+void test_tail_bounds_at_the_id_limits() {
+    tailEntries tail;
+    for (long long id : {LLONG_MIN, -1LL, 5LL, LLONG_MAX - 1})
+        tail.emplace(id, {{"n", std::to_string(id)}});
+    for (int large = 0; large < 2; ++large) {
+        assert(tail.is_small() == !large);
+        assert(tail.upper_bound(LLONG_MAX) == tail.end());
+        assert(tail.upper_bound(LLONG_MAX - 1) == tail.end());
+        assert(tail.upper_bound(LLONG_MIN)->first == -1);
+        assert(tail.lower_bound(LLONG_MIN)->first == LLONG_MIN);
+        for (long long id = 100; large == 0 && id < 100 + static_cast<long long>(tailEntries::small_entries); ++id)
+            tail.emplace(id, {{"n", "x"}});
+    }
+    redisStream stream;
+    for (int i = 0; i < 3; ++i)
+        stream.xadd("s", {{"n", std::to_string(i)}});
+    replyEncoder out(REPLY_RESP);
+    command_interpreter({"XTRIM", "s", "MINID", "9223372036854775807"}, stream, out);
+    assert(out.buffer() == ":3\r\n" && stream.xlen("s") == 0);
+    std::cout << "test_tail_bounds_at_the_id_limits passed" << std::endl;
+}
+
+// a tail starts out as one sorted vector and turns into a map once it's
+// past small_entries, it has to act the same either way
+void test_tail_entries_small_then_large() {
+    tailEntries tail;
+    VectorPairStructure expected;
+    auto same = [&]() {
+        VectorPairStructure got(tail.begin(), tail.end());
+        assert(got == expected);
+        assert(tail.size() == expected.size());
+    };
+    const long long n = tailEntries::small_entries * 3;
+    for (long long id = 0; id < n; ++id) {
+        // odd ids first then even ones so some go into the middle
+        long long put = id < n / 2 ? id * 2 + 1 : (id - n / 2) * 2;
+        assert(tail.emplace(put, {{"n", std::to_string(put)}}).second);
+        assert(!tail.emplace(put, {{"n", "again"}}).second);
+        expected.emplace_back(put, FieldsStructure{{"n", std::to_string(put)}});
+        std::sort(expected.begin(), expected.end());
+        same();
+        assert(tail.is_small() == (tail.size() <= tailEntries::small_entries));
+    }
+    assert(tail.find(7)->second[0].second == "7");
+    assert(tail.find(n * 2) == tail.end());
+    assert(tail.lower_bound(10)->first == 10 && tail.upper_bound(10)->first == 11);
+    assert(std::prev(tail.end())->first == n - 1);
+    // taking some out of the middle, then all of it, goes back to small
+    auto it = tail.erase(tail.find(10), tail.find(20));
+    assert(it->first == 20);
+    expected.erase(expected.begin() + 10, expected.begin() + 20);
+    same();
+    assert(tail.erase(tail.begin(), tail.end()) == tail.end());
+    assert(tail.empty() && tail.is_small());
+    for (long long id = 0; id < 3; ++id) tail.emplace(id, {});
+    expected = {{0, {}}, {1, {}}, {2, {}}};
+    same();
+    assert(tail.erase(tail.begin(), std::next(tail.begin()))->first == 1);
+    std::cout << "test_tail_entries_small_then_large passed" << std::endl;
+}
+
+// one stream per device, lots of tiny streams going through every command
+void test_many_small_streams() {
+    redisStream stream(small_blocks(0));
+    for (int d = 0; d < 200; ++d)
+        for (int i = 0; i <= d % 40; ++i) stream.xadd("device:" + std::to_string(d), {{"i", std::to_string(i)}});
+    for (int d = 0; d < 200; ++d) {
+        std::string name = "device:" + std::to_string(d);
+        long long len = d % 40 + 1;
+        assert(static_cast<long long>(stream.xlen(name)) == len);
+        std::vector<long long> gone = {len / 2};
+        assert(stream.xdel(name, gone) == 1);
+        auto entries = stream.xrange(name);
+        assert(static_cast<long long>(entries.size()) == len - 1);
+        for (const auto &entry : entries)
+            assert(entry.first != len / 2 && entry.second[0].second == std::to_string(entry.first));
+        stream.xtrim(name, MAXLEN, 1);
+        assert(stream.xadd(name, {{"i", "next"}}) == len);
+        assert(stream.xrange(name).back().first == len);
+    }
+    std::cout << "test_many_small_streams passed" << std::endl;
+}
+
+// traces for ./loadgen come back exactly as written, and a cut off one is
+// told apart from one that just ended
+void test_trace_round_trip() {
+    std::string path = "/tmp/redis_stream_test.trace";
+    std::vector<traceRecord> records(4);
+    records[0].toks = {"XADD", "s", "f", "v"};
+    records[1].at_us = 300;
+    records[1].client = 7;
+    records[1].toks = {"XRANGE", "s", "-", "+", ""};
+    records[2].at_us = 1LL << 40;
+    records[2].client = 100000;
+    records[2].toks = {"XADD", "s", "big", std::string(1000, 'x')};
+    records[3].at_us = 5; // earlier than the last one, gets its time
+    records[3].toks = {"XLEN", "s"};
+    traceWriter writer;
+    assert(writer.open(path));
+    for (const auto &record : records) writer.add(record);
+    assert(writer.close());
+    records[3].at_us = records[2].at_us;
+
+    traceReader reader;
+    assert(reader.open(path));
+    traceRecord record;
+    for (const auto &expected : records) {
+        assert(reader.next(record));
+        assert(record.at_us == expected.at_us && record.client == expected.client);
+        assert(record.toks == expected.toks);
+    }
+    assert(!reader.next(record) && !reader.bad());
+
+    // chop the last few bytes off
+    std::ifstream in(path, std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << bytes.substr(0, bytes.size() - 3);
+    traceReader cut;
+    assert(cut.open(path));
+    size_t read = 0;
+    while (cut.next(record)) read++;
+    assert(read == 3 && cut.bad());
+    std::ofstream(path, std::ios::trunc) << "not a trace";
+    traceReader wrong;
+    assert(!wrong.open(path));
+    std::remove(path.c_str());
+    std::cout << "test_trace_round_trip passed" << std::endl;
+}
+
+// RESP tail reads served from the reply cache have to match building the
+// reply from xrange/xread every time, through appends, deletes in the tail
+// and in blocks, trims from both ends and the cache dropping its older half
+void test_reply_cache_matches_xrange() {
+    streamConfig config = small_blocks(4);
+    config.reply_cache_entries = 6;
+    redisStream stream(config);
+    std::mt19937 rng(7);
+    auto expected_range = [&](long long start, std::optional<long long> count) {
+        replyEncoder out(REPLY_RESP);
+        out.range(stream.xrange("s", start, LLONG_MAX, count));
+        return out.buffer();
+    };
+    auto check = [&](long long start, std::optional<long long> count) {
+        std::string got;
+        stream.xrange_resp("s", start, count, got);
+        assert(got == expected_range(start, count));
+        replyEncoder want(REPLY_RESP);
+        want.streams(stream.xread({"s", "nope"}, {start, 0}, std::nullopt, count));
+        std::string read;
+        assert(stream.xread_resp({"s", "nope"}, {start, 0}, std::nullopt, count, read));
+        assert(read == want.buffer());
+    };
+    long long next = 0;
+    for (int step = 0; step < 3000; ++step) {
+        int what = rng() % 10;
+        if (what < 5) {
+            next = stream.xadd("s", {{"n", std::to_string(step)}}) + 1;
+        } else if (what == 5 && next) {
+            std::vector<long long> ids = {static_cast<long long>(rng() % next)};
+            stream.xdel("s", ids);
+        } else if (what == 6 && step % 7 == 0) {
+            stream.xtrim("s", MINID, next > 10 ? next - 10 - rng() % 10 : 0);
+        } else if (what == 7 && step % 11 == 0) {
+            stream.xtrim("s", MAXLEN, rng() % 3);
+        } else {
+            // mostly polling close to the end, sometimes further back
+            long long start = next - static_cast<long long>(rng() % (rng() % 4 ? 8 : 40));
+            std::optional<long long> count;
+            if (rng() % 3 == 0) count = rng() % 5;
+            check(start, count);
+            check(start, count);
+        }
+    }
+    check(LLONG_MIN, std::nullopt);
+    check(next + 5, std::nullopt);
+    replyCacheStats stats = stream.reply_cache_stats();
+    assert(stats.hits > stats.misses && stats.streams == 1 && stats.bytes > 0);
+
+    // a stream that's gone takes its cache with it, and not being there at
+    // all is an empty reply
+    std::string none;
+    stream.xrange_resp("nope", 0, std::nullopt, none);
+    assert(none == "*0\r\n");
+    std::string blocked;
+    assert(!stream.xread_resp({"nope"}, {0}, 10, std::nullopt, blocked) && blocked.empty());
+    assert(!stream.xread_resp({"s", "s"}, {0, 1}, std::nullopt, std::nullopt, blocked));
+    std::cout << "test_reply_cache_matches_xrange passed" << std::endl;
+}
+
+// MULTI queues instead of running, EXEC runs the lot and replies with one
+// array, a bad command while queueing throws the whole thing away
+void test_multi_exec() {
+    redisStream stream;
+    commandSession session;
+    replyEncoder out(REPLY_RESP);
+    command_interpreter({"MULTI"}, stream, out, session);
+    command_interpreter({"XADD", "a", "f", "1"}, stream, out, session);
+    command_interpreter({"XADD", "b", "f", "2"}, stream, out, session);
+    command_interpreter({"XLEN", "a"}, stream, out, session);
+    assert(out.buffer() == "+OK\r\n+QUEUED\r\n+QUEUED\r\n+QUEUED\r\n");
+    assert(stream.xlen("a") == 0 && stream.xlen("b") == 0);
+    // another session isn't in the transaction
+    replyEncoder other(REPLY_RESP);
+    command_interpreter({"XLEN", "a"}, stream, other);
+    assert(other.buffer() == ":0\r\n");
+    out.clear();
+    command_interpreter({"EXEC"}, stream, out, session);
+    assert(out.buffer() == "*3\r\n:0\r\n:0\r\n:1\r\n");
+    assert(stream.xlen("a") == 1 && stream.xlen("b") == 1 && !session.in_multi);
+    out.clear();
+
+    // a blocking read in a transaction doesn't block, nothing could show up
+    auto started = std::chrono::steady_clock::now();
+    command_interpreter({"MULTI"}, stream, out, session);
+    command_interpreter({"XREAD", "BLOCK", "5000", "STREAMS", "c", "0"}, stream, out, session);
+    command_interpreter({"EXEC"}, stream, out, session);
+    assert(std::chrono::steady_clock::now() - started < std::chrono::seconds(2));
+    assert(out.buffer() == "+OK\r\n+QUEUED\r\n*1\r\n*0\r\n");
+    out.clear();
+
+    command_interpreter({"MULTI"}, stream, out, session);
+    command_interpreter({"XADD", "a", "f", "3"}, stream, out, session);
+    command_interpreter({"DISCARD"}, stream, out, session);
+    assert(out.buffer() == "+OK\r\n+QUEUED\r\n+OK\r\n");
+    assert(stream.xlen("a") == 1 && !session.in_multi);
+    out.clear();
+
+    command_interpreter({"MULTI"}, stream, out, session);
+    command_interpreter({"XADD", "a", "f", "4"}, stream, out, session);
+    command_interpreter({"XLEN"}, stream, out, session);
+    command_interpreter({"MULTI"}, stream, out, session);
+    command_interpreter({"EXEC"}, stream, out, session);
+    assert(out.buffer() ==
+           "+OK\r\n+QUEUED\r\n-ERR XLEN requires a key\r\n-ERR MULTI calls can not be nested\r\n"
+           "-EXECABORT Transaction discarded because of previous errors.\r\n");
+    assert(stream.xlen("a") == 1 && !session.in_multi);
+    out.clear();
+    command_interpreter({"EXEC"}, stream, out, session);
+    command_interpreter({"DISCARD"}, stream, out, session);
+    assert(out.buffer() == "-ERR EXEC without MULTI\r\n-ERR DISCARD without MULTI\r\n");
+
+    // the human format just has the replies one after the other
+    replyEncoder human(REPLY_HUMAN);
+    command_interpreter({"MULTI"}, stream, human, session);
+    command_interpreter({"XADD", "a", "f", "5"}, stream, human, session);
+    command_interpreter({"XLEN", "a"}, stream, human, session);
+    command_interpreter({"EXEC"}, stream, human, session);
+    assert(human.buffer() == "OK\nQUEUED\nQUEUED\n1\n2\n");
+    std::cout << "test_multi_exec passed" << std::endl;
+}
+
+// UNLINK hands big streams to the free thread and DEL frees them on the
+// spot, both count what was there and ids carry on afterwards. trims that
+// take whole blocks or the whole tail go to the free thread too.
+void test_del_unlink_and_lazy_trims() {
+    streamConfig config = small_blocks(16);
+    config.lazyfree_entries = 64;
+    redisStream stream(config);
+    for (int i = 0; i < 1000; ++i) stream.xadd("big", {{"n", std::to_string(i)}});
+    for (int i = 0; i < 3; ++i) stream.xadd("small", {{"n", std::to_string(i)}});
+    size_t empty = redisStream().memory_stats().used_bytes;
+    replyEncoder out(REPLY_RESP);
+    command_interpreter({"UNLINK", "big", "small", "missing"}, stream, out);
+    assert(out.buffer() == ":2\r\n");
+    assert(stream.xlen("big") == 0 && stream.xlen("small") == 0);
+    assert(stream.memory_stats().used_bytes == empty);
+    stream.wait_for_lazy_free();
+    // only the big one was worth handing over
+    assert(stream.memory_stats().lazyfreed == 1 && stream.memory_stats().lazyfree_pending == 0);
+    assert(stream.xadd("big", {{"n", "again"}}) == 1000);
+    out.clear();
+    command_interpreter({"DEL", "big", "big"}, stream, out);
+    command_interpreter({"DEL"}, stream, out);
+    assert(out.buffer() == ":1\r\n-ERR DEL requires at least one key\r\n");
+    assert(stream.memory_stats().lazyfreed == 1);
+
+    // MINID takes whole blocks off the front, MAXLEN the tail and blocks off
+    // the back, what's left has to be exactly the right entries
+    for (int i = 0; i < 1000; ++i) stream.xadd("s", {{"n", std::to_string(i)}});
+    assert(stream.xtrim("s", MINID, 499) == 500);
+    assert(stream.xtrim("s", MAXLEN, 300) == 300);
+    stream.wait_for_lazy_free();
+    assert(stream.memory_stats().lazyfreed == 3);
+    auto left = stream.xrange("s");
+    assert(left.size() == 200 && left.front().first == 500 && left.back().first == 699);
+    assert(stream.xtrim("s", MINID, 1000000) == 200 && stream.xlen("s") == 0);
+    stream.wait_for_lazy_free();
+    assert(stream.memory_stats().lazyfreed == 4);
+
+    // 0 frees everything right away
+    config.lazyfree_entries = 0;
+    redisStream eager(config);
+    for (int i = 0; i < 1000; ++i) eager.xadd("s", {{"n", std::to_string(i)}});
+    assert(eager.xtrim("s", MINID, 899) == 900);
+    assert(eager.del({"s"}, true) == 1);
+    assert(eager.memory_stats().lazyfreed == 0);
+    std::cout << "test_del_unlink_and_lazy_trims passed" << std::endl;
+}
+
 int main() {
     // Run all tests
     test_xadd();
@@ -317,6 +1455,43 @@ int main() {
     test_xtrim_maxlen();
     test_xtrim_minid();
     test_xdel_delete_duplicate();
+    test_xrange_across_sealed_blocks();
+    test_xdel_in_sealed_block();
+    test_xtrim_across_sealed_blocks();
+    test_cold_blocks_spill_to_segment_files();
+    test_xrange_where_with_index();
+    test_xrange_where_without_index();
+    test_xindex_on_missing_stream();
+    test_xagg();
+    test_lz_codec_round_trip();
+    test_compressed_blocks();
+    test_xdel_tombstones_then_compacts();
+    test_xdel_and_xlen_dont_create_streams();
+    test_retention_max_len_and_bytes();
+    test_retention_none_on_missing_stream();
+    test_load_snapshot_keeps_retention_only_for_streams_it_has();
+    test_retention_max_age_in_background();
+    test_maxmemory_rejects_writes();
+    test_maxmemory_trims_oldest_entries();
+    test_maxmemory_evicts_lru_streams();
+    test_maxmemory_counts_backlog_and_indexes();
+    test_maxmemory_trims_oldest_of_many_streams();
+    test_maxmemory_evicts_lru_of_many_streams();
+    test_xmerge();
+    test_xmerge_blocking();
+    test_command_table();
+    test_reply_encoder();
+    test_subscribe_fanout();
+    test_xrange_bytime();
+    test_parallel_xrange();
+    test_count_zero_on_every_xrange_path();
+    test_tail_entries_small_then_large();
+    test_tail_bounds_at_the_id_limits();
+    test_many_small_streams();
+    test_trace_round_trip();
+    test_reply_cache_matches_xrange();
+    test_multi_exec();
+    test_del_unlink_and_lazy_trims();
 
     std::cout << "All tests passed!" << std::endl;
     return 0;
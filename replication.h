@@ -0,0 +1,727 @@
+// leader -> follower replication over a unix socket. the leader ships its
+// mutation log (xadd/xdel/xtrim with the ids it assigned) and followers
+// replay it, kind of like redis' PSYNC. a new follower or one that fell too
+// far behind gets a full copy first, one that only dropped off for a bit
+// picks up from the backlog.
+//
+// wire format is just frames of [1 byte type][8 byte length][payload]
+//   P  follower -> leader  replication id, offset it has applied up to
+//   F  leader -> follower  full resync: replication id, offset, stream count
+//   S  leader -> follower  a piece of one stream of the full resync: name,
+//                          next id, 1 on the stream's last piece, entries
+//   C  leader -> follower  continue from the backlog: replication id, offset
+//   M  leader -> follower  leader offset and a batch of mutations
+//   H  leader -> follower  heartbeat with the leader offset
+//   A  follower -> leader  ack with the offset the follower has applied
+
+#pragma once
+#include "stream.h"
+#include <thread>
+#include <list>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+
+inline void put_u64(std::string &buf, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i)
+        buf.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+}
+
+inline void put_string(std::string &buf, const std::string &value)
+{
+    put_u64(buf, value.size());
+    buf.append(value);
+}
+
+// reads back what put_* wrote, ok goes false on anything truncated
+struct wireReader
+{
+    const std::string &buf;
+    size_t pos = 0;
+    bool ok = true;
+
+    uint64_t u64()
+    {
+        if (buf.size() - pos < 8)
+        {
+            ok = false;
+            return 0;
+        }
+        uint64_t value = 0;
+        for (int i = 0; i < 8; ++i)
+            value |= static_cast<uint64_t>(static_cast<unsigned char>(buf[pos + i])) << (8 * i);
+        pos += 8;
+        return value;
+    }
+
+    long long i64() { return static_cast<long long>(u64()); }
+
+    std::string str()
+    {
+        // a length off the wire can be anything, pos + len could wrap
+        uint64_t len = u64();
+        if (!ok || len > buf.size() - pos)
+        {
+            ok = false;
+            return {};
+        }
+        std::string value = buf.substr(pos, len);
+        pos += len;
+        return value;
+    }
+};
+
+inline void put_fields(std::string &buf, const FieldsStructure &fields)
+{
+    put_u64(buf, fields.size());
+    for (const auto &fv : fields)
+    {
+        put_string(buf, fv.first);
+        put_string(buf, fv.second);
+    }
+}
+
+inline FieldsStructure read_fields(wireReader &in)
+{
+    FieldsStructure fields;
+    uint64_t n = in.u64();
+    for (uint64_t i = 0; i < n && in.ok; ++i)
+    {
+        std::string field = in.str();
+        fields.emplace_back(std::move(field), in.str());
+    }
+    return fields;
+}
+
+inline void put_mutation(std::string &buf, const streamMutation &mutation)
+{
+    put_u64(buf, mutation.offset);
+    put_u64(buf, mutation.logged_ms);
+    put_u64(buf, mutation.kind);
+    put_string(buf, mutation.stream_name);
+    put_u64(buf, mutation.id);
+    put_u64(buf, mutation.strategy);
+    put_u64(buf, mutation.ids.size());
+    for (auto id : mutation.ids)
+        put_u64(buf, id);
+    put_fields(buf, mutation.data);
+}
+
+inline streamMutation read_mutation(wireReader &in)
+{
+    streamMutation mutation;
+    mutation.offset = in.i64();
+    mutation.logged_ms = in.i64();
+    mutation.kind = static_cast<mutationKind>(in.u64());
+    mutation.stream_name = in.str();
+    mutation.id = in.i64();
+    mutation.strategy = static_cast<trimmingStrategy>(in.u64());
+    uint64_t n = in.u64();
+    for (uint64_t i = 0; i < n && in.ok; ++i)
+        mutation.ids.push_back(in.i64());
+    mutation.data = read_fields(in);
+    return mutation;
+}
+
+inline bool write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        // MSG_NOSIGNAL so a follower going away doesn't SIGPIPE the leader
+        ssize_t n = ::send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+inline bool read_all(int fd, char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = ::recv(fd, data, len, 0);
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+inline bool send_frame(int fd, char type, const std::string &payload)
+{
+    std::string header(1, type);
+    put_u64(header, payload.size());
+    return write_all(fd, header.data(), header.size()) &&
+           write_all(fd, payload.data(), payload.size());
+}
+
+// the biggest frame anyone gets to make us allocate by default, the length
+// comes off the wire before any of the payload does. anything past it is
+// garbage or someone else on the socket and the connection gets dropped.
+inline constexpr uint64_t max_frame_bytes = 1ull << 30;
+
+inline bool recv_frame(int fd, char &type, std::string &payload,
+                       uint64_t max_bytes = max_frame_bytes)
+{
+    std::string header(9, '\0');
+    if (!read_all(fd, &header[0], header.size()))
+        return false;
+    type = header[0];
+    wireReader in{header, 1};
+    uint64_t len = in.u64();
+    if (len > max_bytes)
+        return false;
+    payload.assign(len, '\0');
+    return payload.empty() || read_all(fd, &payload[0], payload.size());
+}
+
+inline bool make_address(const std::string &path, sockaddr_un &addr)
+{
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+        return false;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return true;
+}
+
+inline long long wall_ms()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+struct replicationConfig
+{
+    // mutations the leader keeps for followers that drop off for a bit
+    size_t backlog_entries = 100000;
+    // frames neither side sends or takes past this, leader and follower
+    // have to agree on it. a full sync goes out in pieces that fit and a
+    // batch of mutations stops short of it, only a single entry bigger
+    // than this can't be replicated.
+    size_t max_frame_bytes = ::max_frame_bytes;
+};
+
+// what the leader knows about each connected follower
+struct followerStatus
+{
+    long long acked_offset = 0;
+    long long lag = 0;          // mutations the follower hasn't acked yet
+    long long ms_since_ack = 0;
+};
+
+class replicationLeader
+{
+private:
+    struct followerConnection
+    {
+        int fd = -1;
+        std::thread thread;
+        std::atomic<bool> done{false};
+        std::atomic<long long> acked_offset{0};
+        std::atomic<long long> last_ack_ms{0};
+    };
+
+    redisStream &stream_;
+    std::string socket_path_;
+    replicationConfig config_;
+    int listen_fd_ = -1;
+    std::atomic<bool> running_{false};
+    std::thread accept_thread_;
+    std::mutex followers_mutex_;
+    std::list<std::unique_ptr<followerConnection>> followers_;
+
+    // one stream of a full sync as S frames that each stay under the frame
+    // cap and piece_entries entries
+    struct pieceWriter
+    {
+        static const size_t piece_entries = 1024;
+        int fd;
+        size_t max_bytes;
+        const streamSnapshotView &view;
+        std::string entries;
+        uint64_t count = 0;
+
+        size_t header_bytes() const { return 32 + view.stream_name.size(); }
+
+        bool flush(bool last)
+        {
+            std::string payload;
+            put_string(payload, view.stream_name);
+            put_u64(payload, view.next_id);
+            put_u64(payload, last);
+            put_u64(payload, count);
+            payload.append(entries);
+            entries.clear();
+            count = 0;
+            return send_frame(fd, 'S', payload);
+        }
+
+        bool add(const VectorPairStructure &from, const std::vector<long long> &arrival_ms)
+        {
+            for (size_t i = 0; i < from.size(); ++i)
+            {
+                size_t before = entries.size();
+                put_u64(entries, from[i].first);
+                put_u64(entries, arrival_ms[i]);
+                put_fields(entries, from[i].second);
+                if (header_bytes() + entries.size() > max_bytes)
+                {
+                    // one entry on its own is too big, no piece can take it
+                    if (!count)
+                        return false;
+                    std::string entry = entries.substr(before);
+                    entries.resize(before);
+                    if (!flush(false))
+                        return false;
+                    entries = std::move(entry);
+                    if (header_bytes() + entries.size() > max_bytes)
+                        return false;
+                }
+                if (++count == piece_entries && !flush(false))
+                    return false;
+            }
+            return true;
+        }
+    };
+
+    // the views are taken under the lock all at once, the entries in sealed
+    // blocks get read a block at a time while the pieces go out so writers
+    // only ever wait for one block
+    bool full_sync_(int fd, long long &offset)
+    {
+        std::vector<streamSnapshotView> streams;
+        offset = stream_.snapshot_view(streams);
+        std::string payload;
+        put_string(payload, stream_.replication_id());
+        put_u64(payload, offset);
+        put_u64(payload, streams.size());
+        if (!send_frame(fd, 'F', payload))
+            return false;
+        VectorPairStructure entries;
+        std::vector<long long> arrival_ms;
+        for (const auto &view : streams)
+        {
+            pieceWriter piece{fd, config_.max_frame_bytes, view, {}, 0};
+            for (const auto &block : view.blocks)
+            {
+                entries.clear();
+                arrival_ms.clear();
+                stream_.snapshot_block(*block, entries, arrival_ms);
+                if (!piece.add(entries, arrival_ms))
+                    return false;
+            }
+            if (!piece.add(view.tail, view.tail_arrival_ms) || !piece.flush(true))
+                return false;
+        }
+        return true;
+    }
+
+    // drain whatever acks came in without blocking
+    bool read_acks_(followerConnection &follower)
+    {
+        pollfd pfd{follower.fd, POLLIN, 0};
+        while (::poll(&pfd, 1, 0) > 0)
+        {
+            if (pfd.revents & (POLLHUP | POLLERR))
+                return false;
+            char type;
+            std::string payload;
+            if (!recv_frame(follower.fd, type, payload, config_.max_frame_bytes))
+                return false;
+            if (type == 'A')
+            {
+                wireReader in{payload};
+                follower.acked_offset = in.i64();
+                follower.last_ack_ms = wall_ms();
+            }
+        }
+        return true;
+    }
+
+    void serve_follower_(followerConnection &follower)
+    {
+        char type;
+        std::string payload;
+        long long offset = 0;
+        if (recv_frame(follower.fd, type, payload, config_.max_frame_bytes) && type == 'P')
+        {
+            wireReader in{payload};
+            std::string replication_id = in.str();
+            long long follower_offset = in.i64();
+            bool ok;
+            if (in.ok && stream_.can_partial_resync(replication_id, follower_offset))
+            {
+                offset = follower_offset;
+                payload.clear();
+                put_string(payload, replication_id);
+                put_u64(payload, offset);
+                ok = send_frame(follower.fd, 'C', payload);
+            }
+            else
+            {
+                ok = full_sync_(follower.fd, offset);
+            }
+            follower.acked_offset = offset;
+            follower.last_ack_ms = wall_ms();
+
+            std::vector<streamMutation> batch;
+            while (ok && running_)
+            {
+                batch.clear();
+                if (!stream_.mutations_since(offset, batch, 512,
+                                             std::chrono::milliseconds(100)))
+                {
+                    // fell out of the backlog while we were sending
+                    ok = full_sync_(follower.fd, offset);
+                    continue;
+                }
+                payload.clear();
+                put_u64(payload, stream_.replication_offset());
+                if (batch.empty())
+                {
+                    ok = send_frame(follower.fd, 'H', payload);
+                }
+                else
+                {
+                    // as many as fit in a frame, the rest go next time round
+                    std::string mutations;
+                    size_t count = 0;
+                    for (const auto &mutation : batch)
+                    {
+                        size_t before = mutations.size();
+                        put_mutation(mutations, mutation);
+                        if (payload.size() + 8 + mutations.size() > config_.max_frame_bytes)
+                        {
+                            mutations.resize(before);
+                            break;
+                        }
+                        count++;
+                    }
+                    if (!count)
+                        break; // one mutation that no frame can hold
+                    put_u64(payload, count);
+                    payload.append(mutations);
+                    offset = batch[count - 1].offset;
+                    ok = send_frame(follower.fd, 'M', payload);
+                }
+                ok = ok && read_acks_(follower);
+            }
+        }
+        ::close(follower.fd);
+        follower.done = true;
+    }
+
+    void accept_loop_()
+    {
+        while (running_)
+        {
+            int fd = ::accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0)
+            {
+                if (!running_)
+                    break;
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(followers_mutex_);
+            // forget about followers that already went away
+            for (auto it = followers_.begin(); it != followers_.end();)
+            {
+                if ((*it)->done)
+                {
+                    (*it)->thread.join();
+                    it = followers_.erase(it);
+                }
+                else
+                    ++it;
+            }
+            auto follower = std::make_unique<followerConnection>();
+            follower->fd = fd;
+            followerConnection *raw = follower.get();
+            follower->thread = std::thread([this, raw]
+                                           { serve_follower_(*raw); });
+            followers_.push_back(std::move(follower));
+        }
+    }
+
+public:
+    replicationLeader(redisStream &stream, std::string socket_path,
+                      replicationConfig config = replicationConfig())
+        : stream_(stream), socket_path_(std::move(socket_path)),
+          config_(config) {}
+    replicationLeader(redisStream &stream, std::string socket_path,
+                      size_t backlog_entries)
+        : replicationLeader(stream, std::move(socket_path))
+    {
+        config_.backlog_entries = backlog_entries;
+    }
+    ~replicationLeader() { stop(); }
+
+    bool start()
+    {
+        sockaddr_un addr;
+        if (!make_address(socket_path_, addr))
+            return false;
+        stream_.enable_replication_backlog(config_.backlog_entries);
+        ::unlink(socket_path_.c_str());
+        listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd_ < 0)
+            return false;
+        if (::bind(listen_fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+            ::listen(listen_fd_, 16) < 0)
+        {
+            ::close(listen_fd_);
+            listen_fd_ = -1;
+            return false;
+        }
+        running_ = true;
+        accept_thread_ = std::thread([this]
+                                     { accept_loop_(); });
+        return true;
+    }
+
+    void stop()
+    {
+        if (!running_.exchange(false))
+            return;
+        // shutdown wakes up the blocked accept and any blocked sends
+        ::shutdown(listen_fd_, SHUT_RDWR);
+        accept_thread_.join();
+        ::close(listen_fd_);
+        listen_fd_ = -1;
+        std::lock_guard<std::mutex> lock(followers_mutex_);
+        for (auto &follower : followers_)
+        {
+            if (!follower->done)
+                ::shutdown(follower->fd, SHUT_RDWR);
+            follower->thread.join();
+        }
+        followers_.clear();
+        ::unlink(socket_path_.c_str());
+    }
+
+    std::vector<followerStatus> followers()
+    {
+        std::vector<followerStatus> out;
+        long long offset = stream_.replication_offset();
+        long long now = wall_ms();
+        std::lock_guard<std::mutex> lock(followers_mutex_);
+        for (const auto &follower : followers_)
+        {
+            if (follower->done)
+                continue;
+            followerStatus status;
+            status.acked_offset = follower->acked_offset;
+            status.lag = offset - status.acked_offset;
+            status.ms_since_ack = now - follower->last_ack_ms;
+            out.push_back(status);
+        }
+        return out;
+    }
+};
+
+// what a follower knows about how far behind it is
+struct replicaStatus
+{
+    bool connected = false;
+    long long leader_offset = 0;
+    long long applied_offset = 0;
+    long long lag_ms = 0;  // age of the last applied mutation when it landed
+    long long full_syncs = 0;
+    long long partial_syncs = 0;
+};
+
+class replicationFollower
+{
+private:
+    redisStream &stream_;
+    std::string socket_path_;
+    replicationConfig config_;
+    std::atomic<bool> running_{false};
+    std::atomic<int> fd_{-1};
+    std::thread thread_;
+
+    std::atomic<bool> connected_{false};
+    std::atomic<long long> leader_offset_{0};
+    std::atomic<long long> lag_ms_{0};
+    std::atomic<long long> full_syncs_{0};
+    std::atomic<long long> partial_syncs_{0};
+
+    bool send_ack_(int fd)
+    {
+        std::string payload;
+        put_u64(payload, stream_.replication_offset());
+        return send_frame(fd, 'A', payload);
+    }
+
+    // a stream can come in several S pieces, open is set while the last
+    // one started still has more coming
+    bool receive_full_sync_(int fd, const std::string &header)
+    {
+        wireReader in{header};
+        std::string replication_id = in.str();
+        long long offset = in.i64();
+        uint64_t stream_count = in.u64();
+        if (!in.ok)
+            return false;
+        std::vector<streamSnapshot> streams;
+        bool open = false;
+        char type;
+        std::string payload;
+        while (streams.size() < stream_count || open)
+        {
+            if (!recv_frame(fd, type, payload, config_.max_frame_bytes) || type != 'S')
+                return false;
+            wireReader piece{payload};
+            std::string stream_name = piece.str();
+            long long next_id = piece.i64();
+            bool last = piece.u64() != 0;
+            if (!open)
+            {
+                streams.emplace_back();
+                streams.back().stream_name = std::move(stream_name);
+            }
+            else if (stream_name != streams.back().stream_name)
+                return false;
+            streamSnapshot &snap = streams.back();
+            snap.next_id = next_id;
+            uint64_t entries = piece.u64();
+            for (uint64_t j = 0; j < entries && piece.ok; ++j)
+            {
+                long long id = piece.i64();
+                snap.arrival_ms.push_back(piece.i64());
+                snap.entries.emplace_back(id, read_fields(piece));
+            }
+            if (!piece.ok)
+                return false;
+            open = !last;
+        }
+        stream_.load_snapshot(streams, replication_id, offset);
+        leader_offset_ = offset;
+        full_syncs_++;
+        return true;
+    }
+
+    // one connection to the leader, returns when it drops
+    void session_(int fd)
+    {
+        std::string payload;
+        put_string(payload, stream_.replication_id());
+        put_u64(payload, stream_.replication_offset());
+        if (!send_frame(fd, 'P', payload))
+            return;
+        connected_ = true;
+        char type;
+        while (running_ && recv_frame(fd, type, payload, config_.max_frame_bytes))
+        {
+            wireReader in{payload};
+            if (type == 'F')
+            {
+                if (!receive_full_sync_(fd, payload))
+                    break;
+            }
+            else if (type == 'C')
+            {
+                partial_syncs_++;
+            }
+            else if (type == 'H' || type == 'M')
+            {
+                leader_offset_ = in.i64();
+                if (type == 'M')
+                {
+                    uint64_t n = in.u64();
+                    for (uint64_t i = 0; i < n && in.ok; ++i)
+                    {
+                        streamMutation mutation = read_mutation(in);
+                        if (!in.ok)
+                            break;
+                        stream_.apply_mutation(mutation);
+                        lag_ms_ = wall_ms() - mutation.logged_ms;
+                    }
+                    if (!in.ok)
+                        break;
+                }
+                else
+                {
+                    lag_ms_ = 0;
+                }
+            }
+            if (!send_ack_(fd))
+                break;
+        }
+        connected_ = false;
+    }
+
+    void run_()
+    {
+        while (running_)
+        {
+            sockaddr_un addr;
+            make_address(socket_path_, addr);
+            int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd >= 0 &&
+                ::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0)
+            {
+                fd_ = fd;
+                // stop() could have run between the check and storing fd
+                if (running_)
+                    session_(fd);
+                fd_ = -1;
+            }
+            if (fd >= 0)
+                ::close(fd);
+            // leader not up yet or went away, keep trying
+            for (int i = 0; i < 10 && running_; ++i)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+public:
+    replicationFollower(redisStream &stream, std::string socket_path,
+                        replicationConfig config = replicationConfig())
+        : stream_(stream), socket_path_(std::move(socket_path)), config_(config) {}
+    ~replicationFollower() { stop(); }
+
+    bool start()
+    {
+        sockaddr_un addr;
+        if (!make_address(socket_path_, addr))
+            return false;
+        stream_.set_read_only(true);
+        running_ = true;
+        thread_ = std::thread([this]
+                              { run_(); });
+        return true;
+    }
+
+    void stop()
+    {
+        if (!running_.exchange(false))
+            return;
+        int fd = fd_.load();
+        if (fd >= 0)
+            ::shutdown(fd, SHUT_RDWR);
+        thread_.join();
+    }
+
+    replicaStatus status()
+    {
+        replicaStatus status;
+        status.connected = connected_;
+        status.leader_offset = leader_offset_;
+        status.applied_offset = stream_.replication_offset();
+        status.lag_ms = lag_ms_;
+        status.full_syncs = full_syncs_;
+        status.partial_syncs = partial_syncs_;
+        return status;
+    }
+};
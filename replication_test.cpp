@@ -0,0 +1,327 @@
+#include "replication.h"
+#include <cassert>
+#include <thread>
+#include <chrono>
+#include <iostream>
+#include <functional>
+#include <sys/wait.h>
+
+// leader and follower talk over a real unix socket in /tmp, most of these
+// run both ends in one process and the last one forks so it's two processes
+
+static std::string socket_path(const std::string &name) {
+    return "/tmp/redis_stream_" + name + "_" + std::to_string(getpid()) + ".sock";
+}
+
+// replication is async so poll until the follower catches up
+static bool wait_for(const std::function<bool()> &done, int timeout_ms = 3000) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (std::chrono::steady_clock::now() < deadline) {
+        if (done()) return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return done();
+}
+
+static bool caught_up(redisStream &leader, redisStream &follower) {
+    return leader.replication_offset() == follower.replication_offset() &&
+           leader.replication_id() == follower.replication_id();
+}
+
+void test_full_sync() {
+    std::string path = socket_path("full_sync");
+    redisStream leader_stream, follower_stream;
+    replicationLeader leader(leader_stream, path);
+    assert(leader.start());
+    leader_stream.xadd("mystream", {{"field1", "value1"}});
+    leader_stream.xadd("mystream", {{"field1", "value2"}});
+    leader_stream.xadd("other", {{"field2", "value3"}});
+
+    replicationFollower follower(follower_stream, path);
+    assert(follower.start());
+    assert(wait_for([&] { return caught_up(leader_stream, follower_stream); }));
+    assert(follower_stream.xlen("mystream") == 2);
+    assert(follower_stream.xlen("other") == 1);
+    assert(follower_stream.xrange("mystream")[1].second[0].second == "value2");
+    assert(follower_stream.is_read_only());
+    assert(follower.status().full_syncs == 1);
+    std::cout << "test_full_sync passed" << std::endl;
+}
+
+void test_mutations_are_streamed() {
+    std::string path = socket_path("stream");
+    redisStream leader_stream, follower_stream;
+    replicationLeader leader(leader_stream, path);
+    assert(leader.start());
+    replicationFollower follower(follower_stream, path);
+    assert(follower.start());
+    assert(wait_for([&] { return follower.status().connected; }));
+
+    for (int i = 0; i < 10; ++i)
+        leader_stream.xadd("mystream", {{"n", std::to_string(i)}});
+    leader_stream.xdel("mystream", {3, 4});
+    leader_stream.xtrim("mystream", MINID, 1);
+    assert(wait_for([&] { return caught_up(leader_stream, follower_stream); }));
+
+    auto expected = leader_stream.xrange("mystream");
+    auto got = follower_stream.xrange("mystream");
+    assert(got == expected);
+    assert(got.size() == 6);
+    // once the acks come back the leader sees the follower as caught up
+    assert(follower.status().lag_ms >= 0);
+    assert(wait_for([&] {
+        auto followers = leader.followers();
+        return followers.size() == 1 && followers[0].lag == 0;
+    }));
+    std::cout << "test_mutations_are_streamed passed" << std::endl;
+}
+
+void test_blocked_reader_on_follower_wakes_up() {
+    std::string path = socket_path("block");
+    redisStream leader_stream, follower_stream;
+    replicationLeader leader(leader_stream, path);
+    assert(leader.start());
+    replicationFollower follower(follower_stream, path);
+    assert(follower.start());
+    assert(wait_for([&] { return follower.status().connected; }));
+
+    std::thread writer([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        leader_stream.xadd("mystream", {{"field", "value"}});
+    });
+    auto result = follower_stream.xread({"mystream"}, {0}, 2000);
+    writer.join();
+    assert(result.count("mystream") == 1);
+    assert(result["mystream"].size() == 1);
+    std::cout << "test_blocked_reader_on_follower_wakes_up passed" << std::endl;
+}
+
+void test_partial_resync() {
+    std::string path = socket_path("partial");
+    redisStream leader_stream, follower_stream;
+    replicationLeader leader(leader_stream, path);
+    assert(leader.start());
+    leader_stream.xadd("mystream", {{"field", "before"}});
+    {
+        replicationFollower follower(follower_stream, path);
+        assert(follower.start());
+        assert(wait_for([&] { return caught_up(leader_stream, follower_stream); }));
+    }
+    // follower is gone, leader keeps going
+    for (int i = 0; i < 20; ++i)
+        leader_stream.xadd("mystream", {{"field", "while away"}});
+
+    replicationFollower follower(follower_stream, path);
+    assert(follower.start());
+    assert(wait_for([&] { return caught_up(leader_stream, follower_stream); }));
+    // picked up from the backlog instead of copying everything again
+    assert(follower.status().partial_syncs == 1);
+    assert(follower.status().full_syncs == 0);
+    assert(follower_stream.xlen("mystream") == 21);
+    std::cout << "test_partial_resync passed" << std::endl;
+}
+
+void test_full_resync_when_backlog_overflows() {
+    std::string path = socket_path("overflow");
+    redisStream leader_stream, follower_stream;
+    replicationLeader leader(leader_stream, path, 5);
+    assert(leader.start());
+    leader_stream.xadd("mystream", {{"field", "before"}});
+    {
+        replicationFollower follower(follower_stream, path);
+        assert(follower.start());
+        assert(wait_for([&] { return caught_up(leader_stream, follower_stream); }));
+    }
+    // more than the backlog holds
+    for (int i = 0; i < 50; ++i)
+        leader_stream.xadd("mystream", {{"field", "while away"}});
+
+    replicationFollower follower(follower_stream, path);
+    assert(follower.start());
+    assert(wait_for([&] { return caught_up(leader_stream, follower_stream); }));
+    assert(follower.status().full_syncs == 1);
+    assert(follower.status().partial_syncs == 0);
+    assert(follower_stream.xlen("mystream") == 51);
+    std::cout << "test_full_resync_when_backlog_overflows passed" << std::endl;
+}
+
+void test_retention_trims_replicate() {
+    std::string path = socket_path("retention");
+    redisStream leader_stream, follower_stream;
+    replicationLeader leader(leader_stream, path);
+    assert(leader.start());
+    replicationFollower follower(follower_stream, path);
+    assert(follower.start());
+    for (int i = 0; i < 50; ++i)
+        leader_stream.xadd("mystream", {{"n", std::to_string(i)}});
+    retentionPolicy policy;
+    policy.max_len = 10;
+    leader_stream.set_retention("mystream", policy);
+    leader_stream.enforce_retention();
+    assert(leader_stream.xlen("mystream") == 10);
+    // the follower doesn't trim on its own, it gets the leader's trims
+    assert(wait_for([&] { return caught_up(leader_stream, follower_stream); }));
+    assert(follower_stream.xrange("mystream") == leader_stream.xrange("mystream"));
+    std::cout << "test_retention_trims_replicate passed" << std::endl;
+}
+
+void test_evictions_replicate() {
+    std::string path = socket_path("evict");
+    streamConfig config;
+    config.max_memory = 20000;
+    config.eviction = EVICT_LRU_STREAMS;
+    redisStream leader_stream(config), follower_stream;
+    replicationLeader leader(leader_stream, path);
+    assert(leader.start());
+    replicationFollower follower(follower_stream, path);
+    assert(follower.start());
+    for (int i = 0; i < 20; ++i)
+        leader_stream.xadd("cold", {{"payload", std::string(100, 'x')}});
+    for (int i = 0; i < 200 && leader_stream.memory_stats().evicted_streams == 0; ++i)
+        leader_stream.xadd("new", {{"payload", std::string(100, 'x')}});
+    assert(leader_stream.memory_stats().evicted_streams == 1);
+    assert(wait_for([&] { return caught_up(leader_stream, follower_stream); }));
+    assert(follower_stream.xlen("cold") == 0);
+    assert(follower_stream.xrange("new") == leader_stream.xrange("new"));
+    std::cout << "test_evictions_replicate passed" << std::endl;
+}
+
+void test_leader_and_follower_in_two_processes() {
+    std::string path = socket_path("two_procs");
+    ::unlink(path.c_str());
+    int to_child[2];
+    assert(pipe(to_child) == 0);
+    pid_t child = fork();
+    assert(child >= 0);
+    if (child == 0) {
+        // child is the leader, it writes and then waits to be told to quit
+        close(to_child[1]);
+        redisStream stream;
+        replicationLeader leader(stream, path);
+        if (!leader.start()) _exit(1);
+        for (int i = 0; i < 100; ++i)
+            stream.xadd("events", {{"n", std::to_string(i)}});
+        stream.xdel("events", {0});
+        char byte;
+        if (read(to_child[0], &byte, 1) < 0) _exit(1);
+        leader.stop();
+        _exit(0);
+    }
+    close(to_child[0]);
+    redisStream stream;
+    replicationFollower follower(stream, path);
+    assert(follower.start());
+    assert(wait_for([&] { return stream.xlen("events") == 99; }, 5000));
+    assert(stream.xrange("events")[0].first == 1);
+    replicaStatus status = follower.status();
+    assert(status.connected);
+    assert(wait_for([&] {
+        status = follower.status();
+        return status.leader_offset == status.applied_offset;
+    }));
+    follower.stop();
+    assert(write(to_child[1], "x", 1) == 1);
+    close(to_child[1]);
+    int exit_status = 0;
+    waitpid(child, &exit_status, 0);
+    assert(WIFEXITED(exit_status) && WEXITSTATUS(exit_status) == 0);
+    std::cout << "test_leader_and_follower_in_two_processes passed" << std::endl;
+}
+
+// subscribers on a follower get the entries as the leader's xadds get
+// replayed
+void test_follower_subscribers_get_replicated_entries() {
+    std::string path = socket_path("subscribe");
+    redisStream leader_stream, follower_stream;
+    replicationLeader leader(leader_stream, path);
+    assert(leader.start());
+    replicationFollower follower(follower_stream, path);
+    assert(follower.start());
+    assert(wait_for([&] { return follower.status().connected; }));
+    auto subscription = follower_stream.subscribe({"mystream"});
+    for (int i = 0; i < 5; ++i)
+        leader_stream.xadd("mystream", {{"n", std::to_string(i)}});
+    std::vector<PublishedEntryPointer> got;
+    assert(wait_for([&] {
+        subscription->pop(got, 10);
+        return got.size() == 5;
+    }));
+    for (int i = 0; i < 5; ++i)
+        assert(got[i]->id == i && got[i]->fields[0].second == std::to_string(i));
+    std::cout << "test_follower_subscribers_get_replicated_entries passed" << std::endl;
+}
+
+// a stream a lot bigger than one frame goes over in pieces, and so do
+// batches of mutations that wouldn't fit in one
+void test_full_sync_bigger_than_a_frame() {
+    std::string path = socket_path("big_sync");
+    streamConfig config;
+    config.block_entries = 8;
+    config.memory_budget = 2048; // some of it spilled too
+    redisStream leader_stream(config), follower_stream;
+    replicationConfig small;
+    small.max_frame_bytes = 4096;
+    for (int i = 0; i < 300; ++i)
+        leader_stream.xadd("big", {{"n", std::to_string(i)}, {"pad", std::string(100, 'x')}});
+    leader_stream.xadd("small", {{"n", "0"}});
+    leader_stream.xdel("big", {3, 150, 299});
+    assert(leader_stream.storage_stats().spilled_blocks > 0);
+    replicationLeader leader(leader_stream, path, small);
+    assert(leader.start());
+    replicationFollower follower(follower_stream, path, small);
+    assert(follower.start());
+    assert(wait_for([&] { return caught_up(leader_stream, follower_stream); }));
+    assert(follower.status().full_syncs == 1);
+    assert(follower_stream.xrange("big", 0, LLONG_MAX) == leader_stream.xrange("big", 0, LLONG_MAX));
+    // arrival times come along too
+    assert(follower_stream.xrange_bytime("big", 0, LLONG_MAX, 297) ==
+           leader_stream.xrange_bytime("big", 0, LLONG_MAX, 297));
+    assert(follower_stream.xlen("small") == 1);
+    for (int i = 0; i < 200; ++i)
+        leader_stream.xadd("big", {{"pad", std::string(200, 'y')}});
+    assert(wait_for([&] { return caught_up(leader_stream, follower_stream); }));
+    assert(follower_stream.xlen("big") == 497);
+    follower.stop();
+    leader.stop();
+    std::cout << "test_full_sync_bigger_than_a_frame passed" << std::endl;
+}
+
+// a length off the wire is checked before anything gets allocated for it
+void test_oversized_frames_are_refused() {
+    int fds[2];
+    assert(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    std::string header(1, 'M');
+    put_u64(header, max_frame_bytes + 1);
+    assert(write_all(fds[0], header.data(), header.size()));
+    char type;
+    std::string payload;
+    assert(!recv_frame(fds[1], type, payload));
+    assert(payload.empty());
+    ::close(fds[0]);
+    ::close(fds[1]);
+    // a string length that would wrap pos + len round to something small
+    std::string buf;
+    put_u64(buf, 1);
+    put_u64(buf, UINT64_MAX - 7);
+    buf.append("abcd");
+    wireReader in{buf};
+    assert(in.u64() == 1);
+    assert(in.str().empty() && !in.ok);
+    std::cout << "test_oversized_frames_are_refused passed" << std::endl;
+}
+
+int main() {
+    test_full_sync();
+    test_oversized_frames_are_refused();
+    test_full_sync_bigger_than_a_frame();
+    test_mutations_are_streamed();
+    test_blocked_reader_on_follower_wakes_up();
+    test_partial_resync();
+    test_full_resync_when_backlog_overflows();
+    test_retention_trims_replicate();
+    test_evictions_replicate();
+    test_follower_subscribers_get_replicated_entries();
+    test_leader_and_follower_in_two_processes();
+    std::cout << "All replication tests passed!" << std::endl;
+    return 0;
+}
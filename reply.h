@@ -0,0 +1,289 @@
+// reply encoder for the interface. handlers serialize into one growable
+// buffer that gets reused between replies, and flush writes the whole thing
+// at once. before this every line went through std::cout and on a terminal
+// (or anything line buffered) a 10k entry XRANGE was tens of thousands of
+// write calls.
+//
+// two formats, the human readable one the interface always printed and
+// RESP so something else can parse the replies. in the human one errors go
+// to stderr like before, in RESP they're part of the reply.
+
+#pragma once
+#include "stream.h"
+#include "resp.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <charconv>
+#include <cstdio>
+#include <cerrno>
+#include <unistd.h>
+
+enum replyFormat { REPLY_HUMAN, REPLY_RESP };
+
+class replyEncoder {
+private:
+    replyFormat format_;
+    std::string out_, err_;
+    // human errors go to their own fd. for each run of them, how far out_
+    // had got when it started and how far err_ got by its end, so flush
+    // writes them in between the replies they came with
+    std::vector<std::pair<size_t, size_t>> err_at_;
+    size_t write_calls_ = 0;
+
+    void number_(long long v) {
+        char buf[24];
+        auto done = std::to_chars(buf, buf + sizeof(buf), v);
+        out_.append(buf, done.ptr - buf);
+    }
+
+    // same as the default ostream formatting for doubles
+    static std::string_view format_double_(double v, char (&buf)[32]) {
+        int n = std::snprintf(buf, sizeof(buf), "%g", v);
+        return std::string_view(buf, n);
+    }
+
+    void double_(double v) {
+        char buf[32];
+        std::string_view s = format_double_(v, buf);
+        out_.append(s.data(), s.size());
+    }
+
+    void resp_header_(char type, long long n) { resp_header(out_, type, n); }
+    void resp_bulk_(std::string_view s) { resp_bulk(out_, s); }
+    void resp_entry_(long long id, const FieldsStructure &fields) { resp_entry(out_, id, fields); }
+
+    void human_fields_(const FieldsStructure &fields, std::string_view indent) {
+        long long field_index = 1;
+        for (const auto &fv : fields) {
+            out_.append(indent.data(), indent.size());
+            number_(field_index++);
+            out_ += ") ";
+            out_ += fv.first;
+            out_ += ':';
+            out_ += fv.second;
+            out_ += '\n';
+        }
+    }
+
+    // false if the fd is gone, retries short writes and EINTR
+    bool write_all_(int fd, std::string_view data) {
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+            ++write_calls_;
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            done += n;
+        }
+        return true;
+    }
+
+public:
+    explicit replyEncoder(replyFormat format = REPLY_HUMAN) : format_(format) {
+        out_.reserve(4096);
+    }
+
+    replyFormat format() const { return format_; }
+    const std::string &buffer() const { return out_; }
+    const std::string &errors() const { return err_; }
+    size_t write_calls() const { return write_calls_; }
+
+    // keeps the capacity around for the next reply
+    void clear() {
+        out_.clear();
+        err_.clear();
+        err_at_.clear();
+    }
+
+    // for RESP that's already serialized somewhere else (the engine's reply
+    // caches), handlers only use it in RESP
+    std::string &resp_buffer() { return out_; }
+
+    // the prompt and such, only in the human format
+    void raw(std::string_view s) {
+        if (format_ == REPLY_HUMAN) out_.append(s.data(), s.size());
+    }
+
+    // code is the first word of a RESP error, the human format only shows
+    // it when it isn't plain ERR
+    void error(std::string_view message, std::string_view code = "ERR") {
+        std::string &to = format_ == REPLY_HUMAN ? err_ : out_;
+        if (format_ == REPLY_RESP) to += '-';
+        if (format_ == REPLY_RESP || code != "ERR") {
+            to.append(code.data(), code.size());
+            to += ' ';
+        }
+        to.append(message.data(), message.size());
+        to += format_ == REPLY_RESP ? "\r\n" : "\n";
+        if (format_ == REPLY_RESP) return;
+        if (!err_at_.empty() && err_at_.back().first == out_.size())
+            err_at_.back().second = err_.size();
+        else
+            err_at_.emplace_back(out_.size(), err_.size());
+    }
+
+    void integer(long long v) {
+        if (format_ == REPLY_RESP) {
+            resp_header_(':', v);
+            return;
+        }
+        number_(v);
+        out_ += '\n';
+    }
+
+    void status(std::string_view s) {
+        if (format_ == REPLY_RESP) out_ += '+';
+        out_.append(s.data(), s.size());
+        out_ += format_ == REPLY_RESP ? "\r\n" : "\n";
+    }
+
+    // free form text like INFO, as is for people and one bulk string in RESP
+    void text(std::string_view s) {
+        if (format_ == REPLY_RESP) resp_bulk_(s);
+        else out_.append(s.data(), s.size());
+    }
+
+    void value(double v) {
+        if (format_ == REPLY_RESP) {
+            char buf[32];
+            resp_bulk_(format_double_(v, buf));
+            return;
+        }
+        double_(v);
+        out_ += '\n';
+    }
+
+    // EXEC, the n replies after this are one array in RESP. the human
+    // format just has them one after another
+    void array(long long n) {
+        if (format_ == REPLY_RESP) resp_header_('*', n);
+    }
+
+    // XRANGE
+    void range(const VectorPairStructure &entries) {
+        if (format_ == REPLY_RESP) {
+            resp_header_('*', static_cast<long long>(entries.size()));
+            for (const auto &entry : entries) resp_entry_(entry.first, entry.second);
+            return;
+        }
+        long long id_index = 1;
+        for (const auto &entry : entries) {
+            number_(id_index++);
+            out_ += ") ";
+            number_(entry.first);
+            out_ += '\n';
+            human_fields_(entry.second, "\t");
+            out_ += '\n';
+        }
+    }
+
+    // XREAD
+    void streams(const ResultStructure &result) {
+        if (format_ == REPLY_RESP) {
+            resp_header_('*', static_cast<long long>(result.size()));
+            for (const auto &p : result) {
+                resp_header_('*', 2);
+                resp_bulk_(p.first);
+                resp_header_('*', static_cast<long long>(p.second.size()));
+                for (const auto &entry : p.second) resp_entry_(entry.first, entry.second);
+            }
+            return;
+        }
+        long long key_index = 1;
+        for (const auto &p : result) {
+            number_(key_index++);
+            out_ += ") \"";
+            out_ += p.first;
+            out_ += "\"\n";
+            long long id_index = 0;
+            for (const auto &entry : p.second) {
+                out_ += '\t';
+                number_(id_index++);
+                out_ += ") ";
+                number_(entry.first);
+                out_ += '\n';
+                human_fields_(entry.second, "\t\t");
+            }
+        }
+    }
+
+    // XMERGE
+    void merged(const std::vector<mergedEntry> &entries) {
+        if (format_ == REPLY_RESP) {
+            resp_header_('*', static_cast<long long>(entries.size()));
+            for (const auto &entry : entries) {
+                resp_header_('*', 2);
+                resp_bulk_(entry.stream_name);
+                resp_entry_(entry.id, entry.fields);
+            }
+            return;
+        }
+        long long entry_index = 1;
+        for (const auto &entry : entries) {
+            number_(entry_index++);
+            out_ += ") \"";
+            out_ += entry.stream_name;
+            out_ += "\" ";
+            number_(entry.id);
+            out_ += '\n';
+            human_fields_(entry.fields, "\t");
+        }
+    }
+
+    // an entry pushed to a subscription. RESP clients get the bytes that
+    // were serialized once for every subscriber
+    void published(const publishedEntry &entry) {
+        if (format_ == REPLY_RESP) {
+            out_ += entry.resp;
+            return;
+        }
+        out_ += "message \"";
+        out_ += entry.stream_name;
+        out_ += "\" ";
+        number_(entry.id);
+        out_ += '\n';
+        human_fields_(entry.fields, "\t");
+    }
+
+    // XAGG with BUCKET, start ms and value of each bucket
+    void buckets(const std::vector<std::pair<long long, double>> &values) {
+        if (format_ == REPLY_RESP) {
+            resp_header_('*', static_cast<long long>(values.size()));
+            for (const auto &bucket : values) {
+                resp_header_('*', 2);
+                resp_header_(':', bucket.first);
+                char buf[32];
+                resp_bulk_(format_double_(bucket.second, buf));
+            }
+            return;
+        }
+        long long bucket_index = 1;
+        for (const auto &bucket : values) {
+            number_(bucket_index++);
+            out_ += ") ";
+            number_(bucket.first);
+            out_ += ' ';
+            double_(bucket.second);
+            out_ += '\n';
+        }
+    }
+
+    // writes everything buffered since the last flush in the order it came
+    // in, one write per run of replies and one per run of errors (those go
+    // to err_fd), then the buffers are reused
+    bool flush(int out_fd = STDOUT_FILENO, int err_fd = STDERR_FILENO) {
+        std::string_view out = out_, err = err_;
+        size_t out_done = 0, err_done = 0;
+        bool ok = true;
+        for (const auto &at : err_at_) {
+            ok = ok && write_all_(out_fd, out.substr(out_done, at.first - out_done)) &&
+                 write_all_(err_fd, err.substr(err_done, at.second - err_done));
+            out_done = at.first;
+            err_done = at.second;
+        }
+        ok = ok && write_all_(out_fd, out.substr(out_done));
+        clear();
+        return ok;
+    }
+};
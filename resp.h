@@ -0,0 +1,36 @@
+// RESP building blocks shared by the reply encoder and by pub/sub, which
+// serializes each new entry once for all of its subscribers.
+
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <charconv>
+
+inline void resp_header(std::string &out, char type, long long n) {
+    char buf[24];
+    auto done = std::to_chars(buf, buf + sizeof(buf), n);
+    out += type;
+    out.append(buf, done.ptr - buf);
+    out += "\r\n";
+}
+
+inline void resp_bulk(std::string &out, std::string_view s) {
+    resp_header(out, '$', static_cast<long long>(s.size()));
+    out.append(s.data(), s.size());
+    out += "\r\n";
+}
+
+// one stream entry the way XRANGE and XREAD send it, [id, [field, value ...]]
+template <typename Fields>
+inline void resp_entry(std::string &out, long long id, const Fields &fields) {
+    char buf[24];
+    auto done = std::to_chars(buf, buf + sizeof(buf), id);
+    resp_header(out, '*', 2);
+    resp_bulk(out, std::string_view(buf, done.ptr - buf));
+    resp_header(out, '*', static_cast<long long>(fields.size() * 2));
+    for (const auto &fv : fields) {
+        resp_bulk(out, fv.first);
+        resp_bulk(out, fv.second);
+    }
+}
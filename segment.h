@@ -0,0 +1,685 @@
+// sealed blocks, the immutable chunks older stream entries get packed into
+// once the tail moves on. a block is one contiguous buffer so it can live in
+// memory or get written out to a segment file and read back through mmap
+// without changing how it's read.
+//
+// layout, everything little endian:
+//   header   u32 magic, u32 count, i64 first id, i64 last id,
+//            u32 times offset, u32 columns offset, u32 payload size,
+//            u32 stored payload size
+//   ids      i64[count]
+//   offsets  u32[count + 1] into the payload
+//   payload  per entry u32 field count then u32 length + bytes for every
+//            field and value. compressed with lzCodec when the stored size
+//            is smaller than the payload size, only this part is since ids,
+//            times and columns get read without decoding any entries.
+//   times    i64[count] arrival time of each entry in ms
+//   columns  u32 column count, then for each column u32 name length, name,
+//            u32 values offset, u32 present offset. every field that has a
+//            numeric value somewhere in the block gets a column of
+//            double[count] values (0 where it's missing or not a number) and
+//            u8[count] present flags, so aggregating a field is a straight
+//            loop over two arrays instead of decoding entries.
+//
+// stream.h includes this after it declares the structure aliases.
+
+#pragma once
+#include "compression.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <iterator>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <limits>
+#include <climits>
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// count/sum/min/max of a numeric field over some entries, one per bucket
+// when XAGG buckets by time
+struct aggregateBucket
+{
+    long long start_ms = 0;
+    long long count = 0;
+    double sum = 0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+
+    void add(double value)
+    {
+        count++;
+        sum += value;
+        min = std::min(min, value);
+        max = std::max(max, value);
+    }
+
+    void merge(const aggregateBucket &other)
+    {
+        count += other.count;
+        sum += other.sum;
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+    }
+};
+
+// a segment file mapped read only, unmapped when the last block using it
+// goes away
+class segmentMapping
+{
+private:
+    void *address_ = MAP_FAILED;
+    size_t size_ = 0;
+
+public:
+    segmentMapping(void *address, size_t size) : address_(address), size_(size) {}
+    segmentMapping(const segmentMapping &) = delete;
+    segmentMapping &operator=(const segmentMapping &) = delete;
+    ~segmentMapping()
+    {
+        if (address_ != MAP_FAILED)
+            ::munmap(address_, size_);
+    }
+
+    const char *data() const { return static_cast<const char *>(address_); }
+    size_t size() const { return size_; }
+
+    // writes bytes to a new file in dir and maps it back. the file is
+    // unlinked right away, the mapping keeps it alive and nothing is left
+    // behind in dir if the process dies.
+    static std::shared_ptr<segmentMapping> write(const std::string &dir,
+                                                 const char *bytes,
+                                                 size_t size)
+    {
+        static std::atomic<unsigned long long> sequence{0};
+        std::string path = dir + "/redis_stream_" + std::to_string(::getpid()) +
+                           "_" + std::to_string(sequence.fetch_add(1)) + ".seg";
+        int fd = ::open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0)
+            return nullptr;
+        size_t written = 0;
+        while (written < size)
+        {
+            ssize_t n = ::write(fd, bytes + written, size - written);
+            if (n <= 0)
+                break;
+            written += static_cast<size_t>(n);
+        }
+        void *address = MAP_FAILED;
+        if (written == size)
+            address = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        ::unlink(path.c_str());
+        if (address == MAP_FAILED)
+            return nullptr;
+        // blocks are always read front to back
+        ::madvise(address, size, MADV_SEQUENTIAL);
+        return std::make_shared<segmentMapping>(address, size);
+    }
+};
+
+// decompressed payloads of the compressed blocks read most recently. blocks
+// only hold a weak_ptr to theirs so anything that falls out of here is
+// freed and decompressed again the next time it's read. it's only touched
+// with the stream lock held, but a parallel range read has several threads
+// decoding blocks under that one lock so it keeps its own mutex too.
+class decompressCache
+{
+private:
+    mutable std::mutex mutex_;
+    size_t capacity_ = 8;
+    std::deque<std::shared_ptr<const std::vector<char>>> recent_; // newest last
+    size_t bytes_ = 0;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+
+public:
+    void set_capacity(size_t capacity)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        capacity_ = capacity;
+    }
+    size_t bytes() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return bytes_;
+    }
+    size_t hits() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return hits_;
+    }
+    size_t misses() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return misses_;
+    }
+
+    void hit(const std::shared_ptr<const std::vector<char>> &plain)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        hits_++;
+        // a scan reads a block many times in a row, don't go looking then
+        if (recent_.empty() || recent_.back() == plain)
+            return;
+        auto found = std::find(recent_.begin(), recent_.end(), plain);
+        if (found != recent_.end())
+        {
+            recent_.erase(found);
+            recent_.push_back(plain);
+        }
+    }
+
+    void add(std::shared_ptr<const std::vector<char>> plain)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        misses_++;
+        bytes_ += plain->size();
+        recent_.push_back(std::move(plain));
+        while (recent_.size() > capacity_)
+        {
+            bytes_ -= recent_.front()->size();
+            recent_.pop_front();
+        }
+    }
+};
+
+class sealedBlock
+{
+private:
+    static constexpr uint32_t magic_ = 0x33425352; // "RSB3"
+    static constexpr size_t header_size_ = 40;
+
+    std::vector<char> bytes_;                 // while it's resident
+    std::shared_ptr<segmentMapping> segment_; // once it's spilled
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+    uint32_t count_ = 0;
+    long long first_id_ = 0;
+    long long last_id_ = 0;
+    // earliest and latest arrival time in the block, for XRANGE BYTIME. ids
+    // don't have to follow arrival order so these can be anything.
+    long long min_time_ = 0;
+    long long max_time_ = 0;
+    size_t times_at_ = 0;
+    size_t columns_at_ = 0;
+    size_t payload_size_ = 0;
+    size_t stored_payload_size_ = 0;
+    decompressCache *cache_ = nullptr; // only set on compressed blocks
+    mutable std::weak_ptr<const std::vector<char>> plain_;
+    // deletes don't touch the bytes, they mark the entry here and everything
+    // that reads entries skips it. allocated on the first delete.
+    std::vector<uint8_t> deleted_;
+    size_t deleted_count_ = 0;
+    bool retired_ = false;
+
+    template <typename T>
+    static void put_(std::vector<char> &out, size_t at, T value)
+    {
+        std::memcpy(out.data() + at, &value, sizeof(T));
+    }
+
+    template <typename T>
+    T get_(size_t at) const
+    {
+        T value;
+        std::memcpy(&value, data_ + at, sizeof(T));
+        return value;
+    }
+
+    size_t offsets_at_() const { return header_size_ + 8 * static_cast<size_t>(count_); }
+    size_t payload_at_() const { return offsets_at_() + 4 * (static_cast<size_t>(count_) + 1); }
+    static size_t align8_(size_t at) { return (at + 7) & ~static_cast<size_t>(7); }
+
+    template <typename T>
+    static T load_(const char *p)
+    {
+        T value;
+        std::memcpy(&value, p, sizeof(T));
+        return value;
+    }
+
+    // the payload to decode entries from, decompressed if it has to be.
+    // keep holding on to plain for as long as the pointer is used. null if
+    // a compressed payload doesn't decompress, which means the bytes got
+    // mangled somewhere.
+    const char *payload_(std::shared_ptr<const std::vector<char>> &plain) const
+    {
+        if (!cache_)
+            return data_ + payload_at_();
+        plain = plain_.lock();
+        if (plain)
+        {
+            cache_->hit(plain);
+            return plain->data();
+        }
+        auto decoded = std::make_shared<std::vector<char>>(payload_size_);
+        if (!lzCodec::decompress(data_ + payload_at_(), stored_payload_size_,
+                                 decoded->data(), decoded->size()))
+            return nullptr;
+        plain = decoded;
+        plain_ = plain;
+        cache_->add(plain);
+        return plain->data();
+    }
+
+    // finds the column for field, values and present are null if the block
+    // has no numbers for it
+    void column_(const std::string &field, const double *&values,
+                 const uint8_t *&present) const
+    {
+        values = nullptr;
+        present = nullptr;
+        size_t at = columns_at_;
+        uint32_t n = get_<uint32_t>(at);
+        at += 4;
+        for (uint32_t c = 0; c < n; ++c)
+        {
+            uint32_t name_len = get_<uint32_t>(at);
+            bool match = name_len == field.size() &&
+                         std::memcmp(data_ + at + 4, field.data(), name_len) == 0;
+            at += 4 + name_len;
+            if (match)
+            {
+                // values are 8 byte aligned in the buffer and the buffer
+                // itself is (vector or page aligned mapping)
+                values = reinterpret_cast<const double *>(data_ + get_<uint32_t>(at));
+                present = reinterpret_cast<const uint8_t *>(data_ + get_<uint32_t>(at + 4));
+                return;
+            }
+            at += 8;
+        }
+    }
+
+public:
+    // only values that are entirely a finite number count for aggregation
+    static bool parse_number(const std::string &text, double &out)
+    {
+        if (text.empty())
+            return false;
+        char *end = nullptr;
+        out = std::strtod(text.c_str(), &end);
+        return end == text.c_str() + text.size() && std::isfinite(out);
+    }
+
+    // packs entries (sorted by id, at least one) into a new resident block,
+    // time_of(id) gives the arrival time of each one. given a cache the
+    // payload gets compressed if that makes it smaller and reads of it
+    // decompress through the cache.
+    template <typename Iterator, typename TimeOf>
+    static std::shared_ptr<sealedBlock> build(Iterator begin, Iterator end,
+                                              TimeOf time_of,
+                                              decompressCache *cache = nullptr)
+    {
+        auto block = std::make_shared<sealedBlock>();
+        size_t count = static_cast<size_t>(std::distance(begin, end));
+        size_t payload = 0;
+        for (auto it = begin; it != end; ++it)
+        {
+            payload += 4;
+            for (const auto &fv : it->second)
+                payload += 8 + fv.first.size() + fv.second.size();
+        }
+        std::vector<char> offsets(4 * (count + 1));
+        std::vector<char> plain(payload);
+        size_t i = 0;
+        uint32_t offset = 0;
+        for (auto it = begin; it != end; ++it, ++i)
+        {
+            put_<uint32_t>(offsets, 4 * i, offset);
+            size_t at = offset;
+            put_<uint32_t>(plain, at, static_cast<uint32_t>(it->second.size()));
+            at += 4;
+            for (const auto &fv : it->second)
+            {
+                for (const std::string *s : {&fv.first, &fv.second})
+                {
+                    put_<uint32_t>(plain, at, static_cast<uint32_t>(s->size()));
+                    std::memcpy(plain.data() + at + 4, s->data(), s->size());
+                    at += 4 + s->size();
+                }
+            }
+            offset = static_cast<uint32_t>(at);
+        }
+        put_<uint32_t>(offsets, 4 * count, offset);
+        std::vector<char> packed;
+        if (cache)
+        {
+            packed = lzCodec::compress(plain.data(), plain.size());
+            if (packed.size() < plain.size())
+                block->cache_ = cache;
+            else
+                packed.clear();
+        }
+        const std::vector<char> &stored = block->cache_ ? packed : plain;
+        // pull the numeric columns out first so the final size is known
+        std::vector<std::string> names;
+        std::map<std::string, size_t> column_of;
+        std::vector<std::vector<double>> values;
+        std::vector<std::vector<uint8_t>> present;
+        size_t row = 0;
+        for (auto it = begin; it != end; ++it, ++row)
+        {
+            for (const auto &fv : it->second)
+            {
+                double number;
+                if (!parse_number(fv.second, number))
+                    continue;
+                auto found = column_of.find(fv.first);
+                if (found == column_of.end())
+                {
+                    found = column_of.emplace(fv.first, names.size()).first;
+                    names.push_back(fv.first);
+                    values.emplace_back(count, 0.0);
+                    present.emplace_back(count, 0);
+                }
+                // first one wins if a field shows up twice in an entry
+                if (!present[found->second][row])
+                {
+                    values[found->second][row] = number;
+                    present[found->second][row] = 1;
+                }
+            }
+        }
+
+        std::vector<char> &out = block->bytes_;
+        size_t ids_at = header_size_;
+        size_t offsets_at = ids_at + 8 * count;
+        size_t payload_at = offsets_at + 4 * (count + 1);
+        size_t times_at = align8_(payload_at + stored.size());
+        size_t columns_at = times_at + 8 * count;
+        size_t directory = 4;
+        for (const auto &name : names)
+            directory += 12 + name.size();
+        std::vector<size_t> values_at(names.size());
+        size_t at_column = align8_(columns_at + directory);
+        for (size_t c = 0; c < names.size(); ++c)
+        {
+            values_at[c] = at_column;
+            at_column = align8_(at_column + 9 * count);
+        }
+        out.resize(at_column);
+
+        i = 0;
+        long long min_time = LLONG_MAX, max_time = LLONG_MIN;
+        for (auto it = begin; it != end; ++it, ++i)
+        {
+            long long time = time_of(it->first);
+            put_<int64_t>(out, ids_at + 8 * i, it->first);
+            put_<int64_t>(out, times_at + 8 * i, time);
+            min_time = std::min(min_time, time);
+            max_time = std::max(max_time, time);
+        }
+        std::memcpy(out.data() + offsets_at, offsets.data(), offsets.size());
+        std::memcpy(out.data() + payload_at, stored.data(), stored.size());
+        size_t at = columns_at;
+        put_<uint32_t>(out, at, static_cast<uint32_t>(names.size()));
+        at += 4;
+        for (size_t c = 0; c < names.size(); ++c)
+        {
+            put_<uint32_t>(out, at, static_cast<uint32_t>(names[c].size()));
+            std::memcpy(out.data() + at + 4, names[c].data(), names[c].size());
+            at += 4 + names[c].size();
+            put_<uint32_t>(out, at, static_cast<uint32_t>(values_at[c]));
+            put_<uint32_t>(out, at + 4, static_cast<uint32_t>(values_at[c] + 8 * count));
+            at += 8;
+            std::memcpy(out.data() + values_at[c], values[c].data(), 8 * count);
+            std::memcpy(out.data() + values_at[c] + 8 * count, present[c].data(), count);
+        }
+
+        put_<uint32_t>(out, 0, magic_);
+        put_<uint32_t>(out, 4, static_cast<uint32_t>(count));
+        put_<int64_t>(out, 8, begin->first);
+        put_<int64_t>(out, 16, std::prev(end)->first);
+        put_<uint32_t>(out, 24, static_cast<uint32_t>(times_at));
+        put_<uint32_t>(out, 28, static_cast<uint32_t>(columns_at));
+        put_<uint32_t>(out, 32, static_cast<uint32_t>(plain.size()));
+        put_<uint32_t>(out, 36, static_cast<uint32_t>(stored.size()));
+
+        block->times_at_ = times_at;
+        block->columns_at_ = columns_at;
+        block->payload_size_ = plain.size();
+        block->stored_payload_size_ = stored.size();
+        block->data_ = out.data();
+        block->size_ = out.size();
+        block->count_ = static_cast<uint32_t>(count);
+        block->first_id_ = begin->first;
+        block->last_id_ = std::prev(end)->first;
+        block->min_time_ = min_time;
+        block->max_time_ = max_time;
+        return block;
+    }
+
+    size_t size() const { return count_; }
+    long long first_id() const { return first_id_; }
+    long long last_id() const { return last_id_; }
+    long long min_time() const { return min_time_; }
+    long long max_time() const { return max_time_; }
+    size_t bytes() const { return size_; }
+    size_t payload_bytes() const { return payload_size_; }
+    size_t stored_payload_bytes() const { return stored_payload_size_; }
+    bool compressed() const { return cache_ != nullptr; }
+    bool resident() const { return !segment_; }
+    const char *data() const { return data_; }
+
+    // set once the stream stopped using the block, a spill that was already
+    // writing it out then knows to not count it anymore
+    bool retired() const { return retired_; }
+    void retire() { retired_ = true; }
+
+    long long id_at(size_t i) const { return get_<int64_t>(header_size_ + 8 * i); }
+    long long time_at(size_t i) const { return get_<int64_t>(times_at_ + 8 * i); }
+
+    bool deleted(size_t i) const { return deleted_count_ && deleted_[i]; }
+    size_t deleted_count() const { return deleted_count_; }
+    size_t live() const { return count_ - deleted_count_; }
+
+    // tombstones entry i, false if it already was. caller holds the lock.
+    bool erase(size_t i)
+    {
+        if (deleted(i))
+            return false;
+        if (deleted_.empty())
+            deleted_.assign(count_, 0);
+        deleted_[i] = 1;
+        deleted_count_++;
+        return true;
+    }
+
+    // entries before i that haven't been deleted
+    size_t live_before(size_t i) const
+    {
+        if (!deleted_count_)
+            return i;
+        size_t gone = 0;
+        for (size_t j = 0; j < i; ++j)
+            gone += deleted_[j];
+        return i - gone;
+    }
+
+    // folds entries [from, to) of field's column into out. four independent
+    // lanes and no branches so the compiler can keep it in vector registers,
+    // missing values are stored as 0 so the sum doesn't need to check.
+    // deleted entries get masked out the same way as missing ones.
+    void aggregate(const std::string &field, size_t from, size_t to,
+                   aggregateBucket &out) const
+    {
+        const double *values;
+        const uint8_t *present;
+        column_(field, values, present);
+        if (!values)
+            return;
+        const double inf = std::numeric_limits<double>::infinity();
+        double sum[4] = {0, 0, 0, 0};
+        double low[4] = {inf, inf, inf, inf};
+        double high[4] = {-inf, -inf, -inf, -inf};
+        long long count[4] = {0, 0, 0, 0};
+        auto fold = [&](auto masked)
+        {
+            const uint8_t *dead = deleted_.data();
+            auto step = [&](int lane, size_t i)
+            {
+                uint8_t p = present[i];
+                if (masked)
+                    p &= static_cast<uint8_t>(!dead[i]);
+                double v = values[i];
+                sum[lane] += masked ? (p ? v : 0) : v;
+                count[lane] += p;
+                low[lane] = std::min(low[lane], p ? v : inf);
+                high[lane] = std::max(high[lane], p ? v : -inf);
+            };
+            size_t i = from;
+            for (; i + 4 <= to; i += 4)
+                for (int lane = 0; lane < 4; ++lane)
+                    step(lane, i + lane);
+            for (; i < to; ++i)
+                step(0, i);
+        };
+        if (deleted_count_)
+            fold(std::true_type());
+        else
+            fold(std::false_type());
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            out.sum += sum[lane];
+            out.count += count[lane];
+            out.min = std::min(out.min, low[lane]);
+            out.max = std::max(out.max, high[lane]);
+        }
+    }
+
+    FieldsStructure fields_at(size_t i) const
+    {
+        std::shared_ptr<const std::vector<char>> plain;
+        const char *p = payload_(plain);
+        if (!p)
+            return FieldsStructure();
+        return decode_fields_(p + get_<uint32_t>(offsets_at_() + 4 * i));
+    }
+
+    // entries from index i on up to end_id, at most limit of them, added to
+    // out. gets the payload once for all of them instead of once per entry
+    // like fields_at. returns false once it got past end_id or the limit so
+    // the caller knows to stop.
+    bool append_range(size_t i, long long end_id, size_t limit,
+                      VectorPairStructure &out) const
+    {
+        std::shared_ptr<const std::vector<char>> plain;
+        const char *p = payload_(plain);
+        if (!p)
+            return true;
+        for (; i < count_; ++i)
+        {
+            long long id = id_at(i);
+            if (id > end_id || limit == 0)
+                return false;
+            if (deleted(i))
+                continue;
+            out.emplace_back(id, decode_fields_(p + get_<uint32_t>(offsets_at_() + 4 * i)));
+            limit--;
+        }
+        return true;
+    }
+
+private:
+    static FieldsStructure decode_fields_(const char *p)
+    {
+        FieldsStructure fields;
+        uint32_t n = load_<uint32_t>(p);
+        p += 4;
+        fields.reserve(n);
+        for (uint32_t f = 0; f < n; ++f)
+        {
+            uint32_t field_len = load_<uint32_t>(p);
+            const char *field = p + 4;
+            p += 4 + field_len;
+            uint32_t value_len = load_<uint32_t>(p);
+            fields.emplace_back(std::string(field, field_len),
+                                std::string(p + 4, value_len));
+            p += 4 + value_len;
+        }
+        return fields;
+    }
+
+public:
+
+    // does entry i have field set to value, checked on the raw bytes so a
+    // filtered scan doesn't build a FieldsStructure for every entry
+    bool has_field_value(size_t i, const std::string &field,
+                         const std::string &value) const
+    {
+        std::shared_ptr<const std::vector<char>> plain;
+        const char *p = payload_(plain);
+        if (!p)
+            return false;
+        p += get_<uint32_t>(offsets_at_() + 4 * i);
+        uint32_t n = load_<uint32_t>(p);
+        p += 4;
+        for (uint32_t f = 0; f < n; ++f)
+        {
+            uint32_t field_len = load_<uint32_t>(p);
+            const char *name = p + 4;
+            p += 4 + field_len;
+            uint32_t value_len = load_<uint32_t>(p);
+            if (field_len == field.size() && value_len == value.size() &&
+                std::memcmp(name, field.data(), field_len) == 0 &&
+                std::memcmp(p + 4, value.data(), value_len) == 0)
+                return true;
+            p += 4 + value_len;
+        }
+        return false;
+    }
+
+    // index of the first entry with id >= the given one, size() if none
+    size_t lower_bound(long long id) const
+    {
+        size_t lo = 0, hi = count_;
+        while (lo < hi)
+        {
+            size_t mid = lo + (hi - lo) / 2;
+            if (id_at(mid) < id)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    // everything left in the block, used when a trim or the compactor has
+    // to rewrite it
+    VectorPairStructure entries() const
+    {
+        VectorPairStructure out;
+        out.reserve(live());
+        for (size_t i = 0; i < count_; ++i)
+            if (!deleted(i))
+                out.emplace_back(id_at(i), fields_at(i));
+        return out;
+    }
+
+    // switch over to reading from a segment that has the same bytes, the
+    // in-memory copy is freed. caller makes sure nobody is reading the block.
+    void install(std::shared_ptr<segmentMapping> segment)
+    {
+        segment_ = std::move(segment);
+        data_ = segment_->data();
+        std::vector<char>().swap(bytes_);
+    }
+
+    // ask the kernel to start reading a spilled block in before a scan
+    // gets to it
+    void prefetch() const
+    {
+        if (segment_)
+            ::madvise(const_cast<char *>(data_), size_, MADV_WILLNEED);
+    }
+};
@@ -0,0 +1,2801 @@
+// the whole engine is header only, #include "stream.h" and build with
+// -std=c++17 -pthread to embed it, replication.h on top of that for leader
+// and follower. interface.cpp and the tests are just users of it.
+
+#pragma once
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <optional>
+#include <unordered_map>
+#include <condition_variable>
+#include <chrono>
+#include <climits>
+#include <iterator>
+#include <deque>
+#include <random>
+#include <algorithm>
+#include <thread>
+#include <cmath>
+#include <set>
+#include <queue>
+#include <tuple>
+#include <functional>
+
+using FieldsStructure = std::vector<std::pair<std::string, std::string>>;
+using MapStructure = std::map<long long, FieldsStructure>;
+using VectorPairStructure = std::vector<std::pair<long long, FieldsStructure>>;
+using ResultStructure = std::map<std::string, VectorPairStructure>;
+
+#include "segment.h"
+#include "resp.h"
+#include "tail.h"
+#include "pool.h"
+#include "lazyfree.h"
+
+// secondary index on one field, value -> ids of the entries that have it.
+// ids only ever get appended in order so the lists stay sorted.
+using FieldIndexStructure = std::unordered_map<std::string, std::vector<long long>>;
+
+// per stream limits the maintenance thread keeps it to by trimming the
+// oldest entries, 0 is no limit
+struct retentionPolicy
+{
+    long long max_age_ms = 0; // by arrival time
+    size_t max_len = 0;
+    size_t max_bytes = 0; // sealed blocks and the tail, spilled or not
+
+    bool empty() const { return !max_age_ms && !max_len && !max_bytes; }
+};
+
+// one stream is a run of sealed blocks holding the older entries and the
+// hot tail that new entries go into. every id in the blocks is lower than
+// every id in the tail. everything we know about a stream lives here, one
+// map node per stream, and nothing in it allocates until it's used so a
+// stream with one entry is about the node and that entry. that's why these
+// are vectors and not deques, an empty deque already holds over 500 bytes.
+struct streamState
+{
+    std::vector<std::shared_ptr<sealedBlock>> blocks; // oldest first
+    size_t sealed_entries = 0;
+    tailEntries tail;
+    // (id, arrival ms) for the tail in id order. deleting from the middle of
+    // the tail leaves its time behind, lookups are by id so that's harmless
+    // and it goes away when that part of the tail gets sealed.
+    std::vector<std::pair<long long, long long>> tail_times;
+    // sparse time index, one slot per block. block_max_time[i] is the latest
+    // arrival time in blocks 0..i and block_min_time[i] the earliest in
+    // blocks i..end, so both stay sorted even when arrival times don't
+    // follow ids and XRANGE BYTIME can binary search them. appending a
+    // block keeps them up to date, anything else marks them stale and the
+    // next BYTIME query rebuilds them.
+    std::vector<long long> block_max_time;
+    std::vector<long long> block_min_time;
+    bool time_index_stale = false;
+    // only for the fields someone asked to index, keyed by field name
+    std::map<std::string, FieldIndexStructure> indexes;
+    retentionPolicy retention;
+    // where it sits in the engine's eviction order, only kept up while
+    // max_memory has a policy that needs it. oldest_ms is its key in oldest_,
+    // LLONG_MIN when it isn't in there.
+    std::list<const std::string *>::iterator lru_at;
+    long long oldest_ms = LLONG_MIN;
+    size_t block_bytes = 0;
+    size_t tail_bytes = 0; // estimated, see entry_bytes_
+    // RESP of the newest entries for polling readers, only once a RESP
+    // read of the stream's end came along
+    std::unique_ptr<tailReplyCache> reply_cache;
+    long long next_id = 0; // what xadd hands out next
+    long long last_id = -1; // newest id ever added, deleting it doesn't change this
+
+    size_t size() const { return sealed_entries + tail.size(); }
+    size_t bytes() const { return block_bytes + tail_bytes; }
+};
+using StreamDataStructure = std::map<std::string, streamState>;
+
+// what happens to a write once max_memory is used up
+enum evictionPolicy
+{
+    EVICT_NONE,           // writes get turned away until something frees up
+    EVICT_OLDEST_ENTRIES, // trim the oldest entries of whichever stream has them
+    EVICT_LRU_STREAMS,    // drop the streams that were read least recently
+};
+
+struct streamConfig
+{
+    // entries packed into each sealed block, the tail holds on to up to two
+    // blocks worth before the older half gets sealed. 0 never seals.
+    size_t block_entries = 1024;
+    // bytes of sealed blocks allowed in memory, past that the oldest ones get
+    // spilled to segment files in segment_dir. 0 means no limit.
+    size_t memory_budget = 0;
+    std::string segment_dir = "/tmp";
+    // compress the entry payloads of sealed blocks, reads decompress a block
+    // when they get to it and keep the last few decompressed
+    bool compress_blocks = false;
+    size_t decompressed_blocks = 8;
+    // xdel only tombstones entries in sealed blocks, once this much of a
+    // block is deleted the background compactor rewrites it without them.
+    // 0 leaves the tombstones alone.
+    double compact_ratio = 0.25;
+    // the maintenance thread (compaction and retention) holds the lock for
+    // at most about this long at a time and then lets go for as long again
+    long long maintenance_slice_us = 1000;
+    // how often it checks retention policies when there's nothing queued
+    long long maintenance_interval_ms = 100;
+    // memory the streams may use all together, 0 means no limit. counts the
+    // tail, sealed blocks in memory, decompressed blocks, the reply caches,
+    // the replication backlog, field indexes and a flat cost per stream.
+    // not counted: what's been spilled to segment files, the arrival times
+    // kept for the tail, entries queued for subscribers and anything waiting
+    // on the lazy free thread. the backlog and indexes can't be evicted, so
+    // a big enough backlog gets writes rejected even with eviction on.
+    size_t max_memory = 0;
+    evictionPolicy eviction = EVICT_NONE;
+    // range reads that cover at least this many entries in sealed blocks
+    // get their blocks decoded on range_threads threads at once, 0 never
+    // does. range_threads 0 means one per core, up to 8.
+    size_t parallel_range_entries = 65536;
+    size_t range_threads = 0;
+    // RESP reads from some id to the end of a stream (XRANGE key id + and
+    // XREAD) get served from a per stream cache of the newest entries
+    // already serialized, this many and up to twice as many. 0 turns it off.
+    size_t reply_cache_entries = 128;
+    // trims and dropped streams that take at least this many entries out
+    // get freed on a background thread instead of with the lock held. 0
+    // frees everything right away.
+    size_t lazyfree_entries = 64;
+};
+
+struct memoryStats
+{
+    size_t used_bytes = 0;
+    size_t max_bytes = 0;
+    size_t evicted_entries = 0;
+    size_t evicted_streams = 0;
+    size_t rejected_writes = 0;
+    size_t backlog_bytes = 0; // replication backlog, part of used_bytes
+    size_t index_bytes = 0;   // field indexes, part of used_bytes
+    size_t lazyfree_pending = 0; // handed to the free thread, not freed yet
+    size_t lazyfreed = 0;
+};
+
+struct maintenanceStats
+{
+    size_t cycles = 0;
+    size_t retention_trimmed = 0; // entries trimmed by retention policies
+    long long last_cycle_us = 0;
+    long long max_cycle_us = 0;
+    long long total_us = 0;
+};
+
+struct replyCacheStats
+{
+    size_t hits = 0;   // reads answered with a slice of the cache
+    size_t misses = 0; // RESP tail reads that had to go to the stream
+    size_t streams = 0; // streams that have a cache
+    size_t bytes = 0;
+};
+
+struct pubsubStats
+{
+    size_t subscriptions = 0;
+    size_t published = 0; // entries that had at least one subscriber
+};
+
+struct storageStats
+{
+    size_t sealed_blocks = 0;
+    size_t spilled_blocks = 0;
+    size_t resident_bytes = 0; // sealed blocks still in memory
+    size_t spilled_bytes = 0;
+    // entry payloads of sealed blocks before and after compression
+    size_t payload_bytes = 0;
+    size_t stored_payload_bytes = 0;
+    size_t decompressed_bytes = 0; // held by the decompressed block cache
+    size_t decompress_hits = 0;
+    size_t decompress_misses = 0;
+    size_t tombstones = 0;       // deleted entries still taking up space in blocks
+    size_t compacted_blocks = 0; // rewritten by the compactor so far
+    size_t parallel_ranges = 0;  // range reads split across the range pool
+};
+
+enum trimmingStrategy
+{
+    MAXLEN,
+    MINID,
+};
+
+// everything that changes the data gets written down as one of these when
+// the replication backlog is turned on, followers replay them in order.
+enum mutationKind
+{
+    MUTATION_XADD,
+    MUTATION_XDEL,
+    MUTATION_XTRIM,
+    MUTATION_DEL, // whole stream, from DEL/UNLINK and eviction
+};
+
+struct streamMutation
+{
+    long long offset = 0;     // position in the leader's log, starts at 1
+    long long logged_ms = 0;  // leader wall clock, used for lag in ms
+    mutationKind kind = MUTATION_XADD;
+    std::string stream_name;
+    long long id = 0;         // assigned id for xadd, threshold for xtrim
+    trimmingStrategy strategy = MAXLEN;
+    std::vector<long long> ids; // ids that actually got deleted by xdel
+    FieldsStructure data;
+};
+
+// whole stream copied out for a full sync
+struct streamSnapshot
+{
+    std::string stream_name;
+    long long next_id = 0;
+    VectorPairStructure entries;
+    std::vector<long long> arrival_ms; // one per entry
+};
+
+// what a full sync starts from. taking one only copies the tail, the sealed
+// blocks are shared with the stream and get read one at a time afterwards
+// with snapshot_block. a delete that lands in one of them in between is
+// already missing from the copy, replaying it after is a no-op.
+struct streamSnapshotView
+{
+    std::string stream_name;
+    long long next_id = 0;
+    std::vector<std::shared_ptr<sealedBlock>> blocks;
+    VectorPairStructure tail;
+    std::vector<long long> tail_arrival_ms;
+};
+
+// XMERGE, many streams read back as one in global order
+enum mergeOrder
+{
+    MERGE_BY_ID,   // ids, ties go to the stream listed first
+    MERGE_BY_TIME, // arrival time, then id
+};
+
+struct mergedEntry
+{
+    std::string stream_name;
+    long long id = 0;
+    long long arrival_ms = 0;
+    FieldsStructure fields;
+};
+
+// a new entry as pushed to subscribers. built once per xadd and shared by
+// every subscriber of the stream, resp is the entry already serialized the
+// way XREAD would send it for just this stream and entry so a RESP client
+// can write it out as is.
+struct publishedEntry
+{
+    std::string stream_name;
+    long long id = 0;
+    long long arrival_ms = 0;
+    FieldsStructure fields;
+    std::string resp;
+};
+
+using PublishedEntryPointer = std::shared_ptr<const publishedEntry>;
+
+// one subscriber's queue. xadd only pushes a pointer here, the subscriber
+// takes them off with pop from whatever thread it reads on. the queue is
+// bounded so a slow subscriber can't hold on to everything, past the limit
+// the oldest queued entries get dropped and counted and the subscriber can
+// XRANGE for the gap.
+class streamSubscription
+{
+private:
+    friend class redisStream;
+    mutable std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<PublishedEntryPointer> queue_;
+    std::vector<std::string> stream_names_;
+    size_t max_queued_;
+    size_t dropped_ = 0;
+    bool closed_ = false;
+
+    void push_(const PublishedEntryPointer &entry)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (closed_)
+                return;
+            if (queue_.size() >= max_queued_)
+            {
+                queue_.pop_front();
+                dropped_++;
+            }
+            queue_.push_back(entry);
+        }
+        ready_.notify_one();
+    }
+
+    void close_()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        ready_.notify_all();
+    }
+
+public:
+    streamSubscription(std::vector<std::string> stream_names, size_t max_queued)
+        : stream_names_(std::move(stream_names)),
+          max_queued_(max_queued ? max_queued : 1) {}
+
+    // waits up to wait_time for something to be queued then moves up to
+    // max_count entries into out, returns how many. gives back 0 right away
+    // once unsubscribed.
+    size_t pop(std::vector<PublishedEntryPointer> &out, size_t max_count,
+               std::chrono::milliseconds wait_time = std::chrono::milliseconds(0))
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_.wait_for(lock, wait_time, [this]
+                        { return closed_ || !queue_.empty(); });
+        size_t taken = 0;
+        while (!queue_.empty() && taken < max_count)
+        {
+            out.push_back(std::move(queue_.front()));
+            queue_.pop_front();
+            taken++;
+        }
+        return taken;
+    }
+
+    const std::vector<std::string> &stream_names() const { return stream_names_; }
+
+    size_t queued() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return queue_.size();
+    }
+
+    // entries thrown away because the queue was full
+    size_t dropped() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return dropped_;
+    }
+
+    bool closed() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return closed_;
+    }
+};
+
+class redisStream
+{
+private:
+    std::mutex mutex_; // switch to shared mutex and unique and shared lock
+    // in the future to better allow concurrent readers
+    StreamDataStructure stream_data_;
+    std::condition_variable new_data_condition_;
+    // ids are per stream sequence numbers kept in streamState, not globally
+    // unique and probably should use timestamps instead but I'm keeping it
+    // simple. a stream that gets dropped leaves its next id here so ids
+    // never go back if something writes to it again.
+    std::unordered_map<std::string, long long> dropped_next_ids_;
+    // fields someone asked to index on a stream that isn't there yet, the
+    // stream gets them when it's made instead of being made for them
+    std::unordered_map<std::string, std::set<std::string>> pending_indexes_;
+
+    // replication backlog, a bounded window of the most recent mutations so
+    // a follower that drops off for a bit can pick up where it left off
+    // instead of copying everything again. off unless someone asks for it.
+    size_t backlog_limit_ = 0;
+    std::deque<streamMutation> backlog_;
+    size_t backlog_bytes_ = 0; // estimated like entry_bytes_, for max_memory
+    long long replication_offset_ = 0;
+    std::string replication_id_;
+    std::condition_variable backlog_condition_;
+    std::atomic<bool> read_only_{false};
+
+    // tiered storage bookkeeping, resident_blocks_ is in the order blocks
+    // got sealed so the oldest ones are the first to be spilled
+    streamConfig config_;
+    std::deque<std::weak_ptr<sealedBlock>> resident_blocks_;
+    size_t resident_bytes_ = 0;
+    size_t spilling_bytes_ = 0; // picked to spill, still being written out
+    size_t spilled_bytes_ = 0;
+    size_t sealed_blocks_ = 0;
+    size_t spilled_blocks_ = 0;
+    size_t payload_bytes_ = 0;
+    size_t stored_payload_bytes_ = 0;
+    decompressCache decompressed_;
+
+    // threads for splitting up big range reads, made the first time one
+    // comes along. only used with the lock held so it's one read at a time.
+    mutable std::unique_ptr<workerPool> range_pool_;
+    mutable size_t parallel_ranges_ = 0;
+
+    // background maintenance, started the first time there's something for
+    // it to do. compaction_queue_ has the blocks that got past compact_ratio
+    // and the stream they're in, retention_streams_ the streams with a
+    // retention policy and retention_cursor_ where the last cycle stopped.
+    std::deque<std::pair<std::string, std::weak_ptr<sealedBlock>>> compaction_queue_;
+    std::set<std::string> retention_streams_;
+    std::string retention_cursor_;
+    std::condition_variable maintenance_condition_;
+    std::thread maintenance_;
+    bool stopping_ = false;
+    size_t tombstones_ = 0;
+    size_t compacted_blocks_ = 0;
+    maintenanceStats maintenance_stats_;
+
+    // max_memory bookkeeping. tail_bytes_ is every stream's tail_bytes
+    // added up so checking the limit is a couple of additions.
+    size_t tail_bytes_ = 0;
+    size_t index_bytes_ = 0; // postings in every field index, estimated
+    // the eviction candidates in order so finding the next one isn't a walk
+    // over every stream. lru_ is least recently read first, oldest_ has the
+    // streams with entries by the arrival time of their first one. both
+    // point at the map's own keys.
+    struct oldestOrder
+    {
+        bool operator()(const std::pair<long long, const std::string *> &a,
+                        const std::pair<long long, const std::string *> &b) const
+        {
+            return a.first != b.first ? a.first < b.first : *a.second < *b.second;
+        }
+    };
+    std::list<const std::string *> lru_;
+    std::set<std::pair<long long, const std::string *>, oldestOrder> oldest_;
+    size_t evicted_entries_ = 0;
+    size_t evicted_streams_ = 0;
+    size_t rejected_writes_ = 0;
+
+    // pub/sub, stream name -> subscribers. a subscription to a stream that
+    // doesn't exist yet doesn't create it.
+    std::unordered_map<std::string, std::vector<std::shared_ptr<streamSubscription>>> subscribers_;
+    size_t published_ = 0;
+    size_t subscriptions_ = 0;
+
+    // reply caches, reply_cache_bytes_ is all of them added up and counts
+    // toward max_memory
+    size_t reply_cache_hits_ = 0;
+    size_t reply_cache_misses_ = 0;
+    size_t reply_caches_ = 0;
+    size_t reply_cache_bytes_ = 0;
+
+    // what a trim or a dropped stream took out, already off every total.
+    // free_garbage_ decides whether it's destroyed on lazy_free_'s thread or
+    // right here.
+    struct streamGarbage
+    {
+        std::vector<std::shared_ptr<sealedBlock>> blocks;
+        std::vector<tailEntries> tails;
+        std::vector<streamState> streams;
+        size_t entries = 0;
+    };
+    lazyFreer lazy_free_;
+
+    // MULTI/EXEC, see batch(). batch_thread_ is the thread running one, it
+    // already holds mutex_ so its calls don't take it again. waking readers
+    // and pushing to subscribers wait until the end so nobody sees half of
+    // a batch.
+    std::atomic<std::thread::id> batch_thread_{};
+    bool batch_added_ = false;
+    std::vector<std::pair<std::shared_ptr<streamSubscription>, PublishedEntryPointer>> batch_published_;
+
+    bool in_batch_() const
+    {
+        return batch_thread_.load(std::memory_order_relaxed) == std::this_thread::get_id();
+    }
+
+    // what every public call locks with, empty (not owning anything) inside
+    // a batch on this thread
+    std::unique_lock<std::mutex> lock_()
+    {
+        if (in_batch_())
+            return std::unique_lock<std::mutex>();
+        return std::unique_lock<std::mutex>(mutex_);
+    }
+
+    // caller holds the lock
+    void wake_readers_()
+    {
+        if (in_batch_())
+            batch_added_ = true;
+        else
+            new_data_condition_.notify_all();
+    }
+
+    decompressCache *compression_()
+    {
+        return config_.compress_blocks ? &decompressed_ : nullptr;
+    }
+
+    static long long now_ms_()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    }
+
+    // caller holds the lock
+    void log_mutation_(streamMutation mutation)
+    {
+        if (backlog_limit_ == 0)
+            return;
+        mutation.offset = ++replication_offset_;
+        if (mutation.logged_ms == 0)
+            mutation.logged_ms = now_ms_();
+        backlog_bytes_ += mutation_bytes_(mutation);
+        backlog_.push_back(std::move(mutation));
+        trim_backlog_();
+        backlog_condition_.notify_all();
+    }
+
+    void trim_backlog_()
+    {
+        while (backlog_.size() > backlog_limit_)
+        {
+            backlog_bytes_ -= mutation_bytes_(backlog_.front());
+            backlog_.pop_front();
+        }
+    }
+
+    static size_t mutation_bytes_(const streamMutation &mutation)
+    {
+        static const size_t small_string = std::string().capacity();
+        size_t bytes = sizeof(streamMutation) + mutation.ids.capacity() * sizeof(long long);
+        if (mutation.stream_name.capacity() > small_string)
+            bytes += mutation.stream_name.capacity() + 1;
+        if (!mutation.data.empty())
+            bytes += entry_bytes_(mutation.data);
+        return bytes;
+    }
+
+    // caller holds the lock. serializes the entry once and hands the same
+    // pointer to every subscriber of the stream, nothing at all if there
+    // aren't any.
+    void publish_(const std::string &stream_name, long long id,
+                  long long arrival_ms, const FieldsStructure &data)
+    {
+        if (subscribers_.empty())
+            return;
+        auto found = subscribers_.find(stream_name);
+        if (found == subscribers_.end())
+            return;
+        auto entry = std::make_shared<publishedEntry>();
+        entry->stream_name = stream_name;
+        entry->id = id;
+        entry->arrival_ms = arrival_ms;
+        entry->fields = data;
+        resp_header(entry->resp, '*', 1);
+        resp_header(entry->resp, '*', 2);
+        resp_bulk(entry->resp, stream_name);
+        resp_header(entry->resp, '*', 1);
+        resp_entry(entry->resp, id, data);
+        PublishedEntryPointer shared = std::move(entry);
+        for (const auto &subscriber : found->second)
+        {
+            if (in_batch_())
+                batch_published_.emplace_back(subscriber, shared);
+            else
+                subscriber->push_(shared);
+        }
+        published_++;
+    }
+
+    // caller holds the lock and knows the stream isn't there. one that got
+    // dropped before picks up its ids where it left off.
+    StreamDataStructure::iterator create_stream_(const std::string &stream_name)
+    {
+        auto created = stream_data_.emplace(stream_name, streamState()).first;
+        auto dropped = dropped_next_ids_.find(stream_name);
+        if (dropped != dropped_next_ids_.end())
+        {
+            created->second.next_id = dropped->second;
+            dropped_next_ids_.erase(dropped);
+        }
+        auto pending = pending_indexes_.find(stream_name);
+        if (pending != pending_indexes_.end())
+        {
+            for (const auto &field : pending->second)
+                created->second.indexes[field];
+            pending_indexes_.erase(pending);
+        }
+        // a new stream counts as just read so it isn't the first thing evicted
+        if (keeps_lru_())
+            created->second.lru_at = lru_.insert(lru_.end(), &created->first);
+        return created;
+    }
+
+    bool keeps_lru_() const
+    {
+        return config_.max_memory && config_.eviction == EVICT_LRU_STREAMS;
+    }
+
+    // a read moves the stream to the back of the eviction order
+    void touch_(streamState &stream)
+    {
+        if (keeps_lru_())
+            lru_.splice(lru_.end(), lru_, stream.lru_at);
+    }
+
+    // puts the stream where it goes in oldest_ after anything that can change
+    // its first entry, or takes it out once it's empty. caller holds the lock.
+    void track_oldest_(const std::string &stream_name, streamState &stream)
+    {
+        if (!config_.max_memory || config_.eviction != EVICT_OLDEST_ENTRIES)
+            return;
+        long long ms = stream.size() ? first_arrival_ms_(stream) : LLONG_MIN;
+        if (ms == stream.oldest_ms)
+            return;
+        decltype(oldest_)::node_type node;
+        if (stream.oldest_ms != LLONG_MIN)
+            node = oldest_.extract({stream.oldest_ms, &stream_name});
+        stream.oldest_ms = ms;
+        if (ms == LLONG_MIN)
+            return;
+        if (node.empty())
+            oldest_.emplace(ms, &stream_data_.find(stream_name)->first);
+        else
+        {
+            node.value().first = ms;
+            oldest_.insert(std::move(node));
+        }
+    }
+
+    streamState &state_(const std::string &stream_name)
+    {
+        auto found = stream_data_.find(stream_name);
+        if (found == stream_data_.end())
+            found = create_stream_(stream_name);
+        return found->second;
+    }
+
+    // everything below here expects the caller to hold the lock
+
+    void add_block_(streamState &stream, size_t index,
+                    std::shared_ptr<sealedBlock> block)
+    {
+        stream.sealed_entries += block->live();
+        stream.block_bytes += block->bytes();
+        tombstones_ += block->deleted_count();
+        resident_bytes_ += block->bytes();
+        payload_bytes_ += block->payload_bytes();
+        stored_payload_bytes_ += block->stored_payload_bytes();
+        sealed_blocks_++;
+        resident_blocks_.push_back(block);
+        if (index == stream.blocks.size() && !stream.time_index_stale)
+        {
+            long long max_time = block->max_time();
+            if (!stream.block_max_time.empty())
+                max_time = std::max(max_time, stream.block_max_time.back());
+            stream.block_max_time.push_back(max_time);
+            stream.block_min_time.push_back(block->min_time());
+            for (size_t i = stream.block_min_time.size() - 1;
+                 i-- > 0 && stream.block_min_time[i] > block->min_time();)
+                stream.block_min_time[i] = block->min_time();
+        }
+        else
+            stream.time_index_stale = true;
+        stream.blocks.insert(stream.blocks.begin() + index, std::move(block));
+    }
+
+    // caller holds the lock. a few entries aren't worth the handoff, those
+    // go when garbage does at the end of this
+    void free_garbage_(streamGarbage garbage)
+    {
+        if (config_.lazyfree_entries && garbage.entries >= config_.lazyfree_entries)
+            lazy_free_.free(std::move(garbage));
+    }
+
+    // takes a block's share off the stream's and the engine's totals
+    void unaccount_block_(streamState &stream, sealedBlock &block)
+    {
+        stream.sealed_entries -= block.live();
+        stream.block_bytes -= block.bytes();
+        tombstones_ -= block.deleted_count();
+        payload_bytes_ -= block.payload_bytes();
+        stored_payload_bytes_ -= block.stored_payload_bytes();
+        if (block.resident())
+            resident_bytes_ -= block.bytes();
+        else
+        {
+            spilled_bytes_ -= block.bytes();
+            spilled_blocks_--;
+        }
+        sealed_blocks_--;
+        block.retire();
+    }
+
+    void remove_block_(streamState &stream, size_t index)
+    {
+        unaccount_block_(stream, *stream.blocks[index]);
+        stream.blocks.erase(stream.blocks.begin() + index);
+        stream.time_index_stale = true;
+    }
+
+    // blocks first..last-1 with one erase instead of shifting the rest down
+    // once per block, they go into garbage instead of being destroyed here
+    void remove_blocks_(streamState &stream, size_t first, size_t last,
+                        streamGarbage &garbage)
+    {
+        for (size_t i = first; i < last; ++i)
+        {
+            unaccount_block_(stream, *stream.blocks[i]);
+            garbage.entries += stream.blocks[i]->live();
+            garbage.blocks.push_back(std::move(stream.blocks[i]));
+        }
+        stream.blocks.erase(stream.blocks.begin() + first, stream.blocks.begin() + last);
+        stream.time_index_stale = true;
+    }
+
+    // the whole tail at once, its bytes are already added up in the stream
+    // so none of it has to be walked
+    void remove_tail_(streamState &stream, streamGarbage &garbage)
+    {
+        tail_bytes_ -= stream.tail_bytes;
+        stream.tail_bytes = 0;
+        garbage.entries += stream.tail.size();
+        garbage.tails.push_back(std::move(stream.tail));
+        stream.tail = tailEntries();
+        stream.tail_times.clear();
+    }
+
+    static void refresh_time_index_(streamState &stream)
+    {
+        if (!stream.time_index_stale)
+            return;
+        size_t n = stream.blocks.size();
+        stream.block_max_time.resize(n);
+        stream.block_min_time.resize(n);
+        for (size_t i = 0; i < n; ++i)
+            stream.block_max_time[i] = std::max(stream.blocks[i]->max_time(),
+                                                i ? stream.block_max_time[i - 1] : LLONG_MIN);
+        for (size_t i = n; i-- > 0;)
+            stream.block_min_time[i] = std::min(stream.blocks[i]->min_time(),
+                                                i + 1 < n ? stream.block_min_time[i + 1] : LLONG_MAX);
+        stream.time_index_stale = false;
+    }
+
+    // blocks are immutable so a delete or trim that only takes part of one
+    // writes a new block with whatever is left
+    void replace_block_(streamState &stream, size_t index,
+                        const VectorPairStructure &entries)
+    {
+        std::shared_ptr<sealedBlock> block;
+        if (!entries.empty())
+        {
+            const sealedBlock &old = *stream.blocks[index];
+            block = sealedBlock::build(entries.begin(), entries.end(),
+                                       [&old](long long id)
+                                       { return old.time_at(old.lower_bound(id)); },
+                                       compression_());
+        }
+        remove_block_(stream, index);
+        if (block)
+            add_block_(stream, index, std::move(block));
+    }
+
+    static long long tail_time_(const streamState &stream, long long id)
+    {
+        auto it = std::lower_bound(
+            stream.tail_times.begin(), stream.tail_times.end(), id,
+            [](const std::pair<long long, long long> &time, long long target)
+            { return time.first < target; });
+        return it != stream.tail_times.end() && it->first == id ? it->second : 0;
+    }
+
+    // keeps tail_times to the ids the tail can still have after entries came
+    // off either end of it
+    static void trim_tail_times_(streamState &stream)
+    {
+        auto &times = stream.tail_times;
+        if (stream.tail.empty())
+        {
+            times.clear();
+            return;
+        }
+        long long first = stream.tail.begin()->first;
+        times.erase(times.begin(),
+                    std::find_if(times.begin(), times.end(),
+                                 [first](const std::pair<long long, long long> &time)
+                                 { return time.first >= first; }));
+        long long last = std::prev(stream.tail.end())->first;
+        while (!times.empty() && times.back().first > last)
+            times.pop_back();
+    }
+
+    // roughly what an entry in the tail costs on the heap: the map node (a
+    // small tail is less, this errs on the safe side for max_memory), the
+    // vector of fields and every string too long for the small string buffer
+    static size_t entry_bytes_(const FieldsStructure &fields)
+    {
+        static const size_t small_string = std::string().capacity();
+        size_t bytes = sizeof(MapStructure::value_type) + 4 * sizeof(void *);
+        bytes += fields.capacity() * sizeof(FieldsStructure::value_type);
+        for (const auto &fv : fields)
+            for (const std::string *text : {&fv.first, &fv.second})
+                if (text->capacity() > small_string)
+                    bytes += text->capacity() + 1;
+        return bytes;
+    }
+
+    // everything that takes entries out of the tail goes through here so
+    // tail_bytes stays right
+    tailEntries::iterator erase_tail_(streamState &stream,
+                                      tailEntries::iterator first,
+                                      tailEntries::iterator last)
+    {
+        for (auto it = first; it != last; ++it)
+        {
+            size_t bytes = entry_bytes_(it->second);
+            stream.tail_bytes -= bytes;
+            tail_bytes_ -= bytes;
+        }
+        return stream.tail.erase(first, last);
+    }
+
+    // data is taken by value so xadd can move the caller's fields all the
+    // way into the tail, everyone else copies like before
+    void append_tail_(streamState &stream, long long id,
+                      FieldsStructure data, long long arrival_ms)
+    {
+        auto inserted = stream.tail.emplace(id, std::move(data));
+        if (!inserted.second)
+            return;
+        size_t bytes = entry_bytes_(inserted.first->second);
+        stream.tail_bytes += bytes;
+        tail_bytes_ += bytes;
+        if (stream.tail_times.empty() || stream.tail_times.back().first < id)
+            stream.tail_times.emplace_back(id, arrival_ms);
+        index_entry_(stream, id, inserted.first->second);
+        update_reply_cache_(stream, [this, id, &inserted](tailReplyCache &cache)
+                            { return cache.append(id, inserted.first->second,
+                                                  config_.reply_cache_entries); });
+        seal_tail_(stream);
+    }
+
+    // packs the older half of the tail into a block once it's grown to two
+    // blocks worth
+    void seal_tail_(streamState &stream)
+    {
+        size_t block_entries = config_.block_entries;
+        if (block_entries == 0)
+            return;
+        while (stream.tail.size() >= 2 * block_entries)
+        {
+            auto last = std::next(stream.tail.begin(), block_entries);
+            auto block = sealedBlock::build(stream.tail.begin(), last,
+                                            [&stream](long long id)
+                                            { return tail_time_(stream, id); },
+                                            compression_());
+            erase_tail_(stream, stream.tail.begin(), last);
+            trim_tail_times_(stream);
+            add_block_(stream, stream.blocks.size(), std::move(block));
+        }
+    }
+
+    // index of the block whose id range covers id, blocks.size() if none
+    size_t find_block_(const streamState &stream, long long id) const
+    {
+        auto it = std::lower_bound(
+            stream.blocks.begin(), stream.blocks.end(), id,
+            [](const std::shared_ptr<sealedBlock> &block, long long target)
+            { return block->last_id() < target; });
+        if (it == stream.blocks.end() || (*it)->first_id() > id)
+            return stream.blocks.size();
+        return static_cast<size_t>(it - stream.blocks.begin());
+    }
+
+    // what a posting list costs besides its ids, the hash node and the
+    // value it's filed under
+    static size_t posting_bytes_(const std::string &value)
+    {
+        static const size_t small_string = std::string().capacity();
+        return sizeof(FieldIndexStructure::value_type) + 2 * sizeof(void *) +
+               (value.size() > small_string ? value.size() + 1 : 0);
+    }
+
+    // everything in one field's index, for when all of it goes at once
+    static size_t index_bytes_of_(const FieldIndexStructure &index)
+    {
+        size_t bytes = 0;
+        for (const auto &posting : index)
+            bytes += posting_bytes_(posting.first) + posting.second.size() * sizeof(long long);
+        return bytes;
+    }
+
+    void index_entry_(streamState &stream, long long id,
+                      const FieldsStructure &fields)
+    {
+        if (stream.indexes.empty())
+            return;
+        for (const auto &fv : fields)
+        {
+            auto index = stream.indexes.find(fv.first);
+            if (index == stream.indexes.end())
+                continue;
+            auto &ids = index->second[fv.second];
+            if (ids.empty())
+                index_bytes_ += posting_bytes_(fv.second);
+            if (ids.empty() || ids.back() < id)
+                ids.push_back(id);
+            else
+            {
+                auto pos = std::lower_bound(ids.begin(), ids.end(), id);
+                if (pos != ids.end() && *pos == id)
+                    continue;
+                ids.insert(pos, id);
+            }
+            index_bytes_ += sizeof(long long);
+        }
+    }
+
+    void unindex_entry_(streamState &stream, long long id,
+                        const FieldsStructure &fields)
+    {
+        for (const auto &fv : fields)
+        {
+            auto index = stream.indexes.find(fv.first);
+            if (index == stream.indexes.end())
+                continue;
+            auto posting = index->second.find(fv.second);
+            if (posting == index->second.end())
+                continue;
+            auto &ids = posting->second;
+            auto pos = std::lower_bound(ids.begin(), ids.end(), id);
+            if (pos != ids.end() && *pos == id)
+            {
+                ids.erase(pos);
+                index_bytes_ -= sizeof(long long);
+            }
+            if (ids.empty())
+            {
+                index_bytes_ -= posting_bytes_(posting->first);
+                index->second.erase(posting);
+            }
+        }
+    }
+
+    // trims only ever take entries off the ends, so after one the indexes
+    // just drop whatever ids fell outside what's left
+    // lowest and highest id a stream can still have, false if it's empty.
+    // the ends of the blocks could be tombstones but everything outside
+    // these is gone for sure.
+    static bool id_bounds_(const streamState &stream, long long &first,
+                           long long &last)
+    {
+        if (stream.size() == 0)
+            return false;
+        first = stream.blocks.empty() ? stream.tail.begin()->first
+                                      : stream.blocks.front()->first_id();
+        last = stream.tail.empty() ? stream.blocks.back()->last_id()
+                                   : std::prev(stream.tail.end())->first;
+        return true;
+    }
+
+    void trim_indexes_(streamState &stream)
+    {
+        if (stream.indexes.empty())
+            return;
+        long long first = 0, last = 0;
+        bool empty = !id_bounds_(stream, first, last);
+        for (auto &index : stream.indexes)
+        {
+            for (auto it = index.second.begin(); it != index.second.end();)
+            {
+                auto &ids = it->second;
+                size_t before = ids.size();
+                if (!empty)
+                {
+                    ids.erase(std::upper_bound(ids.begin(), ids.end(), last), ids.end());
+                    ids.erase(ids.begin(), std::lower_bound(ids.begin(), ids.end(), first));
+                }
+                if (empty || ids.empty())
+                {
+                    index_bytes_ -= posting_bytes_(it->first) + before * sizeof(long long);
+                    it = index.second.erase(it);
+                }
+                else
+                {
+                    index_bytes_ -= (before - ids.size()) * sizeof(long long);
+                    ++it;
+                }
+            }
+        }
+    }
+
+    // every change to a stream's reply cache goes through here so the byte
+    // count stays right. change returns false when the cache can't be kept.
+    template <typename Change>
+    void update_reply_cache_(streamState &stream, Change change)
+    {
+        tailReplyCache *cache = stream.reply_cache.get();
+        if (!cache)
+            return;
+        reply_cache_bytes_ -= cache->bytes();
+        if (change(*cache))
+        {
+            reply_cache_bytes_ += cache->bytes();
+            return;
+        }
+        stream.reply_cache.reset();
+        reply_caches_--;
+    }
+
+    // after a trim only what's between the stream's ends stays cached
+    void trim_reply_cache_(streamState &stream)
+    {
+        update_reply_cache_(stream, [&stream](tailReplyCache &cache)
+                            {
+            long long first = 0, last = 0;
+            if (id_bounds_(stream, first, last))
+                cache.keep(first, last);
+            else
+                cache.keep(LLONG_MAX, LLONG_MIN);
+            return true; });
+    }
+
+    // RESP array of the entries from start_id to the end of the stream, at
+    // most count, appended to out. a slice of the reply cache when it has
+    // them, otherwise read from the stream, and if that was all of them
+    // and they fit, they become the cache from here on. that's always more
+    // than a cache that was there had since it started later.
+    void tail_reply_(streamState &stream, long long start_id,
+                     std::optional<long long> count, std::string &out)
+    {
+        size_t limit = count ? static_cast<size_t>(std::max(0LL, *count)) : SIZE_MAX;
+        if (stream.reply_cache && stream.reply_cache->reply(start_id, limit, out))
+        {
+            reply_cache_hits_++;
+            return;
+        }
+        reply_cache_misses_++;
+        VectorPairStructure entries;
+        collect_range_(stream, start_id, LLONG_MAX, count, entries);
+        resp_header(out, '*', static_cast<long long>(entries.size()));
+        size_t max_entries = config_.reply_cache_entries;
+        if (max_entries && entries.size() < limit && entries.size() <= max_entries)
+        {
+            update_reply_cache_(stream, [](tailReplyCache &)
+                                { return false; });
+            stream.reply_cache = std::make_unique<tailReplyCache>(start_id);
+            reply_caches_++;
+            update_reply_cache_(stream, [&entries, max_entries](tailReplyCache &cache)
+                                {
+                for (const auto &entry : entries)
+                    cache.append(entry.first, entry.second, max_entries);
+                return true; });
+        }
+        for (const auto &entry : entries)
+            resp_entry(out, entry.first, entry.second);
+    }
+
+    // looks up one entry by id. block is a cursor into the blocks so a run
+    // of increasing ids doesn't binary search from scratch every time.
+    bool fetch_entry_(const streamState &stream, long long id, size_t &block,
+                      FieldsStructure &out) const
+    {
+        while (block < stream.blocks.size() &&
+               stream.blocks[block]->last_id() < id)
+            block++;
+        if (block < stream.blocks.size() && stream.blocks[block]->first_id() <= id)
+        {
+            const sealedBlock &sealed = *stream.blocks[block];
+            size_t i = sealed.lower_bound(id);
+            if (i == sealed.size() || sealed.id_at(i) != id || sealed.deleted(i))
+                return false;
+            out = sealed.fields_at(i);
+            return true;
+        }
+        auto found = stream.tail.find(id);
+        if (found == stream.tail.end())
+            return false;
+        out = found->second;
+        return true;
+    }
+
+    workerPool &range_pool_get_() const
+    {
+        if (!range_pool_)
+        {
+            size_t threads = config_.range_threads;
+            if (threads == 0)
+                threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), 8);
+            range_pool_ = std::make_unique<workerPool>(threads - 1);
+        }
+        return *range_pool_;
+    }
+
+    // what a COUNT comes to, none is no limit and 0 or less is nothing
+    static size_t count_limit_(std::optional<long long> count)
+    {
+        return count ? static_cast<size_t>(std::max(0LL, *count)) : SIZE_MAX;
+    }
+
+    // appends entries with start_id <= id <= end_id to out, sealed blocks
+    // first and then the tail, stops at count
+    void collect_range_(const streamState &stream, long long start_id,
+                        long long end_id, std::optional<long long> count,
+                        VectorPairStructure &out) const
+    {
+        size_t limit = count_limit_(count);
+        auto first = std::lower_bound(
+            stream.blocks.begin(), stream.blocks.end(), start_id,
+            [](const std::shared_ptr<sealedBlock> &block, long long target)
+            { return block->last_id() < target; });
+        // the blocks the range needs, up to the one that gets it to count
+        auto last = first;
+        size_t expected = 0;
+        while (last != stream.blocks.end() && (*last)->first_id() <= end_id &&
+               expected < limit)
+            expected += (*last++)->live();
+        size_t blocks = last - first;
+        size_t start_at = blocks ? (*first)->lower_bound(start_id) : 0;
+        if (config_.parallel_range_entries > 0 && blocks > 1 &&
+            std::min(expected, limit) >= config_.parallel_range_entries &&
+            range_pool_get_().threads() > 1)
+        {
+            // contiguous runs of blocks, a few per thread so one slow
+            // (spilled or compressed) run doesn't hold up the rest. every
+            // block is decoded by exactly one task and the lock is held
+            // the whole time so tombstones can't change underneath.
+            workerPool &pool = range_pool_get_();
+            size_t tasks = std::min(blocks, pool.threads() * 4);
+            std::vector<VectorPairStructure> parts(tasks);
+            auto decode = [&](size_t task)
+            {
+                size_t from = blocks * task / tasks, to = blocks * (task + 1) / tasks;
+                for (size_t b = from; b < to; ++b)
+                {
+                    if (b + 1 < to)
+                        first[b + 1]->prefetch();
+                    size_t left = limit - std::min(limit, parts[task].size());
+                    if (!first[b]->append_range(b == 0 ? start_at : 0, end_id, left,
+                                                parts[task]))
+                        break;
+                }
+            };
+            pool.run(tasks, decode);
+            parallel_ranges_++;
+            size_t total = out.size();
+            for (const auto &part : parts)
+                total += part.size();
+            out.reserve(std::min(total, out.size() + limit));
+            for (auto &part : parts)
+            {
+                size_t take = std::min(limit, part.size());
+                std::move(part.begin(), part.begin() + take, std::back_inserter(out));
+                limit -= take;
+            }
+            // expected counted the whole first block, the entries before
+            // start_id in it might leave the run short of count
+            first = last;
+            start_at = 0;
+        }
+        for (auto it = first; it != stream.blocks.end() && limit > 0; ++it)
+        {
+            // get the disk going on the next block while this one decodes
+            if (!(*it)->resident() && std::next(it) != stream.blocks.end())
+                (*std::next(it))->prefetch();
+            size_t before = out.size();
+            bool more = (*it)->append_range(it == first ? start_at : 0, end_id,
+                                            limit, out);
+            limit -= out.size() - before;
+            if (!more)
+                return;
+        }
+        for (auto t = stream.tail.lower_bound(start_id);
+             t != stream.tail.end() && t->first <= end_id && limit > 0; ++t)
+        {
+            out.push_back(*t);
+            limit--;
+        }
+    }
+
+    // removes the ids that are there and returns those, ids that show up
+    // twice only count once. ids in sealed blocks just get tombstoned, a
+    // block goes away once nothing in it is left and gets handed to the
+    // compactor once enough of it is deleted.
+    std::vector<long long> erase_ids_(const std::string &stream_name,
+                                      streamState &stream,
+                                      const std::vector<long long> &ids)
+    {
+        std::vector<long long> erased;
+        for (auto id : ids)
+        {
+            auto found = stream.tail.find(id);
+            if (found != stream.tail.end())
+            {
+                unindex_entry_(stream, id, found->second);
+                erase_tail_(stream, found, std::next(found));
+                erased.push_back(id);
+                continue;
+            }
+            size_t index = find_block_(stream, id);
+            if (index == stream.blocks.size())
+                continue;
+            sealedBlock &block = *stream.blocks[index];
+            size_t i = block.lower_bound(id);
+            if (i == block.size() || block.id_at(i) != id || !block.erase(i))
+                continue;
+            if (!stream.indexes.empty())
+                unindex_entry_(stream, id, block.fields_at(i));
+            stream.sealed_entries--;
+            tombstones_++;
+            erased.push_back(id);
+            if (block.live() == 0)
+                remove_block_(stream, index);
+            else if (config_.compact_ratio > 0 &&
+                     block.deleted_count() ==
+                         std::max<size_t>(1, static_cast<size_t>(std::ceil(
+                                                 config_.compact_ratio * block.size()))))
+                queue_compaction_(stream_name, stream.blocks[index]);
+        }
+        update_reply_cache_(stream, [&erased](tailReplyCache &cache)
+                            {
+            for (auto id : erased)
+                cache.erase(id);
+            return true; });
+        if (!erased.empty())
+            track_oldest_(stream_name, stream);
+        return erased;
+    }
+
+    void queue_compaction_(const std::string &stream_name,
+                           const std::shared_ptr<sealedBlock> &block)
+    {
+        compaction_queue_.emplace_back(stream_name, block);
+        start_maintenance_();
+    }
+
+    void start_maintenance_()
+    {
+        if (!maintenance_.joinable())
+            maintenance_ = std::thread([this]
+                                       { maintenance_loop_(); });
+        maintenance_condition_.notify_one();
+    }
+
+    // rewrites queued blocks without their tombstones until the queue is
+    // empty or the deadline passes, true if it got through all of them.
+    // caller holds the lock.
+    bool compact_until_(std::chrono::steady_clock::time_point deadline)
+    {
+        while (!compaction_queue_.empty())
+        {
+            if (std::chrono::steady_clock::now() >= deadline)
+                return false;
+            auto queued = std::move(compaction_queue_.front());
+            compaction_queue_.pop_front();
+            auto block = queued.second.lock();
+            auto found = stream_data_.find(queued.first);
+            // trimmed, rewritten or deleted since it got queued
+            if (!block || block->retired() || found == stream_data_.end())
+                continue;
+            streamState &stream = found->second;
+            size_t index = find_block_(stream, block->first_id());
+            if (index == stream.blocks.size() || stream.blocks[index] != block)
+                continue;
+            replace_block_(stream, index, block->entries());
+            compacted_blocks_++;
+        }
+        return true;
+    }
+
+    // takes up to take of the oldest entries off a stream, only out of the
+    // first block or the tail when there are no blocks so one call stays
+    // cheap. returns how many went, followers get it as an XTRIM MINID of
+    // the last one.
+    size_t drop_oldest_(const std::string &stream_name, streamState &stream,
+                        size_t take)
+    {
+        size_t removed = 0;
+        long long last_removed = 0;
+        if (!stream.blocks.empty())
+        {
+            const sealedBlock &block = *stream.blocks.front();
+            removed = std::min(take, block.live());
+            if (removed == 0)
+                return 0;
+            if (removed == block.live())
+            {
+                last_removed = block.last_id();
+                remove_block_(stream, 0);
+            }
+            else
+            {
+                VectorPairStructure entries = block.entries();
+                last_removed = entries[removed - 1].first;
+                entries.erase(entries.begin(), entries.begin() + removed);
+                replace_block_(stream, 0, entries);
+            }
+        }
+        else
+        {
+            auto it = stream.tail.begin();
+            for (; it != stream.tail.end() && removed < take; ++it, ++removed)
+                last_removed = it->first;
+            if (!removed)
+                return 0;
+            erase_tail_(stream, stream.tail.begin(), it);
+            trim_tail_times_(stream);
+        }
+        trim_indexes_(stream);
+        trim_reply_cache_(stream);
+        track_oldest_(stream_name, stream);
+        if (backlog_limit_)
+        {
+            streamMutation mutation;
+            mutation.kind = MUTATION_XTRIM;
+            mutation.stream_name = stream_name;
+            mutation.strategy = MINID;
+            mutation.id = last_removed;
+            log_mutation_(std::move(mutation));
+        }
+        return removed;
+    }
+
+    // takes at most one block, or a block's worth of the tail, off the old
+    // end of a stream that's past its retention policy
+    size_t retention_step_(const std::string &stream_name, streamState &stream,
+                           long long now)
+    {
+        const retentionPolicy &policy = stream.retention;
+        size_t len_over = policy.max_len && stream.size() > policy.max_len
+                              ? stream.size() - policy.max_len
+                              : 0;
+        size_t bytes_over = policy.max_bytes && stream.bytes() > policy.max_bytes
+                                ? stream.bytes() - policy.max_bytes
+                                : 0;
+        long long cutoff = policy.max_age_ms ? now - policy.max_age_ms : LLONG_MIN;
+        size_t take = 0;
+        if (!stream.blocks.empty())
+        {
+            const sealedBlock &block = *stream.blocks.front();
+            // how much of the front of the block each limit wants gone,
+            // bytes go by the block's average entry size
+            size_t per_entry = std::max<size_t>(1, block.bytes() / block.size());
+            take = std::max(len_over, (bytes_over + per_entry - 1) / per_entry);
+            size_t aged = 0;
+            for (size_t i = 0; i < block.size() && block.time_at(i) < cutoff; ++i)
+                aged += !block.deleted(i);
+            take = std::max(take, aged);
+        }
+        else
+        {
+            size_t batch = config_.block_entries ? config_.block_entries : 1024;
+            size_t bytes_taken = 0;
+            for (auto it = stream.tail.begin();
+                 it != stream.tail.end() && take < batch &&
+                 (take < len_over || bytes_taken < bytes_over ||
+                  tail_time_(stream, it->first) < cutoff);
+                 ++it, ++take)
+                bytes_taken += entry_bytes_(it->second);
+        }
+        size_t removed = drop_oldest_(stream_name, stream, take);
+        maintenance_stats_.retention_trimmed += removed;
+        return removed;
+    }
+
+    size_t used_memory_() const
+    {
+        // a stream that's there costs its map node and state even empty
+        static const size_t per_stream =
+            sizeof(StreamDataStructure::value_type) + 4 * sizeof(void *);
+        return tail_bytes_ + resident_bytes_ + decompressed_.bytes() +
+               reply_cache_bytes_ + backlog_bytes_ + index_bytes_ +
+               stream_data_.size() * per_stream;
+    }
+
+    // arrival time of the oldest entry still in a stream that has any
+    long long first_arrival_ms_(const streamState &stream) const
+    {
+        if (stream.blocks.empty())
+            return tail_time_(stream, stream.tail.begin()->first);
+        const sealedBlock &block = *stream.blocks.front();
+        size_t i = 0;
+        while (block.deleted(i))
+            i++;
+        return block.time_at(i);
+    }
+
+    // everything in a stream goes into garbage and comes off the totals,
+    // the state itself too so it's left empty
+    void unhook_stream_(streamState &stream, streamGarbage &garbage)
+    {
+        remove_blocks_(stream, 0, stream.blocks.size(), garbage);
+        remove_tail_(stream, garbage);
+        update_reply_cache_(stream, [](tailReplyCache &)
+                            { return false; });
+        for (const auto &index : stream.indexes)
+            index_bytes_ -= index_bytes_of_(index.second);
+        garbage.streams.push_back(std::move(stream));
+        stream = streamState();
+    }
+
+    // takes a whole stream out. its id counter stays so ids never go back
+    // if something writes to it again. lazy leaves a big one to be freed
+    // in the background.
+    void drop_stream_(StreamDataStructure::iterator it, bool lazy = true)
+    {
+        dropped_next_ids_[it->first] = it->second.next_id;
+        if (it->second.oldest_ms != LLONG_MIN)
+            oldest_.erase({it->second.oldest_ms, &it->first});
+        if (keeps_lru_())
+            lru_.erase(it->second.lru_at);
+        streamGarbage garbage;
+        unhook_stream_(it->second, garbage);
+        retention_streams_.erase(it->first);
+        stream_data_.erase(it);
+        if (lazy)
+            free_garbage_(std::move(garbage));
+    }
+
+    // called before every xadd, true if it can go ahead. under the limit
+    // it's one comparison on running totals, past it the eviction policy
+    // frees things up a block or a stream at a time until it fits again.
+    bool make_room_(const std::string &stream_name)
+    {
+        if (!config_.max_memory || read_only_ || used_memory_() <= config_.max_memory)
+            return true;
+        size_t batch = config_.block_entries ? config_.block_entries : 1024;
+        while (used_memory_() > config_.max_memory)
+        {
+            if (config_.eviction == EVICT_OLDEST_ENTRIES)
+            {
+                if (oldest_.empty())
+                    break;
+                auto oldest = stream_data_.find(*oldest_.begin()->second);
+                size_t removed = drop_oldest_(oldest->first, oldest->second, batch);
+                if (!removed)
+                    break;
+                evicted_entries_ += removed;
+            }
+            else if (config_.eviction == EVICT_LRU_STREAMS)
+            {
+                // never the one being written to, so at most the second one
+                auto victim = stream_data_.end();
+                for (const std::string *name : lru_)
+                    if (*name != stream_name)
+                    {
+                        victim = stream_data_.find(*name);
+                        break;
+                    }
+                if (victim == stream_data_.end())
+                    break;
+                evicted_entries_ += victim->second.size();
+                evicted_streams_++;
+                if (backlog_limit_)
+                {
+                    streamMutation mutation;
+                    mutation.kind = MUTATION_DEL;
+                    mutation.stream_name = victim->first;
+                    log_mutation_(std::move(mutation));
+                }
+                drop_stream_(victim);
+            }
+            else
+                break;
+        }
+        if (used_memory_() <= config_.max_memory)
+            return true;
+        rejected_writes_++;
+        return false;
+    }
+
+    // goes round the streams with a retention policy from where the last
+    // call stopped, true once every one of them is within its limits.
+    // followers leave it to the leader, its trims come through replication.
+    bool retention_until_(std::chrono::steady_clock::time_point deadline)
+    {
+        if (read_only_ || retention_streams_.empty())
+            return true;
+        long long now = now_ms_();
+        auto it = retention_streams_.lower_bound(retention_cursor_);
+        for (size_t visited = 0; visited < retention_streams_.size(); ++visited, ++it)
+        {
+            if (it == retention_streams_.end())
+                it = retention_streams_.begin();
+            auto found = stream_data_.find(*it);
+            if (found == stream_data_.end())
+                continue;
+            while (retention_step_(*it, found->second, now))
+            {
+                if (std::chrono::steady_clock::now() >= deadline)
+                {
+                    retention_cursor_ = *it;
+                    return false;
+                }
+            }
+        }
+        retention_cursor_.clear();
+        return true;
+    }
+
+    // one slice with the lock at a time and then as long without it while
+    // there's work left, so a pile of deletes or a stream that's way over
+    // its retention never holds up writers for more than about a slice
+    void maintenance_loop_()
+    {
+        auto slice = std::chrono::microseconds(config_.maintenance_slice_us);
+        auto interval = std::chrono::milliseconds(config_.maintenance_interval_ms);
+        auto wake = [this]
+        { return stopping_ || !compaction_queue_.empty(); };
+        std::unique_lock<std::mutex> lock(mutex_);
+        bool more = false;
+        while (true)
+        {
+            if (!more && retention_streams_.empty())
+                maintenance_condition_.wait(lock, wake);
+            else if (!more)
+                maintenance_condition_.wait_for(lock, interval, wake);
+            if (stopping_)
+                return;
+            auto start = std::chrono::steady_clock::now();
+            bool compacted = compact_until_(start + slice);
+            bool retained = retention_until_(start + slice);
+            more = !compacted || !retained;
+            long long took = std::chrono::duration_cast<std::chrono::microseconds>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+            maintenance_stats_.cycles++;
+            maintenance_stats_.last_cycle_us = took;
+            maintenance_stats_.max_cycle_us = std::max(maintenance_stats_.max_cycle_us, took);
+            maintenance_stats_.total_us += took;
+            lock.unlock();
+            // rewritten blocks start out resident
+            spill_cold_blocks_();
+            if (more)
+                std::this_thread::sleep_for(slice);
+            lock.lock();
+        }
+    }
+
+    // walks one stream from some id on, blocks and then the tail, skipping
+    // tombstones. only good while the lock is held.
+    struct streamCursor
+    {
+        const streamState *stream;
+        size_t block = 0;
+        size_t i = 0;
+        tailEntries::iterator tail;
+
+        streamCursor(const streamState &state, long long start_id) : stream(&state)
+        {
+            auto it = std::lower_bound(
+                stream->blocks.begin(), stream->blocks.end(), start_id,
+                [](const std::shared_ptr<sealedBlock> &b, long long target)
+                { return b->last_id() < target; });
+            block = static_cast<size_t>(it - stream->blocks.begin());
+            if (block < stream->blocks.size())
+                i = stream->blocks[block]->lower_bound(start_id);
+            tail = stream->tail.lower_bound(start_id);
+            skip_deleted();
+        }
+
+        bool in_blocks() const { return block < stream->blocks.size(); }
+        bool done() const { return !in_blocks() && tail == stream->tail.end(); }
+        long long id() const
+        {
+            return in_blocks() ? stream->blocks[block]->id_at(i) : tail->first;
+        }
+        long long arrival_ms() const
+        {
+            return in_blocks() ? stream->blocks[block]->time_at(i)
+                               : tail_time_(*stream, tail->first);
+        }
+        FieldsStructure fields() const
+        {
+            return in_blocks() ? stream->blocks[block]->fields_at(i) : tail->second;
+        }
+
+        void next()
+        {
+            if (in_blocks())
+                i++;
+            else
+                ++tail;
+            skip_deleted();
+        }
+
+        void skip_deleted()
+        {
+            while (in_blocks())
+            {
+                const sealedBlock &b = *stream->blocks[block];
+                while (i < b.size() && b.deleted(i))
+                    i++;
+                if (i < b.size())
+                    return;
+                block++;
+                i = 0;
+            }
+        }
+    };
+
+    // k-way merge of the streams from their start ids on with a min heap of
+    // one cursor per stream, stops at count
+    std::vector<mergedEntry> merge_streams_(const std::vector<std::string> &stream_names,
+                                            const std::vector<long long> &start_ids,
+                                            mergeOrder order, size_t count)
+    {
+        std::vector<mergedEntry> result;
+        std::vector<streamCursor> cursors;
+        std::vector<const std::string *> names;
+        for (size_t s = 0; s < stream_names.size() && s < start_ids.size(); ++s)
+        {
+            auto found = stream_data_.find(stream_names[s]);
+            if (found == stream_data_.end())
+                continue;
+            touch_(found->second);
+            cursors.emplace_back(found->second, start_ids[s]);
+            names.push_back(&found->first);
+        }
+        // (time or 0, id, cursor), the cursor index breaks ties
+        using headEntry = std::tuple<long long, long long, size_t>;
+        std::priority_queue<headEntry, std::vector<headEntry>, std::greater<headEntry>> heap;
+        auto push = [&](size_t c)
+        {
+            if (!cursors[c].done())
+                heap.emplace(order == MERGE_BY_TIME ? cursors[c].arrival_ms() : 0,
+                             cursors[c].id(), c);
+        };
+        for (size_t c = 0; c < cursors.size(); ++c)
+            push(c);
+        while (!heap.empty() && result.size() < count)
+        {
+            size_t c = std::get<2>(heap.top());
+            heap.pop();
+            streamCursor &cursor = cursors[c];
+            result.push_back({*names[c], cursor.id(), cursor.arrival_ms(), cursor.fields()});
+            cursor.next();
+            push(c);
+        }
+        return result;
+    }
+
+    ResultStructure get_results_(std::unique_lock<std::mutex> &lock,
+                                 const std::vector<std::string> &stream_names,
+                                 const std::vector<long long> &last_ids,
+                                 std::optional<long long> count = std::nullopt)
+    {
+        (void)lock; // only here so you can't call this without holding it
+        ResultStructure result;
+        auto it_sns = stream_names.begin();
+        auto it_ids = last_ids.begin();
+        for (; it_sns != stream_names.end() && it_ids != last_ids.end();
+             it_sns++, it_ids++)
+        {
+            const std::string &stream_name = *it_sns;
+            long long start_id = *it_ids;
+            auto found = stream_data_.find(stream_name);
+            if (found != stream_data_.end())
+            {
+                touch_(found->second);
+                // stop at count
+                collect_range_(found->second, start_id, LLONG_MAX, count,
+                               result[stream_name]);
+            }
+        }
+        return result;
+    }
+    // helper function to trim entries from the stream, caller holds the lock.
+    // MAXLEN drops the newest `threshold` entries once the stream is longer
+    // than the threshold and MINID evicts every id up to and including it.
+    // whole blocks and a whole tail go into garbage, only the one block cut
+    // in half and a partly trimmed tail get freed on the spot.
+    size_t trim_entries_(streamState &stream,
+                         long long threshold,
+                         bool is_maxlen,
+                         streamGarbage &garbage)
+    {
+        size_t count = 0;
+        if (is_maxlen)
+        {
+            // newest entries are in the tail, then the blocks from the back
+            size_t limit = threshold > 0 ? static_cast<size_t>(threshold) : 0;
+            if (limit >= stream.tail.size())
+            {
+                count = stream.tail.size();
+                remove_tail_(stream, garbage);
+            }
+            while (!stream.tail.empty() && count < limit)
+            {
+                erase_tail_(stream, std::prev(stream.tail.end()), stream.tail.end());
+                count++;
+            }
+            trim_tail_times_(stream);
+            size_t from = stream.blocks.size();
+            while (from > 0 && count < limit && count + stream.blocks[from - 1]->live() <= limit)
+                count += stream.blocks[--from]->live();
+            remove_blocks_(stream, from, stream.blocks.size(), garbage);
+            if (!stream.blocks.empty() && count < limit)
+            {
+                size_t last = stream.blocks.size() - 1;
+                VectorPairStructure entries = stream.blocks[last]->entries();
+                entries.resize(entries.size() - (limit - count));
+                replace_block_(stream, last, entries);
+                count = limit;
+            }
+            return count;
+        }
+        // this used to walk back from the end after the first erase and
+        // would take out the newest entries too, the stress test caught it
+        size_t whole = 0;
+        while (whole < stream.blocks.size() &&
+               stream.blocks[whole]->last_id() <= threshold)
+            count += stream.blocks[whole++]->live();
+        remove_blocks_(stream, 0, whole, garbage);
+        if (!stream.blocks.empty() &&
+            stream.blocks.front()->first_id() <= threshold)
+        {
+            const sealedBlock &block = *stream.blocks.front();
+            size_t cut = block.live_before(block.lower_bound(threshold + 1));
+            VectorPairStructure entries = block.entries();
+            entries.erase(entries.begin(), entries.begin() + cut);
+            count += cut;
+            replace_block_(stream, 0, entries);
+        }
+        if (!stream.tail.empty() && std::prev(stream.tail.end())->first <= threshold)
+        {
+            count += stream.tail.size();
+            remove_tail_(stream, garbage);
+            return count;
+        }
+        auto it_end = stream.tail.upper_bound(threshold);
+        count += std::distance(stream.tail.begin(), it_end);
+        erase_tail_(stream, stream.tail.begin(), it_end);
+        trim_tail_times_(stream);
+        return count;
+    }
+
+    // writes the oldest resident blocks out to segment files until sealed
+    // blocks fit in the memory budget again. called without the lock, blocks
+    // never change once sealed so the slow part (the file write) happens
+    // outside it and only the switch over to the mapping takes the lock.
+    void spill_cold_blocks_()
+    {
+        // the lock isn't ours to let go of in a batch, batch() spills at the
+        // end. config_ doesn't change so without a budget there's no need
+        // to take the lock just to find that out.
+        if (in_batch_() || config_.memory_budget == 0)
+            return;
+        std::vector<std::shared_ptr<sealedBlock>> victims;
+        {
+            auto lock = lock_();
+            while (resident_bytes_ > spilling_bytes_ + config_.memory_budget &&
+                   !resident_blocks_.empty())
+            {
+                auto block = resident_blocks_.front().lock();
+                resident_blocks_.pop_front();
+                if (!block || block->retired() || !block->resident())
+                    continue;
+                spilling_bytes_ += block->bytes();
+                victims.push_back(std::move(block));
+            }
+        }
+        if (victims.empty())
+            return;
+        std::vector<std::shared_ptr<segmentMapping>> segments;
+        for (const auto &block : victims)
+            segments.push_back(segmentMapping::write(config_.segment_dir,
+                                                     block->data(),
+                                                     block->bytes()));
+        auto lock = lock_();
+        for (size_t i = 0; i < victims.size(); ++i)
+        {
+            sealedBlock &block = *victims[i];
+            spilling_bytes_ -= block.bytes();
+            // a failed write just leaves the block in memory, it doesn't go
+            // back in the queue so a full disk doesn't turn into a retry loop
+            if (!segments[i] || block.retired())
+                continue;
+            resident_bytes_ -= block.bytes();
+            spilled_bytes_ += block.bytes();
+            spilled_blocks_++;
+            block.install(std::move(segments[i]));
+        }
+    }
+
+    size_t xtrim_locked_(const std::string &stream_name,
+                         trimmingStrategy strategy,
+                         long long threshold)
+    {
+        auto found = stream_data_.find(stream_name);
+        if (found == stream_data_.end())
+            return 0;
+        size_t trimmed = 0;
+        streamGarbage garbage;
+        if (strategy == MAXLEN)
+        {
+            // trims latest 1000 which means maybe the last iterator
+            // order is preserved for maps by keys, it's sorted and the
+            // higher the id number the more recent it is.
+
+            // only trim when the length exceeds the threshold
+            if (static_cast<long long>(found->second.size()) > threshold)
+            {
+                trimmed = trim_entries_(found->second, threshold, true, garbage);
+            }
+        }
+        else if (strategy == MINID)
+        {
+            // trims where upper bound is min id and evicts any ids where they
+            // lower than the min id
+            // threshold would be acting as id to start from
+            trimmed = trim_entries_(found->second, threshold, false, garbage);
+        }
+        if (trimmed)
+        {
+            trim_indexes_(found->second);
+            trim_reply_cache_(found->second);
+            track_oldest_(found->first, found->second);
+        }
+        free_garbage_(std::move(garbage));
+        return trimmed;
+    }
+
+public:
+    explicit redisStream(streamConfig config = streamConfig())
+        : config_(std::move(config))
+    {
+        decompressed_.set_capacity(config_.decompressed_blocks);
+    }
+    ~redisStream()
+    {
+        {
+            auto lock = lock_();
+            stopping_ = true;
+            maintenance_condition_.notify_all();
+            for (const auto &stream : subscribers_)
+                for (const auto &subscriber : stream.second)
+                    subscriber->close_();
+        }
+        if (maintenance_.joinable())
+            maintenance_.join();
+    }
+
+    // Not exactly xadd verbatim, I decided not to allow users to specify as an
+    // argument, xadd will always generate one for you. also no other args added
+    // like what's expected for Redis' actual xadd.
+    // returns -1 instead of an id when max_memory is used up and the
+    // eviction policy couldn't (or isn't allowed to) free anything.
+    long long xadd(const std::string &stream_name,
+                   const FieldsStructure &data)
+    {
+        return xadd(stream_name, FieldsStructure(data));
+    }
+
+    // same but the fields move in, the strings the caller built end up in
+    // the stream without being copied. the only allocation left per entry is
+    // the tail's map node, or nothing while the tail is still small (plus the
+    // copy for the replication backlog if it's on).
+    long long xadd(const std::string &stream_name, FieldsStructure &&data)
+    {
+        long long id;
+        {
+            auto lock = lock_();
+            if (!make_room_(stream_name))
+                return -1;
+            long long arrival_ms = now_ms_();
+            auto found = stream_data_.find(stream_name);
+            if (found == stream_data_.end())
+                found = create_stream_(stream_name);
+            id = found->second.next_id++;
+            // the copy for followers has to happen before the move, the
+            // entry could be sealed into a block by the time append returns
+            FieldsStructure logged;
+            if (backlog_limit_)
+                logged = data;
+            publish_(stream_name, id, arrival_ms, data);
+            append_tail_(found->second, id, std::move(data), arrival_ms);
+            found->second.last_id = id;
+            if (found->second.oldest_ms == LLONG_MIN)
+                track_oldest_(found->first, found->second);
+            if (backlog_limit_)
+            {
+                streamMutation mutation;
+                // followers keep the leader's arrival time
+                mutation.logged_ms = arrival_ms;
+                mutation.kind = MUTATION_XADD;
+                mutation.stream_name = stream_name;
+                mutation.id = id;
+                mutation.data = std::move(logged);
+                log_mutation_(std::move(mutation));
+            }
+            wake_readers_();
+        }
+        spill_cold_blocks_();
+        return id;
+    }
+
+    // runs body with the lock taken once for all of it, anything body calls
+    // on this engine from this thread goes through without locking again.
+    // other threads see all of it or none of it, blocked readers get woken
+    // and subscribers get their entries once at the end. there's only the
+    // one lock so there's no order to get wrong between streams. a batch
+    // inside a batch is just part of the outer one.
+    void batch(const std::function<void()> &body)
+    {
+        if (in_batch_())
+        {
+            body();
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            // ends the batch even when body throws, whatever it got done
+            // before that is in the streams so readers still hear about it.
+            // runs before lock lets go of mutex_.
+            struct batchEnd
+            {
+                redisStream &engine;
+                ~batchEnd()
+                {
+                    engine.batch_thread_ = std::thread::id();
+                    for (const auto &pushed : engine.batch_published_)
+                        pushed.first->push_(pushed.second);
+                    engine.batch_published_.clear();
+                    if (engine.batch_added_)
+                        engine.new_data_condition_.notify_all();
+                    engine.batch_added_ = false;
+                }
+            } end{*this};
+            batch_thread_ = std::this_thread::get_id();
+            body();
+        }
+        spill_cold_blocks_();
+    }
+
+    // new entries of these streams get pushed to the subscription from now
+    // on, at most max_queued of them waiting at once
+    std::shared_ptr<streamSubscription> subscribe(const std::vector<std::string> &stream_names,
+                                                  size_t max_queued = 1024)
+    {
+        auto subscription = std::make_shared<streamSubscription>(stream_names, max_queued);
+        auto lock = lock_();
+        std::set<std::string> unique(stream_names.begin(), stream_names.end());
+        for (const auto &name : unique)
+            subscribers_[name].push_back(subscription);
+        subscriptions_++;
+        return subscription;
+    }
+
+    // stops anything more being queued, what's already queued can still be
+    // popped
+    void unsubscribe(const std::shared_ptr<streamSubscription> &subscription)
+    {
+        auto lock = lock_();
+        if (subscription->closed())
+            return;
+        for (const auto &name : subscription->stream_names())
+        {
+            auto found = subscribers_.find(name);
+            if (found == subscribers_.end())
+                continue;
+            auto &list = found->second;
+            list.erase(std::remove(list.begin(), list.end(), subscription), list.end());
+            if (list.empty())
+                subscribers_.erase(found);
+        }
+        subscription->close_();
+        subscriptions_--;
+    }
+
+    pubsubStats pubsub_stats()
+    {
+        auto lock = lock_();
+        pubsubStats stats;
+        stats.subscriptions = subscriptions_;
+        stats.published = published_;
+        return stats;
+    }
+
+    replyCacheStats reply_cache_stats()
+    {
+        auto lock = lock_();
+        replyCacheStats stats;
+        stats.hits = reply_cache_hits_;
+        stats.misses = reply_cache_misses_;
+        stats.streams = reply_caches_;
+        stats.bytes = reply_cache_bytes_;
+        return stats;
+    }
+
+    // XRANGE key start_id + [COUNT count] straight to a RESP reply appended
+    // to out, for readers polling the newest entries. see tail_reply_.
+    void xrange_resp(const std::string &stream_name, long long start_id,
+                     std::optional<long long> count, std::string &out)
+    {
+        auto lock = lock_();
+        auto found = stream_data_.find(stream_name);
+        if (found == stream_data_.end())
+        {
+            resp_header(out, '*', 0);
+            return;
+        }
+        touch_(found->second);
+        tail_reply_(found->second, start_id, count, out);
+    }
+
+    // XREAD the same way, the reply xread would give as RESP. false and out
+    // left alone when it'd have to block (none of the streams are there) or
+    // a stream is named twice, xread handles those.
+    bool xread_resp(const std::vector<std::string> &stream_names,
+                    const std::vector<long long> &last_ids,
+                    std::optional<long long> block_time,
+                    std::optional<long long> count, std::string &out)
+    {
+        auto lock = lock_();
+        // xread's result is a map so streams come back sorted by name
+        std::map<std::string, std::pair<streamState *, long long>> found;
+        for (size_t s = 0; s < stream_names.size() && s < last_ids.size(); ++s)
+        {
+            auto it = stream_data_.find(stream_names[s]);
+            if (it == stream_data_.end())
+                continue;
+            if (!found.emplace(it->first, std::make_pair(&it->second, last_ids[s])).second)
+                return false;
+        }
+        if (found.empty() && block_time)
+            return false;
+        resp_header(out, '*', static_cast<long long>(found.size()));
+        for (auto &stream : found)
+        {
+            touch_(*stream.second.first);
+            resp_header(out, '*', 2);
+            resp_bulk(out, stream.first);
+            tail_reply_(*stream.second.first, stream.second.second, count, out);
+        }
+        return true;
+    }
+
+    ResultStructure xread(
+        const std::vector<std::string> &stream_names,
+        const std::vector<long long> &last_ids,
+        std::optional<long long> block_time = std::nullopt,
+        std::optional<long long> count = std::nullopt)
+    {
+
+        ResultStructure result;
+        auto lock = lock_();
+
+        result = get_results_(lock, stream_names, last_ids, count);
+
+        // nothing can show up while this thread is in a batch, so like
+        // Redis a blocking read in MULTI just doesn't block
+        if (block_time && !in_batch_())
+        {
+            // if result is empty wait, else return result
+            // this is going to be hard to test I might run out of time
+            if (result.empty())
+            {
+                new_data_condition_.wait_for(
+                    lock, std::chrono::milliseconds(*block_time),
+                    [this, &lock, &stream_names, &last_ids, &count, &result]
+                    {
+                        result = get_results_(lock,
+                                              stream_names,
+                                              last_ids,
+                                              count);
+                        // notify
+                        return !result.empty();
+                    });
+            }
+        }
+        // implement block later if I have time.
+        return result;
+    }
+
+    // XMERGE, the next count entries across all the streams in global order
+    // starting at each stream's id (inclusive like xread). with block_time
+    // it waits for something to show up if there's nothing yet.
+    std::vector<mergedEntry> xmerge(const std::vector<std::string> &stream_names,
+                                    const std::vector<long long> &start_ids,
+                                    size_t count,
+                                    mergeOrder order = MERGE_BY_ID,
+                                    std::optional<long long> block_time = std::nullopt)
+    {
+        auto lock = lock_();
+        auto result = merge_streams_(stream_names, start_ids, order, count);
+        if (result.empty() && block_time && !in_batch_())
+        {
+            new_data_condition_.wait_for(
+                lock, std::chrono::milliseconds(*block_time), [&]
+                {
+                    result = merge_streams_(stream_names, start_ids, order, count);
+                    return !result.empty(); });
+        }
+        return result;
+    }
+
+    VectorPairStructure xrange(const std::string &stream_name,
+                               long long start_id = LLONG_MIN,
+                               long long end_id = LLONG_MAX,
+                               std::optional<long long> count = std::nullopt)
+    {
+
+        VectorPairStructure result;
+        auto lock = lock_();
+
+        // I meant to implement the special id symbol $ where you can use
+        // that to get the most recently added message id.
+        // However, I'm not sure I'm going to have enough time to do that
+        // yet.
+
+        auto found = stream_data_.find(stream_name);
+        if (found != stream_data_.end())
+        {
+            touch_(found->second);
+            // stop at count is also optional
+            collect_range_(found->second, start_id, end_id, count, result);
+        }
+        return result;
+    }
+
+    // XRANGE ... BYTIME, entries that arrived between start_ms and end_ms
+    // (inclusive, ms since the epoch) in id order. the time index finds the
+    // first block that can have any in O(log blocks) and the scan stops at
+    // the first block where nothing after it arrived early enough, blocks
+    // in between that can't match get skipped on their min/max.
+    VectorPairStructure xrange_bytime(const std::string &stream_name,
+                                      long long start_ms,
+                                      long long end_ms,
+                                      std::optional<long long> count = std::nullopt)
+    {
+        VectorPairStructure result;
+        auto lock = lock_();
+        auto found = stream_data_.find(stream_name);
+        if (found == stream_data_.end() || start_ms > end_ms)
+            return result;
+        streamState &stream = found->second;
+        touch_(stream);
+        size_t limit = count_limit_(count);
+        if (limit == 0)
+            return result;
+        auto full = [&result, limit]
+        { return result.size() >= limit; };
+        refresh_time_index_(stream);
+        size_t b = std::lower_bound(stream.block_max_time.begin(),
+                                    stream.block_max_time.end(), start_ms) -
+                   stream.block_max_time.begin();
+        for (; b < stream.blocks.size() && stream.block_min_time[b] <= end_ms; ++b)
+        {
+            const sealedBlock &block = *stream.blocks[b];
+            if (block.max_time() < start_ms || block.min_time() > end_ms)
+                continue;
+            for (size_t i = 0; i < block.size(); ++i)
+            {
+                long long time = block.time_at(i);
+                if (time < start_ms || time > end_ms || block.deleted(i))
+                    continue;
+                result.emplace_back(block.id_at(i), block.fields_at(i));
+                if (full())
+                    return result;
+            }
+        }
+        for (const auto &time : stream.tail_times)
+        {
+            if (time.second < start_ms || time.second > end_ms)
+                continue;
+            // deletes from the middle of the tail leave their time behind
+            auto entry = stream.tail.find(time.first);
+            if (entry == stream.tail.end())
+                continue;
+            result.emplace_back(entry->first, entry->second);
+            if (full())
+                break;
+        }
+        return result;
+    }
+
+    // XRANGE ... WHERE field value, only entries where field is set to
+    // value. uses the index on field if there is one and otherwise scans.
+    VectorPairStructure xrange_where(const std::string &stream_name,
+                                     long long start_id,
+                                     long long end_id,
+                                     const std::string &field,
+                                     const std::string &value,
+                                     std::optional<long long> count = std::nullopt)
+    {
+        VectorPairStructure result;
+        auto lock = lock_();
+        auto found = stream_data_.find(stream_name);
+        if (found == stream_data_.end())
+            return result;
+        touch_(found->second);
+        const streamState &stream = found->second;
+        size_t limit = count_limit_(count);
+        if (limit == 0)
+            return result;
+        auto full = [&result, limit]
+        { return result.size() >= limit; };
+
+        auto index = stream.indexes.find(field);
+        if (index != stream.indexes.end())
+        {
+            auto posting = index->second.find(value);
+            if (posting == index->second.end())
+                return result;
+            const auto &ids = posting->second;
+            size_t block = 0;
+            FieldsStructure fields;
+            for (auto it = std::lower_bound(ids.begin(), ids.end(), start_id);
+                 it != ids.end() && *it <= end_id; ++it)
+            {
+                if (!fetch_entry_(stream, *it, block, fields))
+                    continue;
+                result.emplace_back(*it, std::move(fields));
+                if (full())
+                    break;
+            }
+            return result;
+        }
+
+        // no index, scan but only copy out the matches
+        auto matches = [&field, &value](const FieldsStructure &fields)
+        {
+            for (const auto &fv : fields)
+                if (fv.first == field && fv.second == value)
+                    return true;
+            return false;
+        };
+        for (const auto &block : stream.blocks)
+        {
+            if (block->last_id() < start_id)
+                continue;
+            if (block->first_id() > end_id)
+                return result;
+            for (size_t i = block->lower_bound(start_id); i < block->size(); ++i)
+            {
+                long long id = block->id_at(i);
+                if (id > end_id)
+                    return result;
+                if (block->deleted(i) || !block->has_field_value(i, field, value))
+                    continue;
+                result.emplace_back(id, block->fields_at(i));
+                if (full())
+                    return result;
+            }
+        }
+        for (auto t = stream.tail.lower_bound(start_id);
+             t != stream.tail.end() && t->first <= end_id; ++t)
+        {
+            if (!matches(t->second))
+                continue;
+            result.push_back(*t);
+            if (full())
+                break;
+        }
+        return result;
+    }
+
+    // XAGG, count/sum/min/max of a numeric field over the entries in
+    // [start_id, end_id]. with bucket_ms it's one result per bucket of
+    // arrival time that has entries, oldest first, otherwise just one.
+    // sealed blocks aggregate straight off their columns, values that aren't
+    // numbers are skipped.
+    std::vector<aggregateBucket> xagg(const std::string &stream_name,
+                                      long long start_id,
+                                      long long end_id,
+                                      const std::string &field,
+                                      std::optional<long long> bucket_ms = std::nullopt)
+    {
+        std::map<long long, aggregateBucket> buckets;
+        auto bucket_of = [&bucket_ms](long long ms)
+        {
+            if (!bucket_ms || *bucket_ms <= 0)
+                return 0LL;
+            long long rem = ms % *bucket_ms;
+            return ms - (rem < 0 ? rem + *bucket_ms : rem);
+        };
+        if (!bucket_ms)
+            buckets[0];
+        auto lock = lock_();
+        auto found = stream_data_.find(stream_name);
+        if (found != stream_data_.end())
+        {
+            touch_(found->second);
+            const streamState &stream = found->second;
+            for (const auto &block : stream.blocks)
+            {
+                if (block->last_id() < start_id)
+                    continue;
+                if (block->first_id() > end_id)
+                    break;
+                size_t from = block->lower_bound(start_id);
+                size_t to = block->lower_bound(end_id);
+                if (to < block->size() && block->id_at(to) == end_id)
+                    to++;
+                // runs of entries that land in the same bucket go to the
+                // kernel in one go, without buckets that's the whole range
+                while (from < to)
+                {
+                    long long bucket = bucket_of(block->time_at(from));
+                    size_t run = from + 1;
+                    if (!bucket_ms)
+                        run = to;
+                    while (run < to && bucket_of(block->time_at(run)) == bucket)
+                        run++;
+                    aggregateBucket part;
+                    block->aggregate(field, from, run, part);
+                    if (part.count)
+                        buckets[bucket].merge(part);
+                    from = run;
+                }
+            }
+            for (auto t = stream.tail.lower_bound(start_id);
+                 t != stream.tail.end() && t->first <= end_id; ++t)
+            {
+                for (const auto &fv : t->second)
+                {
+                    double number;
+                    if (fv.first != field || !sealedBlock::parse_number(fv.second, number))
+                        continue;
+                    buckets[bucket_of(tail_time_(stream, t->first))].add(number);
+                    break;
+                }
+            }
+        }
+        std::vector<aggregateBucket> result;
+        for (auto &bucket : buckets)
+        {
+            bucket.second.start_ms = bucket.first;
+            result.push_back(bucket.second);
+        }
+        return result;
+    }
+
+    // secondary index on one field of a stream, kept up to date by xadd,
+    // xdel and xtrim from then on. returns false if it was already there.
+    // a stream that isn't there yet gets it once something makes it.
+    bool create_index(const std::string &stream_name, const std::string &field)
+    {
+        auto lock = lock_();
+        auto found = stream_data_.find(stream_name);
+        if (found == stream_data_.end())
+            return pending_indexes_[stream_name].insert(field).second;
+        streamState &stream = found->second;
+        if (stream.indexes.count(field))
+            return false;
+        stream.indexes[field];
+        for (const auto &block : stream.blocks)
+            for (size_t i = 0; i < block->size(); ++i)
+                if (!block->deleted(i))
+                    index_entry_(stream, block->id_at(i), block->fields_at(i));
+        for (const auto &entry : stream.tail)
+            index_entry_(stream, entry.first, entry.second);
+        return true;
+    }
+
+    bool drop_index(const std::string &stream_name, const std::string &field)
+    {
+        auto lock = lock_();
+        auto found = stream_data_.find(stream_name);
+        if (found != stream_data_.end())
+        {
+            auto index = found->second.indexes.find(field);
+            if (index == found->second.indexes.end())
+                return false;
+            index_bytes_ -= index_bytes_of_(index->second);
+            found->second.indexes.erase(index);
+            return true;
+        }
+        auto pending = pending_indexes_.find(stream_name);
+        if (pending == pending_indexes_.end() || !pending->second.erase(field))
+            return false;
+        if (pending->second.empty())
+            pending_indexes_.erase(pending);
+        return true;
+    }
+
+    size_t xlen(const std::string &stream_name)
+    {
+        auto lock = lock_();
+        // used to go through operator[] and leave an empty stream behind
+        auto found = stream_data_.find(stream_name);
+        return found == stream_data_.end() ? 0 : found->second.size();
+    }
+    /* I am not implementing this as a radix tree so deletes are a lot
+    easier. don't have to delay deletion until all "macro nodes" are
+    deleted internal handling of map deletion which underneath is a red
+    black tree is good enough for a toy project. building a radix tree
+    from scratch is not something I can do in a short time and I don't
+    know of any particular libraries that implement thread safe radix trees.
+    */
+    size_t xdel(const std::string &stream_name,
+                const std::vector<long long> &ids)
+    {
+        auto lock = lock_();
+        // check if key exists first I'm guessing we don't count
+        // keys that have already been deleted or don't exist.
+        // ids in sealed blocks only get tombstoned.
+        auto found = stream_data_.find(stream_name);
+        if (found == stream_data_.end())
+            return 0;
+        std::vector<long long> erased = erase_ids_(stream_name, found->second, ids);
+        size_t entries_deleted = erased.size();
+        if (entries_deleted && backlog_limit_)
+        {
+            streamMutation mutation;
+            mutation.kind = MUTATION_XDEL;
+            mutation.stream_name = stream_name;
+            mutation.ids = std::move(erased);
+            log_mutation_(std::move(mutation));
+        }
+        return entries_deleted;
+    }
+    // xtrim with only basic required arguments because all those optional
+    // arguments take a lot more time and I only really want to implement
+    // base functionality for now.
+    size_t xtrim(const std::string &stream_name,
+                 trimmingStrategy strategy,
+                 long long threshold)
+    {
+        // for MAXLEN arg is threshold, for MINID it's id.
+        // this didn't take the lock before and raced with every other
+        // command, can't call xlen here because it locks too.
+        auto lock = lock_();
+        size_t trimmed = xtrim_locked_(stream_name, strategy, threshold);
+        if (trimmed && backlog_limit_)
+        {
+            streamMutation mutation;
+            mutation.kind = MUTATION_XTRIM;
+            mutation.stream_name = stream_name;
+            mutation.strategy = strategy;
+            mutation.id = threshold;
+            log_mutation_(std::move(mutation));
+        }
+        return trimmed;
+    }
+
+    // DEL and UNLINK, takes whole streams out and returns how many of them
+    // were there. lazy (UNLINK) leaves anything with lazyfree_entries or
+    // more entries to the free thread, otherwise (DEL) it all gets freed
+    // before this returns like Redis does.
+    size_t del(const std::vector<std::string> &stream_names, bool lazy = false)
+    {
+        auto lock = lock_();
+        size_t dropped = 0;
+        for (const auto &name : stream_names)
+        {
+            auto found = stream_data_.find(name);
+            if (found == stream_data_.end())
+                continue;
+            if (backlog_limit_)
+            {
+                streamMutation mutation;
+                mutation.kind = MUTATION_DEL;
+                mutation.stream_name = name;
+                log_mutation_(std::move(mutation));
+            }
+            drop_stream_(found, lazy);
+            dropped++;
+        }
+        return dropped;
+    }
+
+    // waits for everything handed to the free thread so far to be freed
+    void wait_for_lazy_free() { lazy_free_.wait(); }
+
+    // replication. the leader side turns on the backlog and hands out
+    // snapshots and runs of mutations, the follower side applies them.
+
+    // keep up to max_entries of the most recent mutations around
+    void enable_replication_backlog(size_t max_entries)
+    {
+        auto lock = lock_();
+        backlog_limit_ = max_entries;
+        if (replication_id_.empty())
+        {
+            // only has to tell one leader's history apart from another's
+            std::random_device rd;
+            std::mt19937_64 rng(rd());
+            replication_id_ = std::to_string(rng());
+        }
+        trim_backlog_();
+    }
+
+    std::string replication_id()
+    {
+        auto lock = lock_();
+        return replication_id_;
+    }
+
+    long long replication_offset()
+    {
+        auto lock = lock_();
+        return replication_offset_;
+    }
+
+    // can a follower that has applied everything up to offset continue from
+    // the backlog or does it need a full sync
+    bool can_partial_resync(const std::string &replication_id, long long offset)
+    {
+        auto lock = lock_();
+        if (replication_id != replication_id_ || offset > replication_offset_)
+            return false;
+        if (offset == replication_offset_)
+            return true;
+        return !backlog_.empty() && backlog_.front().offset <= offset + 1;
+    }
+
+    // copies out the mutations after offset, waits up to wait_time if there
+    // aren't any yet. returns false when offset already fell out of the
+    // backlog and the follower has to full sync.
+    bool mutations_since(long long offset, std::vector<streamMutation> &out,
+                         size_t max_count,
+                         std::chrono::milliseconds wait_time)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        backlog_condition_.wait_for(lock, wait_time, [this, offset]
+                                    { return replication_offset_ > offset; });
+        if (offset == replication_offset_)
+            return true;
+        if (backlog_.empty() || backlog_.front().offset > offset + 1)
+            return false;
+        auto it = backlog_.begin() + (offset + 1 - backlog_.front().offset);
+        for (; it != backlog_.end() && out.size() < max_count; ++it)
+            out.push_back(*it);
+        return true;
+    }
+
+    // the part of a full sync that needs everything to hold still, see
+    // streamSnapshotView. returns the offset the views are consistent with.
+    long long snapshot_view(std::vector<streamSnapshotView> &out)
+    {
+        auto lock = lock_();
+        out.reserve(out.size() + stream_data_.size());
+        for (const auto &stream : stream_data_)
+        {
+            streamSnapshotView view;
+            view.stream_name = stream.first;
+            view.next_id = stream.second.next_id;
+            view.blocks = stream.second.blocks;
+            view.tail.reserve(stream.second.tail.size());
+            view.tail_arrival_ms.reserve(stream.second.tail.size());
+            for (const auto &entry : stream.second.tail)
+            {
+                view.tail.push_back(entry);
+                view.tail_arrival_ms.push_back(tail_time_(stream.second, entry.first));
+            }
+            out.push_back(std::move(view));
+        }
+        return replication_offset_;
+    }
+
+    // what's left in one block of a view and when it arrived, the lock is
+    // only held for the one block so writers get in between blocks
+    void snapshot_block(const sealedBlock &block, VectorPairStructure &entries,
+                        std::vector<long long> &arrival_ms)
+    {
+        auto lock = lock_();
+        block.append_range(0, LLONG_MAX, SIZE_MAX, entries);
+        for (size_t i = 0; i < block.size(); ++i)
+            if (!block.deleted(i))
+                arrival_ms.push_back(block.time_at(i));
+    }
+
+    // copies every stream out, returns the offset the copy is consistent
+    // with. goes through the views so the lock isn't held for all of it.
+    long long snapshot(std::vector<streamSnapshot> &out)
+    {
+        std::vector<streamSnapshotView> views;
+        long long offset = snapshot_view(views);
+        for (auto &view : views)
+        {
+            streamSnapshot snap;
+            snap.stream_name = std::move(view.stream_name);
+            snap.next_id = view.next_id;
+            for (const auto &block : view.blocks)
+                snapshot_block(*block, snap.entries, snap.arrival_ms);
+            std::move(view.tail.begin(), view.tail.end(), std::back_inserter(snap.entries));
+            snap.arrival_ms.insert(snap.arrival_ms.end(), view.tail_arrival_ms.begin(),
+                                   view.tail_arrival_ms.end());
+            out.push_back(std::move(snap));
+        }
+        return offset;
+    }
+
+    // follower side of a full sync, throws away whatever was here
+    void load_snapshot(const std::vector<streamSnapshot> &streams,
+                       const std::string &replication_id, long long offset)
+    {
+        {
+            auto lock = lock_();
+            // indexes are local to this node, keep the ones it had
+            std::map<std::string, std::vector<std::string>> indexed;
+            std::map<std::string, retentionPolicy> retained;
+            streamGarbage garbage;
+            for (auto &stream : stream_data_)
+            {
+                for (const auto &index : stream.second.indexes)
+                    indexed[stream.first].push_back(index.first);
+                if (!stream.second.retention.empty())
+                    retained[stream.first] = stream.second.retention;
+                unhook_stream_(stream.second, garbage);
+            }
+            stream_data_.clear();
+            lru_.clear();
+            oldest_.clear();
+            free_garbage_(std::move(garbage));
+            dropped_next_ids_.clear();
+            for (const auto &snap : streams)
+            {
+                auto &stream = state_(snap.stream_name);
+                for (const auto &field : indexed[snap.stream_name])
+                    stream.indexes[field];
+                for (size_t i = 0; i < snap.entries.size(); ++i)
+                {
+                    long long arrival_ms =
+                        i < snap.arrival_ms.size() ? snap.arrival_ms[i] : 0;
+                    append_tail_(stream, snap.entries[i].first,
+                                 snap.entries[i].second, arrival_ms);
+                }
+                stream.next_id = snap.next_id;
+                if (!snap.entries.empty())
+                    stream.last_id = snap.entries.back().first;
+                track_oldest_(snap.stream_name, stream);
+            }
+            // so are retention policies, but only for streams the leader
+            // still has. the rest are gone and stop being looked after.
+            retention_streams_.clear();
+            for (const auto &policy : retained)
+            {
+                auto found = stream_data_.find(policy.first);
+                if (found == stream_data_.end())
+                    continue;
+                found->second.retention = policy.second;
+                retention_streams_.insert(policy.first);
+            }
+            replication_id_ = replication_id;
+            replication_offset_ = offset;
+            backlog_.clear();
+            backlog_bytes_ = 0;
+            wake_readers_();
+        }
+        spill_cold_blocks_();
+    }
+
+    // follower side, replays one of the leader's mutations with the ids the
+    // leader picked
+    void apply_mutation(const streamMutation &mutation)
+    {
+        {
+            auto lock = lock_();
+            if (mutation.kind == MUTATION_DEL)
+            {
+                auto found = stream_data_.find(mutation.stream_name);
+                if (found != stream_data_.end())
+                    drop_stream_(found);
+                replication_offset_ = mutation.offset;
+                return;
+            }
+            auto &stream = state_(mutation.stream_name);
+            switch (mutation.kind)
+            {
+            case MUTATION_XADD:
+            {
+                long long arrival_ms = mutation.logged_ms ? mutation.logged_ms : now_ms_();
+                publish_(mutation.stream_name, mutation.id, arrival_ms, mutation.data);
+                append_tail_(stream, mutation.id, mutation.data, arrival_ms);
+                stream.next_id = std::max(stream.next_id, mutation.id + 1);
+                stream.last_id = mutation.id;
+                track_oldest_(mutation.stream_name, stream);
+                wake_readers_();
+                break;
+            }
+            case MUTATION_XDEL:
+                erase_ids_(mutation.stream_name, stream, mutation.ids);
+                break;
+            case MUTATION_XTRIM:
+                xtrim_locked_(mutation.stream_name, mutation.strategy, mutation.id);
+                break;
+            case MUTATION_DEL:
+                break;
+            }
+            replication_offset_ = mutation.offset;
+        }
+        spill_cold_blocks_();
+    }
+
+    // runs the compactor on everything queued right now instead of waiting
+    // for the background thread
+    void compact()
+    {
+        {
+            auto lock = lock_();
+            compact_until_(std::chrono::steady_clock::time_point::max());
+        }
+        spill_cold_blocks_();
+    }
+
+    // keeps the oldest entries of a stream trimmed to policy from now on, in
+    // the background. an empty policy turns it off.
+    void set_retention(const std::string &stream_name, const retentionPolicy &policy)
+    {
+        auto lock = lock_();
+        if (policy.empty())
+        {
+            // turning it off on a stream that isn't there doesn't make one
+            auto found = stream_data_.find(stream_name);
+            if (found == stream_data_.end())
+                return;
+            found->second.retention = policy;
+            retention_streams_.erase(stream_name);
+            return;
+        }
+        state_(stream_name).retention = policy;
+        retention_streams_.insert(stream_name);
+        start_maintenance_();
+    }
+
+    retentionPolicy retention(const std::string &stream_name)
+    {
+        auto lock = lock_();
+        auto found = stream_data_.find(stream_name);
+        return found == stream_data_.end() ? retentionPolicy() : found->second.retention;
+    }
+
+    // trims everything past its retention policy right now instead of
+    // waiting for the background thread
+    void enforce_retention()
+    {
+        {
+            auto lock = lock_();
+            retention_cursor_.clear();
+            retention_until_(std::chrono::steady_clock::time_point::max());
+        }
+        spill_cold_blocks_();
+    }
+
+    memoryStats memory_stats()
+    {
+        auto lock = lock_();
+        memoryStats stats;
+        stats.used_bytes = used_memory_();
+        stats.max_bytes = config_.max_memory;
+        stats.evicted_entries = evicted_entries_;
+        stats.evicted_streams = evicted_streams_;
+        stats.rejected_writes = rejected_writes_;
+        stats.backlog_bytes = backlog_bytes_;
+        stats.index_bytes = index_bytes_;
+        stats.lazyfree_pending = lazy_free_.pending();
+        stats.lazyfreed = lazy_free_.freed();
+        return stats;
+    }
+
+    maintenanceStats maintenance_stats()
+    {
+        auto lock = lock_();
+        return maintenance_stats_;
+    }
+
+    storageStats storage_stats()
+    {
+        auto lock = lock_();
+        storageStats stats;
+        stats.sealed_blocks = sealed_blocks_;
+        stats.spilled_blocks = spilled_blocks_;
+        stats.resident_bytes = resident_bytes_;
+        stats.spilled_bytes = spilled_bytes_;
+        stats.payload_bytes = payload_bytes_;
+        stats.stored_payload_bytes = stored_payload_bytes_;
+        stats.decompressed_bytes = decompressed_.bytes();
+        stats.decompress_hits = decompressed_.hits();
+        stats.decompress_misses = decompressed_.misses();
+        stats.tombstones = tombstones_;
+        stats.compacted_blocks = compacted_blocks_;
+        stats.parallel_ranges = parallel_ranges_;
+        return stats;
+    }
+
+    // followers only serve reads, the interface checks this before writes
+    void set_read_only(bool read_only) { read_only_ = read_only; }
+    bool is_read_only() const { return read_only_.load(); }
+};
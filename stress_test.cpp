@@ -0,0 +1,634 @@
+#include "stream.h"
+#include <cassert>
+#include <thread>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <unordered_set>
+#include <cstring>
+#include <cstdint>
+
+// randomized stress test, a lot of threads hammer a handful of streams with a
+// mix of every command and random delays in between. every call gets a
+// invoke and response stamp from one global counter so afterwards the whole
+// history can be checked against a plain single threaded model of a stream
+// (Wing & Gong search with Lowe's memoization). each stream is checked on its
+// own since commands only ever touch one stream here.
+//
+// ./stress_test [--threads N] [--streams N] [--rounds N] [--ops N] [--seed N]
+//               [--block-entries N] [--memory-budget BYTES]
+//               [--compress-blocks 0|1]
+// every round starts from a fresh redisStream so the history per round stays
+// small enough to check, crank --rounds to make it run for a long time.
+// blocks are tiny by default so deletes and trims keep hitting sealed and
+// spilled blocks and not just the tail.
+
+enum opKind
+{
+    OP_XADD,
+    OP_XREAD,
+    OP_XRANGE,
+    OP_XDEL,
+    OP_XTRIM,
+    OP_XLEN,
+    OP_KINDS,
+};
+
+static const char *op_names[OP_KINDS] = {"xadd", "xread", "xrange",
+                                         "xdel", "xtrim", "xlen"};
+
+using ObservedEntries = std::vector<std::pair<long long, std::string>>;
+
+struct historyOp
+{
+    opKind kind;
+    size_t stream;
+    long long invoke = 0;
+    long long response = 0;
+    long long latency_ns = 0;
+    // arguments, which ones are used depends on the kind
+    std::string value;
+    long long start_id = 0;
+    long long end_id = 0;
+    std::optional<long long> count;
+    std::optional<long long> block_time;
+    trimmingStrategy strategy = MAXLEN;
+    std::vector<long long> ids;
+    // what the real stream answered
+    long long ret = 0;
+    ObservedEntries entries;
+};
+
+struct stressConfig
+{
+    size_t threads = 32;
+    size_t streams = 4;
+    size_t rounds = 4;
+    size_t ops_per_thread = 300;
+    unsigned seed = 12345;
+    streamConfig stream_config;
+};
+
+static std::atomic<long long> event_clock{0};
+
+static std::string stream_key(size_t index)
+{
+    return "stress" + std::to_string(index);
+}
+
+static ObservedEntries observe(const VectorPairStructure &entries)
+{
+    ObservedEntries out;
+    out.reserve(entries.size());
+    for (const auto &entry : entries)
+        out.emplace_back(entry.first, entry.second.empty()
+                                          ? std::string{}
+                                          : entry.second[0].second);
+    return out;
+}
+
+// one client thread, it picks random commands against random streams and
+// writes down everything it did
+static void run_client(redisStream &stream, const stressConfig &config,
+                       size_t thread_index, unsigned seed,
+                       std::vector<historyOp> &history)
+{
+    std::mt19937 rng(seed);
+    // rough idea of how far the ids got so reads and deletes hit something
+    std::vector<long long> max_seen(config.streams, 0);
+    auto pick = [&rng](long long lo, long long hi)
+    {
+        return std::uniform_int_distribution<long long>(lo, hi)(rng);
+    };
+    history.reserve(config.ops_per_thread);
+
+    for (size_t n = 0; n < config.ops_per_thread; ++n)
+    {
+        historyOp op;
+        op.stream = static_cast<size_t>(pick(0, config.streams - 1));
+        long long top = max_seen[op.stream] + 2;
+        long long roll = pick(0, 99);
+        if (roll < 40)
+            op.kind = OP_XADD;
+        else if (roll < 55)
+            op.kind = OP_XREAD;
+        else if (roll < 75)
+            op.kind = OP_XRANGE;
+        else if (roll < 87)
+            op.kind = OP_XDEL;
+        else if (roll < 92)
+            op.kind = OP_XTRIM;
+        else
+            op.kind = OP_XLEN;
+
+        switch (op.kind)
+        {
+        case OP_XADD:
+            op.value = std::to_string(thread_index) + ":" + std::to_string(n);
+            break;
+        case OP_XREAD:
+            op.start_id = pick(0, top);
+            if (pick(0, 1))
+                op.count = pick(1, 20);
+            if (pick(0, 3) == 0)
+                op.block_time = pick(1, 5);
+            break;
+        case OP_XRANGE:
+            op.start_id = pick(-2, top);
+            op.end_id = pick(op.start_id, top + 5);
+            if (pick(0, 2) == 0)
+                op.end_id = LLONG_MAX;
+            if (pick(0, 1))
+                op.count = pick(1, 20);
+            break;
+        case OP_XDEL:
+            for (long long i = pick(1, 3); i > 0; --i)
+                op.ids.push_back(pick(0, top));
+            break;
+        case OP_XTRIM:
+            if (pick(0, 1))
+            {
+                op.strategy = MINID;
+                op.start_id = pick(0, std::max(0LL, top - 20));
+            }
+            else
+            {
+                op.strategy = MAXLEN;
+                op.start_id = pick(5, 40);
+            }
+            break;
+        default:
+            break;
+        }
+
+        // random delays so the interleavings actually change between runs
+        long long delay = pick(0, 9);
+        if (delay < 3)
+            std::this_thread::yield();
+        else if (delay < 5)
+            std::this_thread::sleep_for(std::chrono::microseconds(pick(1, 200)));
+
+        const std::string key = stream_key(op.stream);
+        auto started = std::chrono::steady_clock::now();
+        op.invoke = event_clock.fetch_add(1);
+        switch (op.kind)
+        {
+        case OP_XADD:
+            op.ret = stream.xadd(key, {{"v", op.value}});
+            break;
+        case OP_XREAD:
+        {
+            auto result = stream.xread({key}, {op.start_id}, op.block_time,
+                                       op.count);
+            if (result.count(key))
+                op.entries = observe(result[key]);
+            break;
+        }
+        case OP_XRANGE:
+            op.entries = observe(stream.xrange(key, op.start_id, op.end_id,
+                                               op.count));
+            break;
+        case OP_XDEL:
+            op.ret = static_cast<long long>(stream.xdel(key, op.ids));
+            break;
+        case OP_XTRIM:
+            op.ret = static_cast<long long>(stream.xtrim(key, op.strategy,
+                                                         op.start_id));
+            break;
+        case OP_XLEN:
+            op.ret = static_cast<long long>(stream.xlen(key));
+            break;
+        default:
+            break;
+        }
+        op.response = event_clock.fetch_add(1);
+        op.latency_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - started)
+                            .count();
+        if (op.kind == OP_XADD)
+            max_seen[op.stream] = std::max(max_seen[op.stream], op.ret);
+        history.push_back(std::move(op));
+    }
+}
+
+// the single threaded model the history gets checked against. steps can be
+// undone so the search can backtrack without copying the whole state.
+class streamModel
+{
+private:
+    std::map<long long, std::string> entries_;
+    long long next_id_ = 0;
+    uint64_t hash_ = 0;
+
+    static uint64_t entry_hash_(long long id, const std::string &value)
+    {
+        uint64_t h = std::hash<std::string>{}(value) ^
+                     (static_cast<uint64_t>(id) * 0x9e3779b97f4a7c15ULL);
+        h ^= h >> 29;
+        return h * 0xbf58476d1ce4e5b9ULL;
+    }
+
+    void erase_(std::map<long long, std::string>::iterator it,
+                ObservedEntries &undo)
+    {
+        hash_ ^= entry_hash_(it->first, it->second);
+        undo.emplace_back(it->first, it->second);
+        entries_.erase(it);
+    }
+
+    ObservedEntries read_(long long start_id, long long end_id,
+                          std::optional<long long> count) const
+    {
+        ObservedEntries out;
+        for (auto it = entries_.lower_bound(start_id);
+             it != entries_.end() && it->first <= end_id; ++it)
+        {
+            out.push_back(*it);
+            if (count && static_cast<long long>(out.size()) >= *count)
+                break;
+        }
+        return out;
+    }
+
+public:
+    uint64_t hash() const
+    {
+        return hash_ ^ (static_cast<uint64_t>(next_id_) * 0xff51afd7ed558ccdULL);
+    }
+
+    // applies op if the result the real stream gave is possible right now,
+    // anything removed goes into undo
+    bool step(const historyOp &op, ObservedEntries &undo)
+    {
+        undo.clear();
+        switch (op.kind)
+        {
+        case OP_XADD:
+            if (op.ret != next_id_)
+                return false;
+            entries_.emplace(next_id_, op.value);
+            hash_ ^= entry_hash_(next_id_, op.value);
+            next_id_++;
+            return true;
+        case OP_XREAD:
+            return read_(op.start_id, LLONG_MAX, op.count) == op.entries;
+        case OP_XRANGE:
+            return read_(op.start_id, op.end_id, op.count) == op.entries;
+        case OP_XLEN:
+            return static_cast<long long>(entries_.size()) == op.ret;
+        case OP_XDEL:
+        {
+            long long deleted = 0;
+            for (long long id : op.ids)
+                if (entries_.count(id) &&
+                    std::find_if(undo.begin(), undo.end(), [id](const auto &e)
+                                 { return e.first == id; }) == undo.end())
+                {
+                    undo.emplace_back(id, entries_[id]);
+                    deleted++;
+                }
+            if (deleted != op.ret)
+                return false;
+            for (const auto &e : undo)
+            {
+                hash_ ^= entry_hash_(e.first, e.second);
+                entries_.erase(e.first);
+            }
+            return true;
+        }
+        case OP_XTRIM:
+        {
+            long long expected = 0;
+            if (op.strategy == MAXLEN)
+            {
+                if (static_cast<long long>(entries_.size()) > op.start_id)
+                    expected = std::min<long long>(op.start_id, entries_.size());
+            }
+            else
+            {
+                expected = std::distance(entries_.begin(),
+                                         entries_.upper_bound(op.start_id));
+            }
+            if (expected != op.ret)
+                return false;
+            for (long long i = 0; i < expected; ++i)
+                erase_(op.strategy == MAXLEN ? std::prev(entries_.end())
+                                             : entries_.begin(),
+                       undo);
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+    void undo(const historyOp &op, const ObservedEntries &removed)
+    {
+        if (op.kind == OP_XADD)
+        {
+            next_id_--;
+            hash_ ^= entry_hash_(next_id_, op.value);
+            entries_.erase(next_id_);
+            return;
+        }
+        for (const auto &e : removed)
+        {
+            entries_.emplace(e.first, e.second);
+            hash_ ^= entry_hash_(e.first, e.second);
+        }
+    }
+};
+
+struct historyEvent
+{
+    bool is_call;
+    size_t op;
+    historyEvent *match = nullptr;
+    historyEvent *prev = nullptr;
+    historyEvent *next = nullptr;
+};
+
+struct cacheKey
+{
+    std::vector<uint64_t> linearized;
+    uint64_t state;
+    bool operator==(const cacheKey &other) const
+    {
+        return state == other.state && linearized == other.linearized;
+    }
+};
+
+struct cacheKeyHash
+{
+    size_t operator()(const cacheKey &key) const
+    {
+        uint64_t h = key.state;
+        for (uint64_t word : key.linearized)
+            h = (h ^ word) * 0x100000001b3ULL;
+        return static_cast<size_t>(h);
+    }
+};
+
+// returns true when there's some order of the ops that respects real time
+// and that the model agrees with. failed_op is the op that couldn't be placed
+// when the search got the furthest, that's usually the interesting one.
+static bool check_linearizable(const std::vector<const historyOp *> &ops,
+                               size_t &failed_op)
+{
+    std::vector<historyEvent> events(ops.size() * 2);
+    for (size_t i = 0; i < ops.size(); ++i)
+    {
+        events[2 * i] = {true, i};
+        events[2 * i + 1] = {false, i};
+        events[2 * i].match = &events[2 * i + 1];
+        events[2 * i + 1].match = &events[2 * i];
+    }
+    std::vector<historyEvent *> order;
+    order.reserve(events.size());
+    for (auto &event : events)
+        order.push_back(&event);
+    std::sort(order.begin(), order.end(),
+              [&ops](const historyEvent *a, const historyEvent *b)
+              {
+                  long long ta = a->is_call ? ops[a->op]->invoke
+                                            : ops[a->op]->response;
+                  long long tb = b->is_call ? ops[b->op]->invoke
+                                            : ops[b->op]->response;
+                  return ta < tb;
+              });
+    historyEvent head{false, 0};
+    historyEvent *tail = &head;
+    for (historyEvent *event : order)
+    {
+        tail->next = event;
+        event->prev = tail;
+        tail = event;
+    }
+
+    auto lift = [](historyEvent *call)
+    {
+        call->prev->next = call->next;
+        if (call->next)
+            call->next->prev = call->prev;
+        historyEvent *ret = call->match;
+        ret->prev->next = ret->next;
+        if (ret->next)
+            ret->next->prev = ret->prev;
+    };
+    auto unlift = [](historyEvent *call)
+    {
+        historyEvent *ret = call->match;
+        ret->prev->next = ret;
+        if (ret->next)
+            ret->next->prev = ret;
+        call->prev->next = call;
+        if (call->next)
+            call->next->prev = call;
+    };
+
+    streamModel model;
+    cacheKey current{std::vector<uint64_t>((ops.size() + 63) / 64, 0), 0};
+    std::unordered_set<cacheKey, cacheKeyHash> cache;
+    std::vector<std::pair<historyEvent *, ObservedEntries>> stack;
+    ObservedEntries undo;
+    size_t deepest = 0;
+
+    historyEvent *entry = head.next;
+    while (head.next)
+    {
+        if (entry->is_call)
+        {
+            const historyOp &op = *ops[entry->op];
+            if (model.step(op, undo))
+            {
+                current.linearized[entry->op / 64] |= 1ULL << (entry->op % 64);
+                current.state = model.hash();
+                if (cache.insert(current).second)
+                {
+                    stack.emplace_back(entry, std::move(undo));
+                    undo = {};
+                    lift(entry);
+                    entry = head.next;
+                    continue;
+                }
+                current.linearized[entry->op / 64] &= ~(1ULL << (entry->op % 64));
+                model.undo(op, undo);
+            }
+            entry = entry->next;
+        }
+        else
+        {
+            // hit a return before its call could be placed, back up
+            if (stack.size() >= deepest)
+            {
+                deepest = stack.size();
+                failed_op = entry->op;
+            }
+            if (stack.empty())
+                return false;
+            historyEvent *call = stack.back().first;
+            model.undo(*ops[call->op], stack.back().second);
+            current.linearized[call->op / 64] &= ~(1ULL << (call->op % 64));
+            stack.pop_back();
+            unlift(call);
+            entry = call->next;
+        }
+    }
+    return true;
+}
+
+static void print_op(const historyOp &op)
+{
+    std::cerr << "  " << op_names[op.kind] << " " << stream_key(op.stream)
+              << " [" << op.invoke << ", " << op.response << "]";
+    switch (op.kind)
+    {
+    case OP_XADD:
+        std::cerr << " value=" << op.value << " -> " << op.ret;
+        break;
+    case OP_XDEL:
+    case OP_XTRIM:
+    case OP_XLEN:
+        std::cerr << " -> " << op.ret;
+        break;
+    default:
+        std::cerr << " start=" << op.start_id << " -> " << op.entries.size()
+                  << " entries";
+        break;
+    }
+    std::cerr << '\n';
+}
+
+static long long percentile(std::vector<long long> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t index = static_cast<size_t>(p * (sorted.size() - 1));
+    return sorted[index];
+}
+
+static bool parse_args(int argc, char **argv, stressConfig &config)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (i + 1 >= argc)
+            return false;
+        unsigned long value = std::stoul(argv[i + 1]);
+        if (!std::strcmp(argv[i], "--threads"))
+            config.threads = value;
+        else if (!std::strcmp(argv[i], "--streams"))
+            config.streams = value;
+        else if (!std::strcmp(argv[i], "--rounds"))
+            config.rounds = value;
+        else if (!std::strcmp(argv[i], "--ops"))
+            config.ops_per_thread = value;
+        else if (!std::strcmp(argv[i], "--seed"))
+            config.seed = static_cast<unsigned>(value);
+        else if (!std::strcmp(argv[i], "--block-entries"))
+            config.stream_config.block_entries = value;
+        else if (!std::strcmp(argv[i], "--memory-budget"))
+            config.stream_config.memory_budget = value;
+        else if (!std::strcmp(argv[i], "--compress-blocks"))
+            config.stream_config.compress_blocks = value != 0;
+        else
+            return false;
+        ++i;
+    }
+    return config.threads > 0 && config.streams > 0;
+}
+
+int main(int argc, char **argv)
+{
+    stressConfig config;
+    config.stream_config.block_entries = 8;
+    config.stream_config.memory_budget = 4096;
+    config.stream_config.compress_blocks = true;
+    if (!parse_args(argc, argv, config))
+    {
+        std::cerr << "usage: stress_test [--threads N] [--streams N] "
+                     "[--rounds N] [--ops N] [--seed N] [--block-entries N] "
+                     "[--memory-budget BYTES] [--compress-blocks 0|1]\n";
+        return 2;
+    }
+    std::cout << "stress test: " << config.threads << " threads, "
+              << config.streams << " streams, " << config.rounds
+              << " rounds of " << config.ops_per_thread
+              << " ops per thread, seed " << config.seed << ", blocks of "
+              << config.stream_config.block_entries << ", memory budget "
+              << config.stream_config.memory_budget
+              << (config.stream_config.compress_blocks ? ", compressed" : "")
+              << std::endl;
+
+    std::vector<long long> latencies[OP_KINDS];
+    size_t total_ops = 0;
+    double busy_seconds = 0;
+
+    for (size_t round = 0; round < config.rounds; ++round)
+    {
+        redisStream stream(config.stream_config);
+        std::vector<std::vector<historyOp>> histories(config.threads);
+        std::vector<std::thread> threads;
+        auto started = std::chrono::steady_clock::now();
+        for (size_t t = 0; t < config.threads; ++t)
+        {
+            unsigned seed = config.seed + static_cast<unsigned>(round * 1000 + t);
+            threads.emplace_back(run_client, std::ref(stream), std::cref(config),
+                                 t, seed, std::ref(histories[t]));
+        }
+        for (auto &t : threads)
+            t.join();
+        busy_seconds += std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - started)
+                            .count();
+
+        // split the history up by stream and check each one by itself
+        std::vector<std::vector<const historyOp *>> per_stream(config.streams);
+        for (const auto &history : histories)
+            for (const auto &op : history)
+            {
+                per_stream[op.stream].push_back(&op);
+                latencies[op.kind].push_back(op.latency_ns);
+                total_ops++;
+            }
+        for (size_t s = 0; s < config.streams; ++s)
+        {
+            size_t failed = 0;
+            if (!check_linearizable(per_stream[s], failed))
+            {
+                const historyOp &bad = *per_stream[s][failed];
+                std::cerr << "round " << round << ": history of "
+                          << stream_key(s) << " is not linearizable, stuck on\n";
+                print_op(bad);
+                std::cerr << "overlapping ops:\n";
+                for (const historyOp *op : per_stream[s])
+                    if (op->invoke < bad.response && op->response > bad.invoke)
+                        print_op(*op);
+                return 1;
+            }
+        }
+        storageStats stats = stream.storage_stats();
+        std::cout << "round " << round << " linearizable (" << stats.sealed_blocks
+                  << " sealed blocks, " << stats.spilled_blocks << " spilled, "
+                  << stats.compacted_blocks << " compacted)"
+                  << std::endl;
+    }
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << total_ops << " ops in " << busy_seconds << "s, "
+              << total_ops / busy_seconds << " ops/s (with random delays)\n";
+    std::cout << "latency in us      p50      p99    p99.9      max\n";
+    for (int kind = 0; kind < OP_KINDS; ++kind)
+    {
+        auto &samples = latencies[kind];
+        std::sort(samples.begin(), samples.end());
+        std::cout << std::left << std::setw(10) << op_names[kind] << std::right;
+        for (double p : {0.5, 0.99, 0.999, 1.0})
+            std::cout << std::setw(9) << percentile(samples, p) / 1000.0;
+        std::cout << '\n';
+    }
+    std::cout << "All stress tests passed!" << std::endl;
+    return 0;
+}
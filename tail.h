@@ -0,0 +1,296 @@
+// the hot tail of one stream, entries in id order. most streams only ever
+// hold a handful of entries so up to small_entries of them sit in one
+// sorted vector, a single allocation for all of them instead of a map node
+// each. past that the tail moves over to a map so deletes from the middle
+// and long tails (block_entries 0) stay cheap, and it goes back to the
+// vector once it's emptied out.
+//
+// iterators look the same either way and hand out entryRefs, read only
+// views with first and second like a map's value_type. anything that adds
+// or removes entries invalidates them, like a vector.
+//
+// stream.h includes this after it declares the structure aliases.
+
+#pragma once
+#include "resp.h"
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+class tailEntries
+{
+public:
+    static constexpr size_t small_entries = 16;
+
+    struct entryRef
+    {
+        const long long &first;
+        const FieldsStructure &second;
+
+        operator std::pair<long long, FieldsStructure>() const { return {first, second}; }
+    };
+
+    class iterator
+    {
+    private:
+        friend class tailEntries;
+        const VectorPairStructure::value_type *small_ = nullptr;
+        MapStructure::const_iterator large_;
+        bool is_large_ = false;
+
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = std::pair<long long, FieldsStructure>;
+        using difference_type = std::ptrdiff_t;
+        using reference = entryRef;
+        // -> has to hand back something that outlives the call
+        struct pointer
+        {
+            entryRef ref;
+            const entryRef *operator->() const { return &ref; }
+        };
+
+        entryRef operator*() const
+        {
+            if (is_large_)
+                return {large_->first, large_->second};
+            return {small_->first, small_->second};
+        }
+        pointer operator->() const { return {**this}; }
+
+        iterator &operator++()
+        {
+            if (is_large_)
+                ++large_;
+            else
+                ++small_;
+            return *this;
+        }
+        iterator operator++(int)
+        {
+            iterator before = *this;
+            ++*this;
+            return before;
+        }
+        iterator &operator--()
+        {
+            if (is_large_)
+                --large_;
+            else
+                --small_;
+            return *this;
+        }
+        iterator operator--(int)
+        {
+            iterator before = *this;
+            --*this;
+            return before;
+        }
+
+        bool operator==(const iterator &other) const
+        {
+            return is_large_ ? large_ == other.large_ : small_ == other.small_;
+        }
+        bool operator!=(const iterator &other) const { return !(*this == other); }
+    };
+    using const_iterator = iterator;
+
+private:
+    VectorPairStructure small_;
+    std::unique_ptr<MapStructure> large_; // only once it's grown past small_entries
+
+    iterator small_at_(size_t i) const
+    {
+        iterator it;
+        it.small_ = small_.data() + i;
+        return it;
+    }
+
+    iterator large_at_(MapStructure::const_iterator at) const
+    {
+        iterator it;
+        it.large_ = at;
+        it.is_large_ = true;
+        return it;
+    }
+
+    size_t small_index_(long long id) const
+    {
+        return std::lower_bound(small_.begin(), small_.end(), id,
+                                [](const VectorPairStructure::value_type &entry, long long target)
+                                { return entry.first < target; }) -
+               small_.begin();
+    }
+
+    void promote_()
+    {
+        large_ = std::make_unique<MapStructure>();
+        for (auto &entry : small_)
+            large_->emplace_hint(large_->end(), entry.first, std::move(entry.second));
+        VectorPairStructure().swap(small_);
+    }
+
+public:
+    tailEntries() = default;
+    tailEntries(tailEntries &&) = default;
+    tailEntries &operator=(tailEntries &&) = default;
+
+    size_t size() const { return large_ ? large_->size() : small_.size(); }
+    bool empty() const { return size() == 0; }
+    bool is_small() const { return !large_; }
+
+    iterator begin() const { return large_ ? large_at_(large_->begin()) : small_at_(0); }
+    iterator end() const { return large_ ? large_at_(large_->end()) : small_at_(small_.size()); }
+
+    iterator lower_bound(long long id) const
+    {
+        return large_ ? large_at_(large_->lower_bound(id)) : small_at_(small_index_(id));
+    }
+
+    // not lower_bound(id + 1), that overflows on LLONG_MAX
+    iterator upper_bound(long long id) const
+    {
+        if (large_)
+            return large_at_(large_->upper_bound(id));
+        return small_at_(std::upper_bound(small_.begin(), small_.end(), id,
+                                          [](long long target, const VectorPairStructure::value_type &entry)
+                                          { return target < entry.first; }) -
+                         small_.begin());
+    }
+
+    iterator find(long long id) const
+    {
+        iterator it = lower_bound(id);
+        return it != end() && it->first == id ? it : end();
+    }
+
+    // like map::emplace, nothing happens if the id is already there
+    std::pair<iterator, bool> emplace(long long id, FieldsStructure fields)
+    {
+        if (!large_)
+        {
+            size_t i = small_.empty() || small_.back().first < id ? small_.size()
+                                                                  : small_index_(id);
+            if (i < small_.size() && small_[i].first == id)
+                return {small_at_(i), false};
+            if (small_.size() < small_entries)
+            {
+                small_.emplace(small_.begin() + i, id, std::move(fields));
+                return {small_at_(i), true};
+            }
+            promote_();
+        }
+        // new ids are almost always the biggest so end is the hint
+        size_t before = large_->size();
+        auto at = large_->emplace_hint(large_->end(), id, std::move(fields));
+        return {large_at_(at), large_->size() != before};
+    }
+
+    iterator erase(iterator first, iterator last)
+    {
+        if (!large_)
+        {
+            size_t from = first.small_ - small_.data(), to = last.small_ - small_.data();
+            small_.erase(small_.begin() + from, small_.begin() + to);
+            return small_at_(from);
+        }
+        auto next = large_->erase(first.large_, last.large_);
+        if (!large_->empty())
+            return large_at_(next);
+        large_.reset();
+        return end();
+    }
+};
+
+// RESP for the newest entries of one stream, back to back the way a reply
+// has them, so a read from some id to the end of the stream is a header and
+// one slice of bytes. it has every live entry with an id >= from(). the
+// first read that fits makes it, xadd appends to it, and deletes and trims
+// cut out exactly the entries they take out of the stream, nothing ever
+// gets rebuilt. once it's at twice max_entries the older half goes.
+class tailReplyCache
+{
+private:
+    long long from_;
+    std::string bytes_;
+    std::vector<long long> ids_;
+    std::vector<size_t> offsets_; // where each entry starts in bytes_
+
+    size_t offset_(size_t i) const { return i < offsets_.size() ? offsets_[i] : bytes_.size(); }
+
+    size_t index_(long long id) const
+    {
+        return std::lower_bound(ids_.begin(), ids_.end(), id) - ids_.begin();
+    }
+
+    // drops entries first..last-1
+    void erase_(size_t first, size_t last)
+    {
+        if (first >= last)
+            return;
+        size_t from = offset_(first), cut = offset_(last) - from;
+        bytes_.erase(from, cut);
+        ids_.erase(ids_.begin() + first, ids_.begin() + last);
+        offsets_.erase(offsets_.begin() + first, offsets_.begin() + last);
+        for (size_t i = first; i < offsets_.size(); ++i)
+            offsets_[i] -= cut;
+    }
+
+public:
+    explicit tailReplyCache(long long from) : from_(from) {}
+
+    long long from() const { return from_; }
+    size_t size() const { return ids_.size(); }
+    size_t bytes() const { return bytes_.size() + 16 * ids_.size(); }
+
+    // false if id isn't newer than everything in here, the caller has to
+    // drop the cache then. ids under from() aren't wanted.
+    bool append(long long id, const FieldsStructure &fields, size_t max_entries)
+    {
+        if (!ids_.empty() && id <= ids_.back())
+            return false;
+        if (id < from_)
+            return true;
+        ids_.push_back(id);
+        offsets_.push_back(bytes_.size());
+        resp_entry(bytes_, id, fields);
+        if (ids_.size() >= 2 * max_entries)
+        {
+            erase_(0, ids_.size() - max_entries);
+            from_ = ids_.front();
+        }
+        return true;
+    }
+
+    void erase(long long id)
+    {
+        size_t i = index_(id);
+        if (i < ids_.size() && ids_[i] == id)
+            erase_(i, i + 1);
+    }
+
+    // after a trim, only first_id..last_id is left in the stream
+    void keep(long long first_id, long long last_id)
+    {
+        erase_(index_(last_id + (last_id < LLONG_MAX)), ids_.size());
+        erase_(0, index_(first_id));
+    }
+
+    // appends the reply for start_id to the end of the stream, at most
+    // limit entries. false if this doesn't have all of it.
+    bool reply(long long start_id, size_t limit, std::string &out) const
+    {
+        if (start_id < from_)
+            return false;
+        size_t i = index_(start_id);
+        size_t n = std::min(limit, ids_.size() - i);
+        resp_header(out, '*', static_cast<long long>(n));
+        out.append(bytes_, offset_(i), offset_(i + n) - offset_(i));
+        return true;
+    }
+};
@@ -0,0 +1,147 @@
+// command traces for the load generator. a trace is every command a
+// session (or a bunch of clients) ran and when, so it can be replayed
+// against the engine later at the same or a faster pace.
+//
+// file layout, integers are LEB128 varints:
+//   magic    "RSTRACE1"
+//   records  delta us since the previous record, client id, token count,
+//            then length + bytes for every token
+//
+// times are deltas so a trace of a busy session is mostly one byte per
+// record of overhead on top of the tokens themselves.
+
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+struct traceRecord {
+    long long at_us = 0;  // since the start of the trace
+    uint32_t client = 0;  // records of one client replay in order on one thread
+    std::vector<std::string> toks;
+};
+
+class traceWriter {
+private:
+    FILE *file_ = nullptr;
+    std::string buffer_;
+    long long last_us_ = 0;
+
+    void varint_(uint64_t v) {
+        while (v >= 0x80) {
+            buffer_ += static_cast<char>(v | 0x80);
+            v >>= 7;
+        }
+        buffer_ += static_cast<char>(v);
+    }
+
+    bool drain_() {
+        if (!file_) return false;
+        bool ok = std::fwrite(buffer_.data(), 1, buffer_.size(), file_) == buffer_.size();
+        buffer_.clear();
+        return ok;
+    }
+
+public:
+    traceWriter() = default;
+    traceWriter(const traceWriter &) = delete;
+    traceWriter &operator=(const traceWriter &) = delete;
+    ~traceWriter() { close(); }
+
+    bool open(const std::string &path) {
+        close();
+        file_ = std::fopen(path.c_str(), "wb");
+        if (!file_) return false;
+        last_us_ = 0;
+        buffer_ = "RSTRACE1";
+        return true;
+    }
+
+    // records have to come in time order, one that's earlier than the last
+    // gets the last one's time
+    void add(const traceRecord &record) {
+        long long at = record.at_us > last_us_ ? record.at_us : last_us_;
+        varint_(static_cast<uint64_t>(at - last_us_));
+        last_us_ = at;
+        varint_(record.client);
+        varint_(record.toks.size());
+        for (const auto &tok : record.toks) {
+            varint_(tok.size());
+            buffer_ += tok;
+        }
+        if (buffer_.size() >= 1 << 16) drain_();
+    }
+
+    // false if anything failed to make it to the file
+    bool close() {
+        if (!file_) return true;
+        bool ok = drain_();
+        ok = std::fclose(file_) == 0 && ok;
+        file_ = nullptr;
+        return ok;
+    }
+};
+
+class traceReader {
+private:
+    FILE *file_ = nullptr;
+    long long last_us_ = 0;
+    bool bad_ = false;
+
+    bool varint_(uint64_t &v) {
+        v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            int c = std::getc(file_);
+            if (c == EOF) return false;
+            v |= static_cast<uint64_t>(c & 0x7f) << shift;
+            if (!(c & 0x80)) return true;
+        }
+        return false;
+    }
+
+public:
+    traceReader() = default;
+    traceReader(const traceReader &) = delete;
+    traceReader &operator=(const traceReader &) = delete;
+    ~traceReader() {
+        if (file_) std::fclose(file_);
+    }
+
+    // false if it can't be opened or isn't a trace
+    bool open(const std::string &path) {
+        file_ = std::fopen(path.c_str(), "rb");
+        if (!file_) return false;
+        char magic[8];
+        return std::fread(magic, 1, 8, file_) == 8 && std::string(magic, 8) == "RSTRACE1";
+    }
+
+    // false at the end, bad() tells a cut off or mangled record from that
+    bool next(traceRecord &record) {
+        uint64_t delta, client, count;
+        if (!file_ || !varint_(delta)) return false;
+        if (!varint_(client) || !varint_(count) || count > (1u << 20)) {
+            bad_ = true;
+            return false;
+        }
+        last_us_ += static_cast<long long>(delta);
+        record.at_us = last_us_;
+        record.client = static_cast<uint32_t>(client);
+        record.toks.resize(count);
+        for (auto &tok : record.toks) {
+            uint64_t size;
+            if (!varint_(size) || size > (1u << 30)) {
+                bad_ = true;
+                return false;
+            }
+            tok.resize(size);
+            if (size && std::fread(&tok[0], 1, size, file_) != size) {
+                bad_ = true;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool bad() const { return bad_; }
+};